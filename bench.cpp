@@ -0,0 +1,93 @@
+#include "template.h"
+
+// Benchmark runner: renders recorded camera paths through a set of levels and
+// writes frame times and ray counts to JSON, so runs can be compared across commits.
+// With --kernels it times the traversal kernels on synthetic worlds instead.
+// Built with HEADLESS defined, see CMakeLists.txt.
+
+static void Usage()
+{
+	printf( "usage: voxelrt_bench [options]\n"
+		"  --level <file>     add a level; may be repeated\n"
+		"  --no-default       leave out the default Perlin level\n"
+		"  --stream <MB>      stream the level files through a chunk cache of this size\n"
+		"  --no-prefetch      load streamed chunks only once rays ask for them\n"
+		"  --path <file>      add a camera path; may be repeated; default: an orbit around each level\n"
+		"  --frames <n>       frames in the orbit; default: 120\n"
+		"  --warmup <n>       unmeasured frames before each path; default: 5\n"
+		"  --json <file>      results file; default: benchmark.json\n"
+		"  --label <text>     stored in the results, e.g. a commit hash\n"
+		"  --layout <name>    grid layout: linear, morton, tiled4 or tiled8\n"
+		"  --palette          store the grid as 8-bit palette indices\n"
+		"  --octree, --dag    render from a sparse voxel octree, or a DAG\n"
+		"  --wavefront        wavefront path tracing\n"
+		"  --no-packets       trace primary rays one by one\n"
+		"  --pin              pin the job threads to cores\n"
+		"  --kernels          time the traversal kernels on synthetic worlds instead\n"
+		"  --size <n>         world size per axis for --kernels, a power of 2; default: 128\n" );
+}
+
+int main( int argc, char** argv )
+{
+	BenchmarkSettings settings;
+	bool defaultLevel = true, wavefront = false, packets = true, pin = false, kernels = false, json = false;
+	uint kernelWorldSize = 128;
+	vector<string> levels;
+	for (int i = 1; i < argc; i++)
+	{
+		const string arg = argv[i];
+		const bool more = i + 1 < argc;
+		if (arg == "--level" && more) levels.push_back( argv[++i] );
+		else if (arg == "--no-default") defaultLevel = false;
+		else if (arg == "--stream" && more) settings.streamCacheSize = max( 1, atoi( argv[++i] ) );
+		else if (arg == "--no-prefetch") settings.prefetch = false;
+		else if (arg == "--path" && more) settings.cameraPaths.push_back( argv[++i] );
+		else if (arg == "--frames" && more) settings.orbitFrames = max( 1, atoi( argv[++i] ) );
+		else if (arg == "--warmup" && more) settings.warmupFrames = max( 0, atoi( argv[++i] ) );
+		else if (arg == "--json" && more) settings.jsonFile = argv[++i], json = true;
+		else if (arg == "--label" && more) settings.label = argv[++i];
+		else if (arg == "--layout" && more)
+		{
+			const string name = argv[++i];
+			if (name == "linear") settings.layout = LinearLayout;
+			else if (name == "morton") settings.layout = MortonLayout;
+			else if (name == "tiled4") settings.layout = Tiled4Layout;
+			else if (name == "tiled8") settings.layout = Tiled8Layout;
+			else { printf( "unknown layout '%s'\n", name.c_str() ); return 1; }
+		}
+		else if (arg == "--palette") settings.format = Palette8;
+		else if (arg == "--octree") settings.backend = OctreeBackend, settings.dag = false;
+		else if (arg == "--dag") settings.backend = OctreeBackend, settings.dag = true;
+		else if (arg == "--wavefront") wavefront = true;
+		else if (arg == "--no-packets") packets = false;
+		else if (arg == "--pin") pin = true;
+		else if (arg == "--kernels") kernels = true;
+		else if (arg == "--size" && more) kernelWorldSize = (uint)max( 1, atoi( argv[++i] ) );
+		else { Usage(); return arg == "--help" ? 0 : 1; }
+	}
+	// same floating point mode as the interactive renderer: flush denormals to zero
+	_mm_setcsr( _mm_getcsr() | (_MM_FLUSH_ZERO_ON | _MM_DENORMALS_ZERO_ON) );
+	if (kernels)
+	{
+		Scene* scene = new Scene();
+		scene->SetGridLayout( settings.layout );
+		scene->SetGridFormat( settings.format );
+		BenchmarkTraversalKernels( *scene, make_uint3( kernelWorldSize ), json ? settings.jsonFile.c_str() : 0 );
+		return 0;
+	}
+
+	if (defaultLevel) settings.levels.push_back( "" );
+	settings.levels.insert( settings.levels.end(), levels.begin(), levels.end() );
+	if (settings.levels.empty()) { printf( "no levels to benchmark\n" ); return 1; }
+
+	Renderer* renderer = new Renderer();
+	Surface screen( RENDERWIDTH, RENDERHEIGHT );
+	renderer->screen = &screen;
+	renderer->wavefront = wavefront;
+	renderer->packetTracing = packets;
+	if (pin) Jobs().PinThreads( true );
+	const bool ok = RunBenchmarkSuite( *renderer, settings );
+	// the renderer is not deleted: its camera would overwrite camera.bin on destruction
+	renderer->screen = 0;
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,393 @@
+#include "template.h"
+
+static const char* layoutNames[] = { "linear", "morton", "tiled 4^3", "tiled 8^3" };
+
+// Rays towards the world from outside each of its six faces, plus rays in random
+// directions from random points inside it. Fixed seed, so every layout sees the same rays.
+static vector<Ray> CreateBenchmarkRays( const Scene& scene, const uint raysPerView )
+{
+	vector<Ray> rays;
+	const float3 center = scene.extent * 0.5f;
+	const float distance = 1.5f * max( scene.extent.x, max( scene.extent.y, scene.extent.z ) );
+	const uint side = (uint)sqrtf( (float)raysPerView );
+	uint seed = 0x12345678;
+	for (int view = 0; view < 6; view++)
+	{
+		float3 axis( 0 );
+		(&axis.x)[view >> 1] = (view & 1) ? 1.0f : -1.0f;
+		const float3 eye = center + axis * distance;
+		const float3 u = fabs( axis.y ) > 0.5f ? float3( 1, 0, 0 ) : float3( 0, 1, 0 );
+		const float3 v = cross( axis, u );
+		for (uint y = 0; y < side; y++) for (uint x = 0; x < side; x++)
+		{
+			const float fx = (float)x / side - 0.5f, fy = (float)y / side - 0.5f;
+			rays.push_back( Ray( eye, -axis + fx * u + fy * v ) );
+		}
+	}
+	for (uint i = 0; i < 6 * side * side; i++)
+	{
+		const float3 O = float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) * scene.extent;
+		const float3 D = float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) - 0.5f;
+		rays.push_back( Ray( O, D ) );
+	}
+	return rays;
+}
+
+// Shadow rays for the IsOccluded timings: each segment ends where its ray leaves the world,
+// so it crosses the voxels a ray towards a light outside the world would cross. Rays that
+// miss the world keep their length; IsOccluded rejects them in setup, as it would in a frame.
+static vector<Ray> CreateShadowRays( const Scene& scene, const vector<Ray>& rays )
+{
+	vector<Ray> shadowRays( rays );
+	for (Ray& r : shadowRays)
+	{
+		const float3 t1 = (float3( 0 ) - r.O) * r.rD, t2 = (scene.extent - r.O) * r.rD;
+		const float3 tnear = fminf( t1, t2 ), tfar = fmaxf( t1, t2 );
+		const float tmin = max( tnear.x, max( tnear.y, tnear.z ) ), tmax = min( tfar.x, min( tfar.y, tfar.z ) );
+		if (tmax >= max( tmin, 0.0f )) r.t = tmax;
+	}
+	return shadowRays;
+}
+
+void Tmpl8::BenchmarkGridLayouts( Scene& scene )
+{
+	if (!scene.HasGrid()) { printf("The level has no grid to benchmark\n"); return; }
+	const GridLayout originalLayout = scene.layout;
+	const vector<Ray> rays = CreateBenchmarkRays( scene, 256 * 256 ), shadowRays = CreateShadowRays( scene, rays );
+	const uint3 size = scene.size;
+	const uint randomReads = 1 << 22;
+	printf( "grid layout benchmark, %ux%ux%u voxels, %i rays, single thread\n", size.x, size.y, size.z, (int)rays.size() );
+	printf( "%-10s %10s %10s %10s %10s %10s %10s\n", "layout", "walk x", "walk y", "walk z", "random", "nearest", "occluded" );
+	for (int l = LinearLayout; l <= Tiled8Layout; l++)
+	{
+		scene.SetGridLayout( (GridLayout)l );
+		float ms[6];
+		uint sum = 0;
+		Timer t;
+		// walks through the whole grid with the given axis innermost
+		for (int a = 0; a < 3; a++)
+		{
+			t.reset();
+			const uint inner = (&size.x)[a], mid = (&size.x)[(a + 1) % 3], outer = (&size.x)[(a + 2) % 3];
+			for (uint k = 0; k < outer; k++) for (uint j = 0; j < mid; j++) for (uint i = 0; i < inner; i++)
+			{
+				uint3 p;
+				(&p.x)[a] = i, (&p.x)[(a + 1) % 3] = j, (&p.x)[(a + 2) % 3] = k;
+				sum += scene.GetMaterial( p.x, p.y, p.z );
+			}
+			ms[a] = t.elapsed() * 1000;
+		}
+		// scattered reads, as done by edits all over the level
+		uint seed = 0x87654321;
+		t.reset();
+		for (uint i = 0; i < randomReads; i++)
+			sum += scene.GetMaterial( RandomUInt( seed ) & (size.x - 1), RandomUInt( seed ) & (size.y - 1), RandomUInt( seed ) & (size.z - 1) );
+		ms[3] = t.elapsed() * 1000;
+		// ray queries; traversal runs on the occupancy masks, the grid is read on hits
+		t.reset();
+		for (const Ray& ray : rays) { Ray r = ray; scene.FindNearest( r ); sum += r.voxelKey; }
+		ms[4] = t.elapsed() * 1000;
+		t.reset();
+		for (const Ray& ray : shadowRays) { Ray r = ray; sum += scene.IsOccluded( r ); }
+		ms[5] = t.elapsed() * 1000;
+		printf( "%-10s %8.2fms %8.2fms %8.2fms %8.2fms %8.2fms %8.2fms (%u)\n", layoutNames[l], ms[0], ms[1], ms[2], ms[3], ms[4], ms[5], sum );
+	}
+	scene.SetGridLayout( originalLayout );
+}
+
+bool Tmpl8::LoadCameraPath( const char* file, vector<CameraPose>& path )
+{
+	FILE* f = fopen( file, "r" );
+	if (!f) { printf( "Could not open camera path %s\n", file ); return false; }
+	path.clear();
+	char line[256];
+	while (fgets( line, sizeof( line ), f ))
+	{
+		CameraPose pose;
+		if (line[0] == '#') continue;
+		if (sscanf( line, "%f %f %f %f %f %f", &pose.position.x, &pose.position.y, &pose.position.z, &pose.ahead.x, &pose.ahead.y, &pose.ahead.z ) == 6)
+			path.push_back( pose );
+	}
+	fclose( f );
+	if (path.empty()) printf( "Camera path %s has no poses\n", file );
+	return !path.empty();
+}
+
+bool Tmpl8::SaveCameraPath( const char* file, const vector<CameraPose>& path )
+{
+	FILE* f = fopen( file, "w" );
+	if (!f) { printf( "Could not write camera path %s\n", file ); return false; }
+	fprintf( f, "# camera path: position x y z, view direction x y z\n" );
+	for (const CameraPose& p : path)
+		fprintf( f, "%.9g %.9g %.9g %.9g %.9g %.9g\n", p.position.x, p.position.y, p.position.z, p.ahead.x, p.ahead.y, p.ahead.z );
+	fclose( f );
+	return true;
+}
+
+vector<CameraPose> Tmpl8::OrbitCameraPath( const Scene& scene, const int frames )
+{
+	vector<CameraPose> path;
+	const float3 center = scene.extent * 0.5f;
+	const float radius = 1.2f * max( scene.extent.x, scene.extent.z );
+	for (int i = 0; i < frames; i++)
+	{
+		const float a = 2 * PI * i / frames;
+		CameraPose pose;
+		pose.position = center + float3( radius * sinf( a ), 0.25f * scene.extent.y, -radius * cosf( a ) );
+		pose.ahead = normalize( center - pose.position );
+		path.push_back( pose );
+	}
+	return path;
+}
+
+// escape a file name for a JSON string
+static string JsonString( const string& s )
+{
+	string r = "\"";
+	for (const char c : s)
+	{
+		if (c == '"' || c == '\\') r += '\\';
+		r += c;
+	}
+	return r + "\"";
+}
+
+struct BenchmarkFrame
+{
+	float ms;
+	RayCounts rays;
+	uint chunkMisses;	// of a streamed level: chunks rays stepped into before they were loaded
+};
+
+// nearest-rank percentile of sorted frame times
+static float Percentile( const vector<float>& sorted, const float p )
+{
+	const int rank = (int)ceilf( p * sorted.size() );
+	return sorted[max( 0, min( rank, (int)sorted.size() ) - 1 )];
+}
+
+static void WriteRun( FILE* f, const string& level, const string& path, const vector<BenchmarkFrame>& frames )
+{
+	vector<float> ms;
+	double seconds = 0;
+	uint64_t primary = 0, shadow = 0, bounce = 0, chunkMisses = 0;
+	int missFrames = 0;
+	for (const BenchmarkFrame& frame : frames)
+	{
+		ms.push_back( frame.ms ), seconds += frame.ms * 0.001;
+		primary += frame.rays.primary, shadow += frame.rays.shadow, bounce += frame.rays.bounce;
+		chunkMisses += frame.chunkMisses, missFrames += frame.chunkMisses > 0;
+	}
+	sort( ms.begin(), ms.end() );
+	const double mrays = (primary + shadow + bounce) / (seconds * 1e6);
+	printf( "%-24s %-20s %5i frames  mean %7.2f  p50 %7.2f  p90 %7.2f  p99 %7.2f ms  %7.2f Mrays/s\n", level.c_str(), path.c_str(),
+		(int)frames.size(), (float)(seconds * 1000 / frames.size()), Percentile( ms, 0.5f ), Percentile( ms, 0.9f ), Percentile( ms, 0.99f ), mrays );
+	if (chunkMisses) printf( "%-45s %5i frames with chunk misses, %llu chunks missed\n", "", missFrames, (unsigned long long)chunkMisses );
+	fprintf( f, "    {\n      \"level\": %s,\n      \"cameraPath\": %s,\n", JsonString( level ).c_str(), JsonString( path ).c_str() );
+	fprintf( f, "      \"summary\": { \"frames\": %i, \"meanMs\": %.4f, \"minMs\": %.4f, \"p50Ms\": %.4f, \"p90Ms\": %.4f, \"p95Ms\": %.4f, \"p99Ms\": %.4f, \"maxMs\": %.4f,\n",
+		(int)frames.size(), seconds * 1000 / frames.size(), ms.front(), Percentile( ms, 0.5f ), Percentile( ms, 0.9f ), Percentile( ms, 0.95f ), Percentile( ms, 0.99f ), ms.back() );
+	fprintf( f, "        \"primaryRays\": %llu, \"shadowRays\": %llu, \"bounceRays\": %llu, \"mraysPerSecond\": %.4f, \"chunkMisses\": %llu, \"chunkMissFrames\": %i },\n",
+		(unsigned long long)primary, (unsigned long long)shadow, (unsigned long long)bounce, mrays, (unsigned long long)chunkMisses, missFrames );
+	fprintf( f, "      \"frames\": [\n" );
+	for (size_t i = 0; i < frames.size(); i++)
+		fprintf( f, "        { \"ms\": %.4f, \"primary\": %u, \"shadow\": %u, \"bounce\": %u, \"chunkMisses\": %u }%s\n", frames[i].ms,
+			frames[i].rays.primary, frames[i].rays.shadow, frames[i].rays.bounce, frames[i].chunkMisses, i + 1 < frames.size() ? "," : "" );
+	fprintf( f, "      ]\n    }" );
+}
+
+bool Tmpl8::RunBenchmarkSuite( Renderer& renderer, const BenchmarkSettings& settings )
+{
+	Scene& scene = renderer.scene;
+	Camera& camera = renderer.camera;
+	const CameraPose original = { camera.camPos, camera.camAhead };
+	FILE* f = fopen( settings.jsonFile.c_str(), "w" );
+	if (!f) { printf( "Could not write %s\n", settings.jsonFile.c_str() ); return false; }
+	fprintf( f, "{\n  \"label\": %s,\n  \"timestamp\": %llu,\n  \"threads\": %u,\n  \"resolution\": [%i, %i],\n", JsonString( settings.label ).c_str(), (unsigned long long)time( 0 ), Jobs().ThreadCount(), RENDERWIDTH, RENDERHEIGHT );
+	fprintf( f, "  \"settings\": { \"backend\": \"%s\", \"layout\": \"%s\", \"palette\": %s, \"wavefront\": %s, \"packets\": %s, \"warmupFrames\": %i, \"streamCacheMB\": %i, \"prefetch\": %s },\n",
+		settings.backend == OctreeBackend ? (settings.dag ? "dag" : "octree") : "grid", layoutNames[settings.layout], settings.format == Palette8 ? "true" : "false",
+		renderer.wavefront ? "true" : "false", renderer.packetTracing ? "true" : "false", settings.warmupFrames,
+		settings.streamCacheSize, settings.prefetch ? "true" : "false" );
+	fprintf( f, "  \"runs\": [\n" );
+	bool ok = true, first = true;
+	renderer.prefetchChunks = settings.prefetch;
+	for (const string& level : settings.levels)
+	{
+		// the default level has no file to stream from
+		const bool stream = settings.streamCacheSize > 0 && !level.empty();
+		if (level.empty()) scene.LoadDefaultLevel();
+		else if (!(stream ? scene.StreamLevelFromFile( level.c_str(), (size_t)settings.streamCacheSize << 20 ) : scene.LoadLevelFromFile( level.c_str() ))) { ok = false; continue; }
+		scene.SetGridLayout( settings.layout );
+		scene.SetGridFormat( settings.format );
+		if (settings.backend == OctreeBackend && !stream) scene.BuildOctree( settings.dag );
+		vector<pair<string, vector<CameraPose>>> paths;
+		for (const string& file : settings.cameraPaths)
+		{
+			vector<CameraPose> path;
+			if (LoadCameraPath( file.c_str(), path )) paths.push_back( make_pair( file, path ) ); else ok = false;
+		}
+		if (settings.cameraPaths.empty()) paths.push_back( make_pair( string( "orbit" ), OrbitCameraPath( scene, settings.orbitFrames ) ) );
+		for (const auto& path : paths)
+		{
+			vector<BenchmarkFrame> frames;
+			renderer.imageAccumulationIndex = 0;
+			for (int i = -settings.warmupFrames; i < (int)path.second.size(); i++)
+			{
+				const CameraPose& pose = path.second[max( i, 0 )];
+				camera.camPos = pose.position, camera.camAhead = normalize( pose.ahead );
+				camera.UpdateFrustum();
+				Timer t;
+				renderer.RenderFrame();
+				const float ms = t.elapsed() * 1000;
+				// the chunks this frame missed, and the next frame's loads
+				renderer.StreamChunks();
+				if (i >= 0) frames.push_back( BenchmarkFrame{ ms, renderer.frameRays, scene.stream ? scene.stream->stats.misses : 0 } );
+			}
+			if (!first) fprintf( f, ",\n" );
+			WriteRun( f, level.empty() ? "default" : level, path.first, frames );
+			first = false;
+		}
+	}
+	fprintf( f, "\n  ]\n}\n" );
+	fclose( f );
+	camera.camPos = original.position, camera.camAhead = original.ahead;
+	camera.UpdateFrustum();
+	printf( "Benchmark results written to %s\n", settings.jsonFile.c_str() );
+	return ok;
+}
+
+// Synthetic worlds for the traversal microbenchmarks; 'param' is the noise
+// threshold for Perlin worlds
+enum SyntheticWorld { EmptyWorld, SolidWorld, PerlinWorld, ShellWorld };
+
+static float BuildSyntheticWorld( Scene& scene, const SyntheticWorld world, const float param )
+{
+	const uint3 size = scene.size;
+	const float3 center = make_float3( size ) * 0.5f;
+	// a sphere one voxel thick, centered in the world
+	const float radius = 0.4f * min( size.x, min( size.y, size.z ) );
+	uint solid = 0;
+	scene.BeginBulkEdit();
+	Jobs().ParallelFor( 0, (int)size.z, [&]( int z )
+	{
+		uint count = 0;
+		for (uint y = 0; y < size.y; y++) for (uint x = 0; x < size.x; x++)
+		{
+			bool set = world == SolidWorld;
+			if (world == PerlinWorld) set = noise3D( x * scene.cellSize, y * scene.cellSize, z * scene.cellSize ) > param;
+			if (world == ShellWorld) set = fabs( length( make_float3( (float)x, (float)y, (float)z ) + 0.5f - center ) - radius ) < 0.5f;
+			scene.SetMaterial( x, y, z, set ? 1 : NOMATERIALKEY );
+			count += set;
+		}
+		AtomicAdd( solid, (int)count );
+	} );
+	scene.EndBulkEdit();
+	return (float)solid / ((float)size.x * size.y * size.z);
+}
+
+// Ray sets for the microbenchmarks. Fixed seeds, so runs can be compared.
+enum RayDistribution { CoherentRays, RandomRays, GrazingRays };
+
+static vector<Ray> CreateRayDistribution( const Scene& scene, const RayDistribution distribution, const uint count )
+{
+	vector<Ray> rays;
+	const float3 center = scene.extent * 0.5f;
+	uint seed = 0x2468ace1;
+	if (distribution == CoherentRays)
+	{
+		// a pinhole camera outside the world, looking at its center; scanline order,
+		// so each group of MAXPACKETSIZE rays is a row of neighbouring pixels
+		const uint side = (uint)sqrtf( (float)count );
+		const float3 eye = center + float3( 0.3f, 0.4f, -1.2f ) * max( scene.extent.x, max( scene.extent.y, scene.extent.z ) );
+		const float3 ahead = normalize( center - eye ), right = normalize( cross( float3( 0, 1, 0 ), ahead ) ), up = cross( ahead, right );
+		for (uint y = 0; y < side; y++) for (uint x = 0; x < side; x++)
+			rays.push_back( Ray( eye, ahead + ((float)x / side - 0.5f) * right + ((float)y / side - 0.5f) * up ) );
+	}
+	else if (distribution == RandomRays)
+	{
+		// random origins inside the world, random directions: bounce and shadow rays
+		for (uint i = 0; i < count; i++)
+		{
+			const float3 O = float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) * scene.extent;
+			rays.push_back( Ray( O, float3( RandomFloat( seed ), RandomFloat( seed ), RandomFloat( seed ) ) - 0.5f ) );
+		}
+	}
+	else
+	{
+		// from just outside the -x face, almost parallel to it: long walks along an axis
+		for (uint i = 0; i < count; i++)
+		{
+			const float3 O( -0.01f, RandomFloat( seed ) * scene.extent.y, RandomFloat( seed ) * scene.extent.z );
+			rays.push_back( Ray( O, float3( 1, (RandomFloat( seed ) - 0.5f) * 0.02f, (RandomFloat( seed ) - 0.5f) * 0.02f ) ) );
+		}
+	}
+	return rays;
+}
+
+void Tmpl8::BenchmarkTraversalKernels( Scene& scene, const uint3& worldSize, const char* jsonFile )
+{
+	const GridLayout layout = scene.layout;
+	if (!scene.Resize( worldSize )) return;
+	scene.SetGridLayout( layout );
+	const struct { SyntheticWorld world; float param; const char* name; } worlds[] = {
+		{ EmptyWorld, 0, "empty" }, { SolidWorld, 0, "solid" },
+		{ PerlinWorld, 0.05f, "perlin 0.05" }, { PerlinWorld, 0.09f, "perlin 0.09" }, { PerlinWorld, 0.12f, "perlin 0.12" },
+		{ ShellWorld, 0, "shell" } };
+	const char* distributionNames[] = { "coherent", "random", "grazing" };
+	const char* kernelNames[] = { "Ray::Ray", "Setup3DDDA", "FindNearest", "FindNearest x8", "IsOccluded" };
+	const uint rayCount = 1 << 18;
+	FILE* f = jsonFile ? fopen( jsonFile, "w" ) : 0;
+	if (jsonFile && !f) printf( "Could not write %s\n", jsonFile );
+	if (f) fprintf( f, "{\n  \"world\": [%u, %u, %u],\n  \"layout\": \"%s\",\n  \"raysPerSet\": %u,\n  \"results\": [\n",
+		worldSize.x, worldSize.y, worldSize.z, layoutNames[layout], rayCount );
+	printf( "traversal kernels, %ux%ux%u voxels, %s layout, %u rays per set, single thread, ns per ray (best of 3)\n",
+		worldSize.x, worldSize.y, worldSize.z, layoutNames[layout], rayCount );
+	printf( "%-13s %6s %-9s %10s %10s %12s %14s %10s\n", "world", "fill", "rays", kernelNames[0], kernelNames[1], kernelNames[2], kernelNames[3], kernelNames[4] );
+	bool first = true;
+	for (const auto& w : worlds)
+	{
+		const float fill = BuildSyntheticWorld( scene, w.world, w.param );
+		for (int d = CoherentRays; d <= GrazingRays; d++)
+		{
+			const vector<Ray> rays = CreateRayDistribution( scene, (RayDistribution)d, rayCount ), shadowRays = CreateShadowRays( scene, rays );
+			const uint n = (uint)rays.size();
+			vector<Ray> work( n );
+			float ns[5];
+			// the checksum is printed, so the compiler can't drop the work
+			uint sum = 0;
+			for (int k = 0; k < 5; k++)
+			{
+				float best = 1e30f;
+				for (int run = 0; run < 3; run++)
+				{
+					Timer t;
+					if (k == 0) for (uint i = 0; i < n; i++) { work[i] = Ray( rays[i].O, rays[i].D ); sum += work[i].Dsign.x > 0; }
+					if (k == 1) for (uint i = 0; i < n; i++) { Ray r = rays[i]; Scene::DDAState s; sum += scene.Setup3DDDA( r, s ) ? s.X : 0; }
+					if (k == 2) for (uint i = 0; i < n; i++) { Ray r = rays[i]; scene.FindNearest( r ); sum += r.voxelKey; }
+					if (k == 3)
+					{
+						memcpy( work.data(), rays.data(), n * sizeof( Ray ) );
+						for (uint i = 0; i < n; i += MAXPACKETSIZE) scene.FindNearest( work.data() + i, min( n - i, (uint)MAXPACKETSIZE ) );
+						sum += work[n - 1].voxelKey;
+					}
+					if (k == 4) for (uint i = 0; i < n; i++) { Ray r = shadowRays[i]; sum += scene.IsOccluded( r ); }
+					best = min( best, t.elapsed() );
+				}
+				ns[k] = best * 1e9f / n;
+			}
+			printf( "%-13s %5.1f%% %-9s %10.2f %10.2f %12.2f %14.2f %10.2f (%u)\n", w.name, fill * 100, distributionNames[d], ns[0], ns[1], ns[2], ns[3], ns[4], sum );
+			if (!f) continue;
+			for (int k = 0; k < 5; k++)
+			{
+				fprintf( f, "%s    { \"world\": \"%s\", \"fill\": %.6f, \"rays\": \"%s\", \"kernel\": \"%s\", \"nsPerRay\": %.3f, \"mraysPerSecond\": %.3f }",
+					first ? "" : ",\n", w.name, fill, distributionNames[d], kernelNames[k], ns[k], 1000.0f / ns[k] );
+				first = false;
+			}
+		}
+	}
+	if (f)
+	{
+		fprintf( f, "\n  ]\n}\n" );
+		fclose( f );
+		printf( "Results written to %s\n", jsonFile );
+	}
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+namespace Tmpl8 {
+
+class Renderer;
+
+// Time grid reads and ray queries on the current level for every grid layout,
+// print a table and restore the layout the scene had.
+void BenchmarkGridLayouts( Scene& scene );
+
+// One camera pose per frame. Paths are text files with a line per frame:
+// position x y z, view direction x y z; lines starting with '#' are comments.
+struct CameraPose
+{
+	float3 position, ahead;
+};
+bool LoadCameraPath( const char* file, vector<CameraPose>& path );
+bool SaveCameraPath( const char* file, const vector<CameraPose>& path );
+// a full circle around the world, looking at its center
+vector<CameraPose> OrbitCameraPath( const Scene& scene, const int frames );
+
+struct BenchmarkSettings
+{
+	vector<string> levels;			// level files; an empty name is the default Perlin level
+	vector<string> cameraPaths;		// camera path files; without any, every level gets an orbit
+	int orbitFrames = 120;
+	int warmupFrames = 5;			// rendered at the first pose of each path, not measured
+	SceneBackend backend = GridBackend;
+	bool dag = true;				// for the octree backend
+	GridLayout layout = LinearLayout;
+	GridFormat format = Keys16;
+	int streamCacheSize = 0;		// MB; level files are streamed through a chunk cache this size instead of loaded
+	bool prefetch = true;			// for streamed levels, see ChunkPrefetcher
+	string jsonFile = "benchmark.json";
+	string label;					// stored in the results, e.g. the commit that was measured
+};
+
+// Render every camera path in every level, print a summary per run and write
+// all frame times and ray counts, and for streamed levels the chunks that rays
+// missed, to settings.jsonFile. Renderer options such as
+// wavefront and packetTracing are used as they are set.
+bool RunBenchmarkSuite( Renderer& renderer, const BenchmarkSettings& settings );
+
+// Time Ray::Ray, Setup3DDDA, FindNearest (scalar and packet) and IsOccluded on
+// synthetic worlds of 'worldSize' voxels (empty, solid, Perlin noise at several
+// thresholds, a thin spherical shell), with coherent, random and grazing rays.
+// Single threaded, in the scene's current layout; the scene's level is replaced.
+// Prints a table and, if 'jsonFile' is given, writes the results to it.
+void BenchmarkTraversalKernels( Scene& scene, const uint3& worldSize, const char* jsonFile = 0 );
+
+} // namespace Tmpl8
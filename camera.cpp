@@ -24,6 +24,7 @@ Camera::~Camera()
 {
 	// save current camera
 	FILE* f = fopen( "camera.bin", "wb" );
+	if (!f) return;
 	fwrite( this, 1, sizeof( Camera ), f );
 	fclose( f );
 }
@@ -44,6 +45,9 @@ Ray Camera::GetPrimaryRay(const float x, const float y)
 
 bool Camera::HandleInput(const float dt, const int2& mouseMovement)
 {
+#ifdef HEADLESS
+	return false; // no keyboard
+#else
 	if (!WindowHasFocus()) return false;
 	
 	float dmove = speed * dt;
@@ -65,19 +69,35 @@ bool Camera::HandleInput(const float dt, const int2& mouseMovement)
 	
 	if (IsKeyDown( GLFW_KEY_A )) camPos -= dmove * right, changed = true;
 	if (IsKeyDown( GLFW_KEY_D )) camPos += dmove * right, changed = true;
-	if (GetAsyncKeyState( 'W' )) camPos += dmove * camAhead, changed = true;
+	if (IsKeyDown( GLFW_KEY_W )) camPos += dmove * camAhead, changed = true;
 	if (IsKeyDown( GLFW_KEY_S )) camPos -= dmove * camAhead, changed = true;
 	if (IsKeyDown( GLFW_KEY_E )) camPos += dmove * tmpUp, changed = true;
 	if (IsKeyDown( GLFW_KEY_Q )) camPos -= dmove * tmpUp, changed = true;
 	
 	
-	topLeft = camPos + 2 * camAhead - aspect * right + up;
-	topRight = camPos + 2 * camAhead + aspect * right + up;
-	bottomLeft = camPos + 2 * camAhead - aspect * right - up;
+	UpdateFrustum();
 
 	//camAhead = normalize(camAhead + sensitivity * mouseMovement.x * right);
 	//camAhead = normalize(camAhead + sensitivity * mouseMovement.y * up);
 
 
 	return changed;
+#endif
+}
+
+void Camera::LookAt(const float3& position, const float3& target)
+{
+	camPos = position;
+	camAhead = normalize(target - position);
+	UpdateFrustum();
+}
+
+void Camera::UpdateFrustum()
+{
+	const float3 tmpUp( 0, 1, 0 );
+	const float3 right = normalize(cross(tmpUp, camAhead));
+	const float3 up = normalize(cross(camAhead, right));
+	topLeft = camPos + 2 * camAhead - aspect * right + up;
+	topRight = camPos + 2 * camAhead + aspect * right + up;
+	bottomLeft = camPos + 2 * camAhead - aspect * right - up;
 }
\ No newline at end of file
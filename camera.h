@@ -15,6 +15,8 @@ public:
 	~Camera();
 	Ray GetPrimaryRay(const float x, const float y);
 	bool HandleInput(const float dt, const int2& mouseMovement);
+	void LookAt(const float3& position, const float3& target);
+	void UpdateFrustum(); // after changing camPos or camAhead
 
 	const float aspect = (float)RENDERWIDTH / (float)RENDERHEIGHT;
 	float3 camPos, camAhead;
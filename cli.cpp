@@ -0,0 +1,206 @@
+#include "template.h"
+
+// Command line renderer, for machines without a display. Loads a level, renders
+// a number of frames from a fixed camera, and writes the images and timings.
+// Built with HEADLESS defined, see CMakeLists.txt.
+
+static void Usage()
+{
+	printf( "usage: voxelrt_cli [options]\n"
+		"  --level <file>               level to render; default: the generated default level\n"
+		"  --stream <MB>                stream the level from its file through a chunk cache of this size\n"
+		"  --no-prefetch                load streamed chunks only once rays ask for them\n"
+		"  --generate <file> x y z      first write the default level at this size to a file, chunk by chunk\n"
+		"  --import <file> x y z        place a voxel model (assets/*.bin or .vox) at x y z; may be repeated\n"
+		"  --turns <n>                  quarter turns about the y axis for the models imported after it\n"
+		"  --save <file>                save the level first; with --mappable uncompressed, for memory mapped loading\n"
+		"  --frames <n>                 number of frames to render; default: 1\n"
+		"  --camera px py pz tx ty tz   camera position and target; default: camera.bin, if present\n"
+		"  --out <prefix>               write each frame to <prefix>0000.ppm, <prefix>0001.ppm, ...\n"
+		"  --timings <file>             write per-frame timings as CSV\n"
+		"  --trace <file>               write a Chrome trace of all frames, for chrome://tracing or Perfetto\n"
+		"  --accumulate                 blend the frames, as the interactive renderer does for a still camera\n"
+		"  --layout <name>              grid layout: linear, morton, tiled4 or tiled8\n"
+		"  --palette                    store the grid as 8-bit palette indices\n"
+		"  --octree, --dag              render from a sparse voxel octree, or a DAG\n"
+		"  --heatmap <cost>             colour pixels by their cost: steps, shadows or bounces\n"
+		"  --wavefront                  wavefront path tracing\n"
+		"  --no-packets                 trace primary rays one by one\n"
+		"  --pin                        pin the job threads to cores\n" );
+}
+
+static bool WritePPM( const Surface& surface, const char* file )
+{
+	FILE* f = fopen( file, "wb" );
+	if (!f) return false;
+	fprintf( f, "P6\n%i %i\n255\n", surface.width, surface.height );
+	vector<uchar> row( surface.width * 3 );
+	for (int y = 0; y < surface.height; y++)
+	{
+		for (int x = 0; x < surface.width; x++)
+		{
+			const uint c = surface.pixels[x + y * surface.width];
+			row[x * 3 + 0] = (uchar)(c >> 16), row[x * 3 + 1] = (uchar)(c >> 8), row[x * 3 + 2] = (uchar)c;
+		}
+		fwrite( row.data(), 1, row.size(), f );
+	}
+	fclose( f );
+	return true;
+}
+
+int main( int argc, char** argv )
+{
+	const char* level = 0, *save = 0, *out = 0, *timings = 0, *trace = 0, *generate = 0;
+	int frames = 1, streamCacheSize = 0;
+	uint3 generateSize;
+	bool mappable = false, palette = false, prefetch = true, setCamera = false, accumulate = false, wavefront = false, packets = true, octree = false, dag = false, pin = false;
+	float3 position, target;
+	struct Import { const char* file; int3 offset; int turns; };
+	vector<Import> imports;
+	int turns = 0;
+	GridLayout layout = LinearLayout;
+	HeatmapMode heatmap = HeatmapOff;
+	for (int i = 1; i < argc; i++)
+	{
+		const string arg = argv[i];
+		const int left = argc - 1 - i;
+		if (arg == "--level" && left >= 1) level = argv[++i];
+		else if (arg == "--stream" && left >= 1) streamCacheSize = max( 1, atoi( argv[++i] ) );
+		else if (arg == "--no-prefetch") prefetch = false;
+		else if (arg == "--generate" && left >= 4)
+		{
+			generate = argv[i + 1];
+			generateSize = make_uint3( (uint)atoi( argv[i + 2] ), (uint)atoi( argv[i + 3] ), (uint)atoi( argv[i + 4] ) );
+			i += 4;
+		}
+		else if (arg == "--import" && left >= 4)
+		{
+			imports.push_back( Import{ argv[i + 1], make_int3( atoi( argv[i + 2] ), atoi( argv[i + 3] ), atoi( argv[i + 4] ) ), turns } );
+			i += 4;
+		}
+		else if (arg == "--turns" && left >= 1) turns = atoi( argv[++i] );
+		else if (arg == "--save" && left >= 1) save = argv[++i];
+		else if (arg == "--mappable") mappable = true;
+		else if (arg == "--frames" && left >= 1) frames = max( 1, atoi( argv[++i] ) );
+		else if (arg == "--camera" && left >= 6)
+		{
+			position.x = (float)atof( argv[i + 1] ), position.y = (float)atof( argv[i + 2] ), position.z = (float)atof( argv[i + 3] );
+			target.x = (float)atof( argv[i + 4] ), target.y = (float)atof( argv[i + 5] ), target.z = (float)atof( argv[i + 6] );
+			setCamera = true, i += 6;
+		}
+		else if (arg == "--out" && left >= 1) out = argv[++i];
+		else if (arg == "--timings" && left >= 1) timings = argv[++i];
+		else if (arg == "--trace" && left >= 1) trace = argv[++i];
+		else if (arg == "--accumulate") accumulate = true;
+		else if (arg == "--layout" && left >= 1)
+		{
+			const string name = argv[++i];
+			if (name == "linear") layout = LinearLayout;
+			else if (name == "morton") layout = MortonLayout;
+			else if (name == "tiled4") layout = Tiled4Layout;
+			else if (name == "tiled8") layout = Tiled8Layout;
+			else { printf( "unknown layout '%s'\n", name.c_str() ); return 1; }
+		}
+		else if (arg == "--palette") palette = true;
+		else if (arg == "--heatmap" && left >= 1)
+		{
+			const string name = argv[++i];
+			if (name == "steps") heatmap = HeatmapDDASteps;
+			else if (name == "shadows") heatmap = HeatmapShadowRays;
+			else if (name == "bounces") heatmap = HeatmapBounces;
+			else { printf( "unknown heatmap '%s'\n", name.c_str() ); return 1; }
+		}
+		else if (arg == "--octree") octree = true;
+		else if (arg == "--dag") octree = dag = true;
+		else if (arg == "--wavefront") wavefront = true;
+		else if (arg == "--no-packets") packets = false;
+		else if (arg == "--pin") pin = true;
+		else { Usage(); return arg == "--help" ? 0 : 1; }
+	}
+
+	// same floating point mode as the interactive renderer: flush denormals to zero
+	_mm_setcsr( _mm_getcsr() | (_MM_FLUSH_ZERO_ON | _MM_DENORMALS_ZERO_ON) );
+	// the renderer generates the default level on construction
+	Renderer* renderer = new Renderer();
+	Surface screen( RENDERWIDTH, RENDERHEIGHT );
+	memset( screen.pixels, 0, RENDERWIDTH * RENDERHEIGHT * sizeof( uint ) );
+	renderer->screen = &screen;
+	Scene& scene = renderer->scene;
+	if (generate)
+	{
+		Timer t;
+		if (!Scene::GenerateLevelFile( generate, generateSize )) return 1;
+		printf( "generated %s in %.1f s\n", generate, t.elapsed() );
+	}
+	if (level && !(streamCacheSize ? scene.StreamLevelFromFile( level, (size_t)streamCacheSize << 20 ) : scene.LoadLevelFromFile( level ))) return 1;
+	for (const Import& model : imports) if (!ImportVoxelModel( scene, model.file, model.offset, model.turns )) return 1;
+	if (save && !scene.SaveLevelToFile( save, mappable )) return 1;
+	if (layout != LinearLayout) scene.SetGridLayout( layout );
+	if (palette) scene.SetGridFormat( Palette8 );
+	if (octree) scene.BuildOctree( dag );
+	if (setCamera) renderer->camera.LookAt( position, target );
+	else renderer->camera.UpdateFrustum();
+	renderer->wavefront = wavefront;
+	renderer->packetTracing = packets;
+	renderer->heatmap = heatmap;
+	renderer->prefetchChunks = prefetch;
+	if (pin) Jobs().PinThreads( true );
+	printf( "%ux%ux%u voxels, %s, %u threads, %ix%i pixels\n", scene.size.x, scene.size.y, scene.size.z,
+		scene.backend == OctreeBackend ? (dag ? "DAG" : "octree") : scene.backend == StreamBackend ? "streamed" : scene.paletteGrid ? "8-bit grid" : "grid", Jobs().ThreadCount(), RENDERWIDTH, RENDERHEIGHT );
+	const float3 viewpoint = renderer->camera.camPos / scene.cellSize;
+	if (scene.stream)
+	{
+		// the interactive renderer shows the chunks as they arrive; here the frames wait
+		// until all chunks in view are in the cache, or the cache is full
+		Timer t;
+		do renderer->RenderFrame(), scene.stream->Update( viewpoint, true );
+		while (scene.stream->Loading() && scene.stream->stats.evicted == 0);
+		printf( "streamed in %llu chunks in %.1f ms\n", (unsigned long long)scene.stream->stats.loaded, t.elapsed() * 1000 );
+	}
+
+	FILE* csv = timings ? fopen( timings, "w" ) : 0;
+	if (timings && !csv) printf( "could not write %s\n", timings );
+	if (csv) fprintf( csv, "frame,ms,primary,shadow,bounce,ddaSteps,lightEvaluations,materialLookups\n" );
+	// the level load and setup above count as a frame of their own
+	Profile().EndFrame();
+	if (trace) Profile().CaptureTrace( trace, frames );
+	float total = 0, best = 1e30f, worst = 0;
+	uint64_t rays = 0;
+	for (int frame = 0; frame < frames; frame++)
+	{
+		renderer->imageAccumulationIndex = accumulate && frame > 0 ? ACCUMULATION_INDEX : 0.0f;
+		Timer t;
+		renderer->RenderFrame();
+		const float ms = t.elapsed() * 1000;
+		const RayCounts& counts = renderer->frameRays;
+		total += ms, best = min( best, ms ), worst = max( worst, ms ), rays += counts.Total();
+		printf( "frame %i: %.2f ms, %u rays (%u primary, %u shadow, %u bounce)\n", frame, ms, counts.Total(), counts.primary, counts.shadow, counts.bounce );
+		const uint64_t* counters = Profile().frame.counters;
+		if (heatmap) printf( "  per pixel: mean %.1f, 99th percentile %u, max %u\n", renderer->heatmapMean, renderer->heatmapP99, renderer->heatmapMax );
+		if (scene.stream)
+		{
+			renderer->StreamChunks();
+			printf( "  chunks: %u hit, %u missed\n", scene.stream->stats.hits, scene.stream->stats.misses );
+		}
+		if (csv) fprintf( csv, "%i,%.3f,%u,%u,%u,%llu,%llu,%llu\n", frame, ms, counts.primary, counts.shadow, counts.bounce,
+			(unsigned long long)counters[DDASteps], (unsigned long long)counters[LightEvaluations], (unsigned long long)counters[MaterialLookups] );
+		if (out)
+		{
+			char file[1024];
+			snprintf( file, sizeof( file ), "%s%04i.ppm", out, frame );
+			if (!WritePPM( screen, file )) printf( "could not write %s\n", file );
+		}
+	}
+	if (csv) fclose( csv );
+	printf( "%i frames: average %.2f ms, best %.2f ms, worst %.2f ms, %.1f Mrays/s\n",
+		frames, total / frames, best, worst, rays / (total * 1000.0f) );
+	if (scene.stream)
+	{
+		const StreamedWorld::Stats& stats = scene.stream->stats;
+		printf( "chunks: %llu loaded, %llu evicted; %llu prefetched, %llu used, %llu evicted unused\n", (unsigned long long)stats.loaded,
+			(unsigned long long)stats.evicted, (unsigned long long)stats.prefetched, (unsigned long long)stats.prefetchUsed, (unsigned long long)stats.prefetchWasted );
+	}
+	// the renderer is not deleted: its camera would overwrite camera.bin on destruction
+	renderer->screen = 0;
+	return 0;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+// Building blocks for the Amanatides & Woo traversal, shared by the grid and the octree.
+
+inline uint log2_pow2( uint v )
+{
+	uint n = 0;
+	while (v > 1) v >>= 1, n++;
+	return n;
+}
+
+// Step one axis of the DDA across all cell boundaries it passes before 'te', but
+// at most 'n' of them. Closed form with an exact fix-up, so large jumps are cheap.
+inline void advance_axis( uint& X, float& tmax, const int step, const float tdelta, const float te, const uint n )
+{
+	if (!(tmax < te)) return;
+	uint k = min( n, (uint)((te - tmax) / tdelta) + 1 );
+	while (k > 0 && tmax + (k - 1) * tdelta >= te) k--;
+	while (k < n && tmax + k * tdelta < te) k++;
+	X += k * step, tmax += k * tdelta;
+}
+
+// Advance the DDA to the first cell beyond the empty, axis-aligned box of cells
+// [lo..hi] that contains the current cell. The minor axes are stepped up to the
+// exit point, the major axis crosses the box boundary. Returns false if the ray
+// leaves the grid of 'size' cells.
+inline bool skip_empty_box( Scene::DDAState& s, const uint3& lo, const uint3& hi, const uint3& size, uint& axis )
+{
+	const uint nx = s.step.x > 0 ? hi.x - s.X : s.X - lo.x;
+	const uint ny = s.step.y > 0 ? hi.y - s.Y : s.Y - lo.y;
+	const uint nz = s.step.z > 0 ? hi.z - s.Z : s.Z - lo.z;
+	// note: n == 0 is special-cased to avoid 0 * inf for axis-parallel rays
+	const float ex = nx ? s.tmax.x + nx * s.tdelta.x : s.tmax.x;
+	const float ey = ny ? s.tmax.y + ny * s.tdelta.y : s.tmax.y;
+	const float ez = nz ? s.tmax.z + nz * s.tdelta.z : s.tmax.z;
+	if (ex < ey && ex < ez)
+	{
+		advance_axis( s.Y, s.tmax.y, s.step.y, s.tdelta.y, ex, ny );
+		advance_axis( s.Z, s.tmax.z, s.step.z, s.tdelta.z, ex, nz );
+		s.t = ex, s.X += (nx + 1) * s.step.x, axis = 0;
+		if (s.X >= size.x) return false;
+		s.tmax.x = ex + s.tdelta.x;
+	}
+	else if (ey < ez)
+	{
+		advance_axis( s.X, s.tmax.x, s.step.x, s.tdelta.x, ey, nx );
+		advance_axis( s.Z, s.tmax.z, s.step.z, s.tdelta.z, ey, nz );
+		s.t = ey, s.Y += (ny + 1) * s.step.y, axis = 1;
+		if (s.Y >= size.y) return false;
+		s.tmax.y = ey + s.tdelta.y;
+	}
+	else
+	{
+		advance_axis( s.X, s.tmax.x, s.step.x, s.tdelta.x, ez, nx );
+		advance_axis( s.Y, s.tmax.y, s.step.y, s.tdelta.y, ez, ny );
+		s.t = ez, s.Z += (nz + 1) * s.step.z, axis = 2;
+		if (s.Z >= size.z) return false;
+		s.tmax.z = ez + s.tdelta.z;
+	}
+	return true;
+}
+
+// Skip the empty, aligned block of 'blockSize' (power of 2) cells around the current cell.
+inline bool skip_empty_block( Scene::DDAState& s, const uint blockSize, const uint3& size, uint& axis )
+{
+	const uint3 lo = make_uint3( s.X & ~(blockSize - 1), s.Y & ~(blockSize - 1), s.Z & ~(blockSize - 1) );
+	return skip_empty_box( s, lo, lo + (blockSize - 1), size, axis );
+}
@@ -0,0 +1,43 @@
+#include "template.h"
+
+LevelLoader::~LevelLoader()
+{
+	if (worker.joinable()) worker.join();
+	delete loading.load();
+}
+
+bool LevelLoader::Start( const char* filepath, const GridLayout layout, const GridFormat format )
+{
+	if (busy) return false;
+	file = filepath, busy = true, finished = false;
+	worker = thread( [this, layout, format]()
+	{
+		// parallel loops in here run as background jobs, see JobSystem::ParallelFor
+		Scene* scene = new Scene( false );
+		scene->SetGridLayout( layout );
+		scene->SetGridFormat( format );
+		scene->loadProgress = 0;
+		loading = scene;
+		loaded = scene->LoadLevelFromFile( file.c_str() );
+		finished = true;
+	} );
+	return true;
+}
+
+float LevelLoader::Progress() const
+{
+	const Scene* scene = loading.load();
+	return scene ? scene->loadProgress.load() : 0;
+}
+
+bool LevelLoader::Finish( Scene& scene, bool& success )
+{
+	if (!finished) return false;
+	worker.join();
+	success = loaded;
+	if (success) scene.Swap( *loading );
+	// after a swap, this is the old level
+	delete loading.load();
+	loading = 0, busy = false, finished = false;
+	return true;
+}
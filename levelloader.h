@@ -0,0 +1,30 @@
+#pragma once
+
+namespace Tmpl8 {
+
+// Loads a level into a fresh Scene on a thread of its own, while the current scene
+// keeps rendering. Once Done, Finish swaps the new level into the scene that is
+// rendered; call it at a frame boundary, when no jobs use that scene. Until then,
+// the old and the new level both take up memory.
+class LevelLoader
+{
+public:
+	~LevelLoader();	// waits for a load in progress
+	// false if a load is still in progress; the new scene gets 'layout' and 'format'
+	bool Start( const char* filepath, const GridLayout layout, const GridFormat format );
+	bool Busy() const { return busy; }
+	bool Done() const { return finished.load(); }
+	float Progress() const;
+	const char* File() const { return file.c_str(); }
+	// swap the loaded level into 'scene' and free the old one; a level that failed to
+	// load is discarded and 'scene' is left as it is; false until Done
+	bool Finish( Scene& scene, bool& success );
+private:
+	thread worker;
+	atomic<Scene*> loading{ 0 };	// created by the worker
+	atomic<bool> finished{ false };
+	bool busy = false, loaded = false;
+	string file;
+};
+
+} // namespace Tmpl8
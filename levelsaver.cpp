@@ -0,0 +1,31 @@
+#include "template.h"
+
+LevelSaver::~LevelSaver()
+{
+	if (worker.joinable()) worker.join();
+}
+
+bool LevelSaver::Start( Scene& scene, const char* filepath )
+{
+	if (busy || !scene.TakeSnapshot( filepath, snapshot )) return false;
+	busy = true, finished = false;
+	worker = thread( [this]()
+	{
+		// parallel loops in here run as background jobs, see JobSystem::ParallelFor
+		saved = Scene::WriteSnapshot( snapshot );
+		finished = true;
+	} );
+	return true;
+}
+
+bool LevelSaver::Finish( Scene& scene, bool& success )
+{
+	if (!finished) return false;
+	worker.join();
+	success = saved;
+	scene.SnapshotWritten( snapshot, saved );
+	// the snapshot can be large; it is not needed anymore
+	snapshot.keys = vector<unsigned short>();
+	busy = false, finished = false;
+	return true;
+}
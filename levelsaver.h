@@ -0,0 +1,28 @@
+#pragma once
+
+namespace Tmpl8 {
+
+// Saves a level on a thread of its own, so saving does not hold up the frame. Start
+// copies what has to be written: if the file holds the level as it was last loaded or
+// saved, only the chunks that changed since, which are appended to the file as a journal
+// record; otherwise all of them, for a new file. Once Done, Finish tells the scene what
+// the file holds now; call it at a frame boundary.
+class LevelSaver
+{
+public:
+	~LevelSaver();	// waits for a save in progress
+	// false if a save is still in progress, or the scene has no grid (octree levels)
+	bool Start( Scene& scene, const char* filepath );
+	bool Busy() const { return busy; }
+	bool Done() const { return finished.load(); }
+	const char* File() const { return snapshot.file.path.c_str(); }
+	// false until Done
+	bool Finish( Scene& scene, bool& success );
+private:
+	thread worker;
+	Scene::LevelSnapshot snapshot;
+	atomic<bool> finished{ false };
+	bool busy = false, saved = false;
+};
+
+} // namespace Tmpl8
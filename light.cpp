@@ -1,2 +1,74 @@
 #include "template.h"
-#include "Light.h"
+#include "light.h"
+
+// lights with a position reach as far as their range; Scene::PrepareShadowRay drops the rest
+static bool HasRange( const Light& light ) { return light.type == Point || light.type == Spot; }
+
+void LightGrid::Build( const vector<Light>& lights, const float3& worldExtent )
+{
+	extent = worldExtent;
+	cellsPerUnit = make_float3( (float)LIGHTGRIDSIZE ) / extent;
+	cells.assign( LIGHTGRIDSIZE * LIGHTGRIDSIZE * LIGHTGRIDSIZE, vector<uint>() );
+	footprints.clear();
+	for (uint i = 0; i < (uint)lights.size(); i++) footprints.push_back( FootprintOf( lights[i] ) ), Insert( lights[i], i );
+}
+
+void LightGrid::Add( const vector<Light>& lights )
+{
+	footprints.push_back( FootprintOf( lights.back() ) );
+	Insert( lights.back(), (uint)lights.size() - 1 );
+}
+
+void LightGrid::Update( const vector<Light>& lights, const uint index )
+{
+	Erase( index );
+	footprints[index] = FootprintOf( lights[index] );
+	Insert( lights[index], index );
+}
+
+void LightGrid::Remove( const uint index )
+{
+	Erase( index );
+	footprints.erase( footprints.begin() + index );
+	for (vector<uint>& cell : cells) for (uint& i : cell) if (i > index) i--;
+}
+
+LightGrid::Footprint LightGrid::FootprintOf( const Light& light ) const
+{
+	const int3 all = make_int3( LIGHTGRIDSIZE - 1 );
+	if (!HasRange( light )) return Footprint{ make_int3( 0 ), all };
+	if (!(light.range >= 0)) return Footprint{ all, make_int3( 0 ) };
+	return Footprint{ CellOf( light.pos - light.range ), CellOf( light.pos + light.range ) };
+}
+
+bool LightGrid::Reaches( const Light& light, const int x, const int y, const int z ) const
+{
+	if (!HasRange( light )) return true;
+	// distance from the light to the nearest point of the cell
+	const float3 lo = make_float3( (float)x, (float)y, (float)z ) / cellsPerUnit;
+	const float3 hi = make_float3( (float)(x + 1), (float)(y + 1), (float)(z + 1) ) / cellsPerUnit;
+	const float3 d = light.pos - fminf( fmaxf( light.pos, lo ), hi );
+	return dot( d, d ) <= light.range * light.range;
+}
+
+void LightGrid::Insert( const Light& light, const uint index )
+{
+	const Footprint& f = footprints[index];
+	for (int z = f.lo.z; z <= f.hi.z; z++) for (int y = f.lo.y; y <= f.hi.y; y++) for (int x = f.lo.x; x <= f.hi.x; x++)
+	{
+		if (!Reaches( light, x, y, z )) continue;
+		vector<uint>& cell = cells[x + (y + z * LIGHTGRIDSIZE) * LIGHTGRIDSIZE];
+		cell.insert( lower_bound( cell.begin(), cell.end(), index ), index );
+	}
+}
+
+void LightGrid::Erase( const uint index )
+{
+	const Footprint& f = footprints[index];
+	for (int z = f.lo.z; z <= f.hi.z; z++) for (int y = f.lo.y; y <= f.hi.y; y++) for (int x = f.lo.x; x <= f.hi.x; x++)
+	{
+		vector<uint>& cell = cells[x + (y + z * LIGHTGRIDSIZE) * LIGHTGRIDSIZE];
+		const auto it = lower_bound( cell.begin(), cell.end(), index );
+		if (it != cell.end() && *it == index) cell.erase( it );
+	}
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#define LIGHTGRIDSIZE	16	// cells per axis of the light grid
+
 enum LightType
 {
 	Point,
@@ -128,4 +130,39 @@ struct Light
 
 		return light;
 	}
-};
\ No newline at end of file
+};
+
+// Which lights can reach which part of the world: the world's box split into
+// LIGHTGRIDSIZE^3 cells, each listing the lights whose range sphere touches it, in the
+// order of the light array. Directional lights, and the types without a range, are in
+// every cell. Lights are added, edited and removed one at a time; that only touches the
+// cells they covered and cover.
+class LightGrid
+{
+public:
+	void Build( const vector<Light>& lights, const float3& worldExtent );
+	void Add( const vector<Light>& lights );						// the last light is new
+	void Update( const vector<Light>& lights, const uint index );	// moved, or changed its range
+	void Remove( const uint index );								// erased; the lights after it moved down one
+	// the lights that may light 'p'; points outside the world use the nearest cell
+	const vector<uint>& LightsAt( const float3& p ) const
+	{
+		const int3 c = CellOf( p );
+		return cells[c.x + (c.y + c.z * LIGHTGRIDSIZE) * LIGHTGRIDSIZE];
+	}
+	const float3& Extent() const { return extent; }
+private:
+	struct Footprint { int3 lo, hi; };	// the cells around the light's range sphere; lo > hi for none
+	int3 CellOf( const float3& p ) const
+	{
+		const float3 c = p * cellsPerUnit;
+		return make_int3( clamp( (int)c.x, 0, LIGHTGRIDSIZE - 1 ), clamp( (int)c.y, 0, LIGHTGRIDSIZE - 1 ), clamp( (int)c.z, 0, LIGHTGRIDSIZE - 1 ) );
+	}
+	Footprint FootprintOf( const Light& light ) const;
+	bool Reaches( const Light& light, const int x, const int y, const int z ) const;
+	void Insert( const Light& light, const uint index );
+	void Erase( const uint index );
+	float3 extent = make_float3( 0 ), cellsPerUnit = make_float3( 0 );
+	vector<vector<uint>> cells;
+	vector<Footprint> footprints;	// per light
+};
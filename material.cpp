@@ -1,2 +1,62 @@
 #include "template.h"
 #include "material.h"
+
+void MaterialTable::Build( const map<unsigned short, Material>& materials, const Material& fallback )
+{
+	// the highest key plus one, rounded up to whole gathers; entry 0 always exists
+	const uint needed = ((materials.empty() ? 0 : (uint)materials.rbegin()->first) + 8) & ~7u;
+	if (needed != count)
+	{
+		FREE64( albedoR );
+		count = needed;
+		albedoR = (float*)MALLOC64( 5 * count * sizeof( float ) );
+		albedoG = albedoR + count, albedoB = albedoG + count, metallic = albedoB + count, roughness = metallic + count;
+	}
+	for (uint i = 0; i < count; i++)
+		albedoR[i] = fallback.albedo.x, albedoG[i] = fallback.albedo.y, albedoB[i] = fallback.albedo.z,
+		metallic[i] = fallback.metallic, roughness[i] = fallback.roughness;
+	for (const auto& m : materials)
+	{
+		if (m.first == NOMATERIALKEY) continue;
+		const uint i = m.first;
+		albedoR[i] = m.second.albedo.x, albedoG[i] = m.second.albedo.y, albedoB[i] = m.second.albedo.z;
+		metallic[i] = m.second.metallic, roughness[i] = m.second.roughness;
+	}
+}
+
+#ifndef NOAVX2
+AVX2_BEGIN
+uint MaterialTable::GatherAVX2( const uint* keys, const uint n, MaterialBatch& batch ) const
+{
+	const __m256i last = _mm256_set1_epi32( (int)count - 1 );
+	uint i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		// keys beyond the table read entry 0, without a branch
+		__m256i k = _mm256_loadu_si256( (const __m256i*)(keys + i) );
+		k = _mm256_andnot_si256( _mm256_cmpgt_epi32( k, last ), k );
+		_mm256_store_ps( batch.albedoR + i, _mm256_i32gather_ps( albedoR, k, 4 ) );
+		_mm256_store_ps( batch.albedoG + i, _mm256_i32gather_ps( albedoG, k, 4 ) );
+		_mm256_store_ps( batch.albedoB + i, _mm256_i32gather_ps( albedoB, k, 4 ) );
+		_mm256_store_ps( batch.metallic + i, _mm256_i32gather_ps( metallic, k, 4 ) );
+		_mm256_store_ps( batch.roughness + i, _mm256_i32gather_ps( roughness, k, 4 ) );
+	}
+	return i;
+}
+AVX2_END
+#endif
+
+void MaterialTable::Gather( const uint* keys, const uint n, MaterialBatch& batch ) const
+{
+	PROFILE_COUNT( MaterialLookups, n );
+	uint i = 0;
+#ifndef NOAVX2
+	if (CPUCaps::HW_AVX2) i = GatherAVX2( keys, n, batch );
+#endif
+	for (; i < n; i++)
+	{
+		const uint k = keys[i] < count ? keys[i] : 0;
+		batch.albedoR[i] = albedoR[k], batch.albedoG[i] = albedoG[k], batch.albedoB[i] = albedoB[k];
+		batch.metallic[i] = metallic[k], batch.roughness[i] = roughness[k];
+	}
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#define MATERIALBATCH	64	// hits per MaterialTable::Gather
+
 struct Material
 {
 	float3 albedo = float3(0.75f, 0.0f, 0.75f); // bright purple
@@ -13,4 +15,40 @@ struct Material
 	}
 
 	// Here we can create a material by default
-};
\ No newline at end of file
+};
+
+// the materials of a batch of hits, one lane per hit
+struct MaterialBatch
+{
+	alignas(64) float albedoR[MATERIALBATCH];
+	alignas(64) float albedoG[MATERIALBATCH];
+	alignas(64) float albedoB[MATERIALBATCH];
+	alignas(64) float metallic[MATERIALBATCH];
+	alignas(64) float roughness[MATERIALBATCH];
+};
+
+// The materials indexed directly by key, one 64-byte aligned array per field, so shading
+// looks a material up without searching the map, and a batch of hits gathers its materials
+// 8 at a time with AVX2. Entries without a material, NOMATERIALKEY and keys beyond the
+// table read the fallback material.
+class MaterialTable
+{
+public:
+	MaterialTable() = default;
+	MaterialTable( const MaterialTable& ) = delete;
+	MaterialTable& operator=( const MaterialTable& ) = delete;
+	~MaterialTable() { FREE64( albedoR ); }
+	void Build( const map<unsigned short, Material>& materials, const Material& fallback );
+	Material Get( const unsigned short key ) const
+	{
+		const uint i = key < count ? key : 0;
+		return Material( float3( albedoR[i], albedoG[i], albedoB[i] ), metallic[i], roughness[i] );
+	}
+	// the materials of up to MATERIALBATCH keys
+	void Gather( const uint* keys, const uint n, MaterialBatch& batch ) const;
+	uint Size() const { return count; }
+private:
+	uint GatherAVX2( const uint* keys, const uint n, MaterialBatch& batch ) const;	// whole groups of 8; returns the keys done
+	uint count = 0;		// entries, a multiple of 8; the arrays share one allocation
+	float* albedoR = 0, *albedoG = 0, *albedoB = 0, *metallic = 0, *roughness = 0;
+};
@@ -0,0 +1,297 @@
+#include "template.h"
+
+// Packet traversal: the Amanatides & Woo loop of Scene::Traverse, run for 4 (SSE4.1)
+// or 8 (AVX2) rays at once with masked stepping. Every iteration each lane jumps over
+// a box: the cube of empty bricks the distance field vouches for, an empty 4x4x4 block,
+// or just its current cell, which is a regular DDA step. Lanes that hit, leave the grid
+// or start inside a voxel drop out; once few lanes remain, they finish in scalar code.
+
+// lane traits; thin wrappers so the kernel below is written once for both widths
+struct SSELanes
+{
+	static constexpr uint N = 4;
+	typedef __m128 F; typedef __m128i I;
+	static F set1( float v ) { return _mm_set1_ps( v ); }
+	static I set1( int v ) { return _mm_set1_epi32( v ); }
+	static F load( const float* p ) { return _mm_loadu_ps( p ); }
+	static I load( const int* p ) { return _mm_loadu_si128( (const __m128i*)p ); }
+	static void store( float* p, F v ) { _mm_storeu_ps( p, v ); }
+	static void store( int* p, I v ) { _mm_storeu_si128( (__m128i*)p, v ); }
+	static F add( F a, F b ) { return _mm_add_ps( a, b ); }
+	static F sub( F a, F b ) { return _mm_sub_ps( a, b ); }
+	static F mul( F a, F b ) { return _mm_mul_ps( a, b ); }
+	static F div( F a, F b ) { return _mm_div_ps( a, b ); }
+	static F min( F a, F b ) { return _mm_min_ps( a, b ); }
+	static F max( F a, F b ) { return _mm_max_ps( a, b ); }
+	static F lt( F a, F b ) { return _mm_cmplt_ps( a, b ); }
+	static F ge( F a, F b ) { return _mm_cmpge_ps( a, b ); }
+	static F blend( F a, F b, F m ) { return _mm_blendv_ps( a, b, m ); }
+	static I add( I a, I b ) { return _mm_add_epi32( a, b ); }
+	static I sub( I a, I b ) { return _mm_sub_epi32( a, b ); }
+	static I mul( I a, I b ) { return _mm_mullo_epi32( a, b ); }
+	static I min( I a, I b ) { return _mm_min_epi32( a, b ); }
+	static I max( I a, I b ) { return _mm_max_epi32( a, b ); }
+	static I and_( I a, I b ) { return _mm_and_si128( a, b ); }
+	static I or_( I a, I b ) { return _mm_or_si128( a, b ); }
+	static I srl( I a, int n ) { return _mm_srli_epi32( a, n ); }
+	static I sll( I a, int n ) { return _mm_slli_epi32( a, n ); }
+	static I srlv( I a, I n ) { alignas(16) int v[4], s[4]; store( v, a ), store( s, n ); for (int i = 0; i < 4; i++) v[i] = (int)((uint)v[i] >> s[i]); return load( v ); }
+	static I eq( I a, I b ) { return _mm_cmpeq_epi32( a, b ); }
+	static I gt( I a, I b ) { return _mm_cmpgt_epi32( a, b ); }
+	static I blend( I a, I b, F m ) { return _mm_castps_si128( _mm_blendv_ps( _mm_castsi128_ps( a ), _mm_castsi128_ps( b ), m ) ); }
+	static F and_( F a, F b ) { return _mm_and_ps( a, b ); }
+	static F or_( F a, F b ) { return _mm_or_ps( a, b ); }
+	static F andnot( F a, F b ) { return _mm_andnot_ps( a, b ); } // ~a & b
+	static F mask( I a ) { return _mm_castsi128_ps( a ); }
+	static I bits( F a ) { return _mm_castps_si128( a ); }
+	static F tofloat( I a ) { return _mm_cvtepi32_ps( a ); }
+	static I toint( F a ) { return _mm_cvttps_epi32( a ); }
+	static uint movemask( F m ) { return (uint)_mm_movemask_ps( m ); }
+	static I gather( const int* base, I idx, F m )
+	{
+		// no gathers before AVX2
+		alignas(16) int i[4], r[4] = {};
+		store( i, idx );
+		const uint lanes = movemask( m );
+		for (int l = 0; l < 4; l++) if (lanes & (1 << l)) r[l] = base[i[l]];
+		return load( r );
+	}
+	static I gather( const uchar* base, I idx, F m )
+	{
+		alignas(16) int i[4], r[4] = {};
+		store( i, idx );
+		const uint lanes = movemask( m );
+		for (int l = 0; l < 4; l++) if (lanes & (1 << l)) r[l] = base[i[l]];
+		return load( r );
+	}
+};
+
+#ifndef NOAVX2
+AVX2_BEGIN
+struct AVX2Lanes
+{
+	static constexpr uint N = 8;
+	typedef __m256 F; typedef __m256i I;
+	static F set1( float v ) { return _mm256_set1_ps( v ); }
+	static I set1( int v ) { return _mm256_set1_epi32( v ); }
+	static F load( const float* p ) { return _mm256_loadu_ps( p ); }
+	static I load( const int* p ) { return _mm256_loadu_si256( (const __m256i*)p ); }
+	static void store( float* p, F v ) { _mm256_storeu_ps( p, v ); }
+	static void store( int* p, I v ) { _mm256_storeu_si256( (__m256i*)p, v ); }
+	static F add( F a, F b ) { return _mm256_add_ps( a, b ); }
+	static F sub( F a, F b ) { return _mm256_sub_ps( a, b ); }
+	static F mul( F a, F b ) { return _mm256_mul_ps( a, b ); }
+	static F div( F a, F b ) { return _mm256_div_ps( a, b ); }
+	static F min( F a, F b ) { return _mm256_min_ps( a, b ); }
+	static F max( F a, F b ) { return _mm256_max_ps( a, b ); }
+	static F lt( F a, F b ) { return _mm256_cmp_ps( a, b, _CMP_LT_OQ ); }
+	static F ge( F a, F b ) { return _mm256_cmp_ps( a, b, _CMP_GE_OQ ); }
+	static F blend( F a, F b, F m ) { return _mm256_blendv_ps( a, b, m ); }
+	static I add( I a, I b ) { return _mm256_add_epi32( a, b ); }
+	static I sub( I a, I b ) { return _mm256_sub_epi32( a, b ); }
+	static I mul( I a, I b ) { return _mm256_mullo_epi32( a, b ); }
+	static I min( I a, I b ) { return _mm256_min_epi32( a, b ); }
+	static I max( I a, I b ) { return _mm256_max_epi32( a, b ); }
+	static I and_( I a, I b ) { return _mm256_and_si256( a, b ); }
+	static I or_( I a, I b ) { return _mm256_or_si256( a, b ); }
+	static I srl( I a, int n ) { return _mm256_srli_epi32( a, n ); }
+	static I sll( I a, int n ) { return _mm256_slli_epi32( a, n ); }
+	static I srlv( I a, I n ) { return _mm256_srlv_epi32( a, n ); }
+	static I eq( I a, I b ) { return _mm256_cmpeq_epi32( a, b ); }
+	static I gt( I a, I b ) { return _mm256_cmpgt_epi32( a, b ); }
+	static I blend( I a, I b, F m ) { return _mm256_castps_si256( _mm256_blendv_ps( _mm256_castsi256_ps( a ), _mm256_castsi256_ps( b ), m ) ); }
+	static F and_( F a, F b ) { return _mm256_and_ps( a, b ); }
+	static F or_( F a, F b ) { return _mm256_or_ps( a, b ); }
+	static F andnot( F a, F b ) { return _mm256_andnot_ps( a, b ); } // ~a & b
+	static F mask( I a ) { return _mm256_castsi256_ps( a ); }
+	static I bits( F a ) { return _mm256_castps_si256( a ); }
+	static F tofloat( I a ) { return _mm256_cvtepi32_ps( a ); }
+	static I toint( F a ) { return _mm256_cvttps_epi32( a ); }
+	static uint movemask( F m ) { return (uint)_mm256_movemask_ps( m ); }
+	static I gather( const int* base, I idx, F m ) { return _mm256_mask_i32gather_epi32( _mm256_setzero_si256(), base, idx, bits( m ), 4 ); }
+	static I gather( const uchar* base, I idx, F m )
+	{
+		// 32-bit gather at byte granularity; the source must be padded by 3 bytes
+		return and_( _mm256_mask_i32gather_epi32( _mm256_setzero_si256(), (const int*)base, idx, bits( m ), 1 ), set1( 255 ) );
+	}
+};
+AVX2_END
+#endif
+
+// once fewer lanes than this are active, the rest finish in scalar code
+#define PACKET_SCALAR_TAIL( N )	((N) / 4 + 1)
+
+static inline uint lane_count( const uint lanes )
+{
+#ifdef _MSC_VER
+	return __popcnt( lanes );
+#else
+	return __builtin_popcount( lanes );
+#endif
+}
+
+// Step one axis across the boundaries it passes before 'te', at most 'n' of them;
+// the vector counterpart of advance_axis in dda.h.
+template <class V> static void advance_axis( typename V::I& X, typename V::F& tmax, const typename V::I step, const typename V::F tdelta, const typename V::F te, const typename V::I n )
+{
+	typedef typename V::F F; typedef typename V::I I;
+	const F nf = V::tofloat( n ), one = V::set1( 1.0f );
+	const F moving = V::lt( tmax, te );
+	// estimate, clamped in float so huge ratios don't overflow the conversion
+	I k = V::toint( V::min( V::add( V::div( V::sub( te, tmax ), tdelta ), one ), nf ) );
+	k = V::blend( V::set1( 0 ), V::max( k, V::set1( 0 ) ), moving );
+	// exact fix-up, one step either way
+	const F kf = V::tofloat( k );
+	const F over = V::and_( V::mask( V::gt( k, V::set1( 0 ) ) ), V::ge( V::add( tmax, V::mul( V::sub( kf, one ), tdelta ) ), te ) );
+	const F under = V::and_( V::mask( V::gt( n, k ) ), V::lt( V::add( tmax, V::mul( kf, tdelta ) ), te ) );
+	k = V::add( k, V::and_( V::bits( under ), V::set1( 1 ) ) );
+	k = V::sub( k, V::and_( V::bits( over ), V::set1( 1 ) ) );
+	X = V::add( X, V::mul( k, step ) );
+	tmax = V::blend( tmax, V::add( tmax, V::mul( V::tofloat( k ), tdelta ) ), moving );
+}
+
+template <class V> void Scene::FindNearestPacket( Ray* rays, const uint count ) const
+{
+	typedef typename V::F F; typedef typename V::I I;
+	const uint N = V::N;
+	// scalar setup per lane; lanes that miss the grid or start inside a voxel are not vectorized
+	alignas(32) int X[N], Y[N], Z[N], sx[N], sy[N], sz[N], axis[N];
+	alignas(32) float t[N], mx[N], my[N], mz[N], dx[N], dy[N], dz[N];
+	uint lanes = 0, scalarLanes = 0, setupLanes = 0;
+	DDAState s[N];
+	for (uint i = 0; i < N; i++)
+	{
+		if (i >= count) { X[i] = Y[i] = Z[i] = sx[i] = sy[i] = sz[i] = axis[i] = 0, t[i] = mx[i] = my[i] = mz[i] = dx[i] = dy[i] = dz[i] = 0; continue; }
+		Ray& ray = rays[i];
+		ray.O += EPSILON * ray.D;
+		if (!Setup3DDDA( ray, s[i] )) { X[i] = Y[i] = Z[i] = sx[i] = sy[i] = sz[i] = axis[i] = 0, t[i] = mx[i] = my[i] = mz[i] = dx[i] = dy[i] = dz[i] = 0; continue; }
+		if (ray.inside) scalarLanes |= 1 << i; else lanes |= 1 << i;
+		setupLanes |= 1 << i;
+		X[i] = s[i].X, Y[i] = s[i].Y, Z[i] = s[i].Z, axis[i] = ray.axis;
+		sx[i] = s[i].step.x, sy[i] = s[i].step.y, sz[i] = s[i].step.z;
+		t[i] = s[i].t, mx[i] = s[i].tmax.x, my[i] = s[i].tmax.y, mz[i] = s[i].tmax.z;
+		dx[i] = s[i].tdelta.x, dy[i] = s[i].tdelta.y, dz[i] = s[i].tdelta.z;
+	}
+	I vX = V::load( X ), vY = V::load( Y ), vZ = V::load( Z ), vAxis = V::load( axis );
+	const I stepX = V::load( sx ), stepY = V::load( sy ), stepZ = V::load( sz );
+	F vt = V::load( t ), tmaxX = V::load( mx ), tmaxY = V::load( my ), tmaxZ = V::load( mz );
+	const F tdX = V::load( dx ), tdY = V::load( dy ), tdZ = V::load( dz );
+	alignas(32) int laneBits[N];
+	for (uint i = 0; i < N; i++) laneBits[i] = 1 << i;
+	const I laneBit = V::load( laneBits ), zero = V::set1( 0 ), one = V::set1( 1 );
+	const I outsideX = V::set1( ~(int)(size.x - 1) ), outsideY = V::set1( ~(int)(size.y - 1) ), outsideZ = V::set1( ~(int)(size.z - 1) );
+	uint hits = 0, steps = 0;
+	// vectorized traversal
+	while (lanes && lane_count( lanes ) >= PACKET_SCALAR_TAIL( N ))
+	{
+		steps += lane_count( lanes );
+		const F active = V::mask( V::gt( V::and_( laneBit, V::set1( (int)lanes ) ), zero ) );
+		// coarse level: empty bricks
+		const I bx = V::srl( vX, 3 ), by = V::srl( vY, 3 ), bz = V::srl( vZ, 3 );
+		const I brickIdx = V::add( bx, V::add( V::sll( by, brickShift.y ), V::sll( bz, brickShift.z ) ) );
+		const I occupancy = V::gather( (const int*)brickOccupancy, brickIdx, active );
+		const F emptyBrick = V::and_( active, V::mask( V::eq( occupancy, zero ) ) );
+		// fine level: empty blocks and single bits; a 64-bit mask is two 32-bit halves
+		const I blockIdx = V::add( V::srl( vX, 2 ), V::add( V::sll( V::srl( vY, 2 ), blockShift.y ), V::sll( V::srl( vZ, 2 ), blockShift.z ) ) );
+		const F fine = V::andnot( emptyBrick, active );
+		const I lo32 = V::gather( (const int*)blockOccupancy, V::add( blockIdx, blockIdx ), fine );
+		const I hi32 = V::gather( (const int*)blockOccupancy, V::add( V::add( blockIdx, blockIdx ), one ), fine );
+		const F emptyBlock = V::and_( fine, V::mask( V::eq( V::or_( lo32, hi32 ), zero ) ) );
+		const I bit = V::add( V::and_( vX, V::set1( 3 ) ), V::add( V::sll( V::and_( vY, V::set1( 3 ) ), 2 ), V::sll( V::and_( vZ, V::set1( 3 ) ), 4 ) ) );
+		const I half = V::blend( lo32, hi32, V::mask( V::gt( bit, V::set1( 31 ) ) ) );
+		const F solid = V::and_( V::andnot( emptyBlock, fine ), V::mask( V::eq( V::and_( V::srlv( half, V::and_( bit, V::set1( 31 ) ) ), one ), one ) ) );
+		const uint hitLanes = V::movemask( solid );
+		hits |= hitLanes, lanes &= ~hitLanes;
+		// box to skip per lane: the current cell by default
+		I loX = vX, loY = vY, loZ = vZ, hiX = vX, hiY = vY, hiZ = vZ;
+		if (V::movemask( emptyBlock ))
+		{
+			const I m = V::set1( ~(BLOCKSIZE - 1) ), e = V::set1( BLOCKSIZE - 1 );
+			loX = V::blend( loX, V::and_( vX, m ), emptyBlock ), hiX = V::blend( hiX, V::add( V::and_( vX, m ), e ), emptyBlock );
+			loY = V::blend( loY, V::and_( vY, m ), emptyBlock ), hiY = V::blend( hiY, V::add( V::and_( vY, m ), e ), emptyBlock );
+			loZ = V::blend( loZ, V::and_( vZ, m ), emptyBlock ), hiZ = V::blend( hiZ, V::add( V::and_( vZ, m ), e ), emptyBlock );
+		}
+		if (V::movemask( emptyBrick ))
+		{
+		#if DISTANCEFIELD
+			const I d = V::gather( brickDistance, brickIdx, emptyBrick );
+			const I r = V::sub( V::max( d, one ), one );
+		#else
+			const I r = zero;
+		#endif
+			const I lastX = V::set1( (int)brickGridSize.x - 1 ), lastY = V::set1( (int)brickGridSize.y - 1 ), lastZ = V::set1( (int)brickGridSize.z - 1 ), e = V::set1( BRICKSIZE - 1 );
+			loX = V::blend( loX, V::sll( V::max( V::sub( bx, r ), zero ), 3 ), emptyBrick ), hiX = V::blend( hiX, V::add( V::sll( V::min( V::add( bx, r ), lastX ), 3 ), e ), emptyBrick );
+			loY = V::blend( loY, V::sll( V::max( V::sub( by, r ), zero ), 3 ), emptyBrick ), hiY = V::blend( hiY, V::add( V::sll( V::min( V::add( by, r ), lastY ), 3 ), e ), emptyBrick );
+			loZ = V::blend( loZ, V::sll( V::max( V::sub( bz, r ), zero ), 3 ), emptyBrick ), hiZ = V::blend( hiZ, V::add( V::sll( V::min( V::add( bz, r ), lastZ ), 3 ), e ), emptyBrick );
+		}
+		// jump over the box, see skip_empty_box in dda.h
+		const F move = V::andnot( solid, active );
+		const I nX = V::blend( V::sub( vX, loX ), V::sub( hiX, vX ), V::mask( V::gt( stepX, zero ) ) );
+		const I nY = V::blend( V::sub( vY, loY ), V::sub( hiY, vY ), V::mask( V::gt( stepY, zero ) ) );
+		const I nZ = V::blend( V::sub( vZ, loZ ), V::sub( hiZ, vZ ), V::mask( V::gt( stepZ, zero ) ) );
+		const F eX = V::blend( V::add( tmaxX, V::mul( V::tofloat( nX ), tdX ) ), tmaxX, V::mask( V::eq( nX, zero ) ) );
+		const F eY = V::blend( V::add( tmaxY, V::mul( V::tofloat( nY ), tdY ) ), tmaxY, V::mask( V::eq( nY, zero ) ) );
+		const F eZ = V::blend( V::add( tmaxZ, V::mul( V::tofloat( nZ ), tdZ ) ), tmaxZ, V::mask( V::eq( nZ, zero ) ) );
+		const F majorX = V::and_( V::lt( eX, eY ), V::lt( eX, eZ ) );
+		const F majorY = V::andnot( majorX, V::lt( eY, eZ ) );
+		const F majorZ = V::andnot( V::or_( majorX, majorY ), V::mask( V::set1( -1 ) ) );
+		const F te = V::blend( V::blend( eZ, eY, majorY ), eX, majorX );
+		// minor axes: advance up to the exit point
+		I newX = vX, newY = vY, newZ = vZ;
+		F newMaxX = tmaxX, newMaxY = tmaxY, newMaxZ = tmaxZ;
+		advance_axis<V>( newX, newMaxX, stepX, tdX, te, V::blend( nX, zero, majorX ) );
+		advance_axis<V>( newY, newMaxY, stepY, tdY, te, V::blend( nY, zero, majorY ) );
+		advance_axis<V>( newZ, newMaxZ, stepZ, tdZ, te, V::blend( nZ, zero, majorZ ) );
+		// major axis: cross the box boundary
+		newX = V::blend( newX, V::add( vX, V::mul( V::add( nX, one ), stepX ) ), majorX ), newMaxX = V::blend( newMaxX, V::add( eX, tdX ), majorX );
+		newY = V::blend( newY, V::add( vY, V::mul( V::add( nY, one ), stepY ) ), majorY ), newMaxY = V::blend( newMaxY, V::add( eY, tdY ), majorY );
+		newZ = V::blend( newZ, V::add( vZ, V::mul( V::add( nZ, one ), stepZ ) ), majorZ ), newMaxZ = V::blend( newMaxZ, V::add( eZ, tdZ ), majorZ );
+		const I newAxis = V::blend( V::blend( V::set1( 2 ), one, majorY ), zero, majorX );
+		vX = V::blend( vX, newX, move ), vY = V::blend( vY, newY, move ), vZ = V::blend( vZ, newZ, move );
+		tmaxX = V::blend( tmaxX, newMaxX, move ), tmaxY = V::blend( tmaxY, newMaxY, move ), tmaxZ = V::blend( tmaxZ, newMaxZ, move );
+		vt = V::blend( vt, te, move ), vAxis = V::blend( vAxis, newAxis, move );
+		// lanes that left the grid (on either side; coordinates wrap like in the scalar code) are done
+		const I oob = V::or_( V::and_( vX, outsideX ), V::or_( V::and_( vY, outsideY ), V::and_( vZ, outsideZ ) ) );
+		lanes &= ~V::movemask( V::andnot( V::mask( V::eq( oob, zero ) ), move ) );
+	}
+	PROFILE_COUNT( DDASteps, steps );
+	// write back
+	V::store( X, vX ), V::store( Y, vY ), V::store( Z, vZ ), V::store( axis, vAxis );
+	V::store( t, vt ), V::store( mx, tmaxX ), V::store( my, tmaxY ), V::store( mz, tmaxZ );
+	for (uint i = 0; i < N && i < count; i++)
+	{
+		Ray& ray = rays[i];
+		const uint bit = 1 << i;
+		if (scalarLanes & bit) { Traverse( ray, s[i] ); continue; }
+		if (lanes & bit)
+		{
+			// diverged: finish in scalar code from where the vector loop left off
+			s[i].X = X[i], s[i].Y = Y[i], s[i].Z = Z[i], s[i].t = t[i];
+			s[i].tmax = float3( mx[i], my[i], mz[i] ), ray.axis = axis[i];
+			Traverse( ray, s[i] );
+			continue;
+		}
+		if (!(setupLanes & bit)) continue; // lane missed the grid entirely
+		ray.voxelKey = (hits & bit) ? GetMaterial( X[i], Y[i], Z[i] ) : NOMATERIALKEY;
+		ray.t = t[i], ray.axis = axis[i];
+	}
+}
+
+#ifndef NOAVX2
+// the AVX2 kernel, compiled for AVX2 only; the templates above compile for the baseline
+AVX2_BEGIN
+template void advance_axis<AVX2Lanes>( AVX2Lanes::I&, AVX2Lanes::F&, const AVX2Lanes::I, const AVX2Lanes::F, const AVX2Lanes::F, const AVX2Lanes::I );
+template void Scene::FindNearestPacket<AVX2Lanes>( Ray* rays, const uint count ) const;
+AVX2_END
+#endif
+
+void Scene::FindNearest( Ray* rays, const uint count ) const
+{
+	// pick the widest instruction set this CPU supports; the octree and streamed levels are traced ray by ray
+	if (backend != GridBackend) for (uint i = 0; i < count; i++) FindNearest( rays[i] );
+#ifndef NOAVX2
+	else if (CPUCaps::HW_AVX2) for (uint i = 0; i < count; i += AVX2Lanes::N) FindNearestPacket<AVX2Lanes>( rays + i, min( count - i, AVX2Lanes::N ) );
+#endif
+	else if (CPUCaps::HW_SSE41) for (uint i = 0; i < count; i += SSELanes::N) FindNearestPacket<SSELanes>( rays + i, min( count - i, SSELanes::N ) );
+	else for (uint i = 0; i < count; i++) FindNearest( rays[i] );
+}
@@ -0,0 +1,62 @@
+#include "template.h"
+
+void ChunkPrefetcher::Update( StreamedWorld& stream, const Camera& camera, const float cellSize )
+{
+	// smoothed motion; a jump further than the reach is a teleport, not motion
+	const float3 pos = camera.camPos / cellSize, ahead = camera.camAhead;
+	if (tracking && length( pos - lastPos ) < PREFETCHREACH)
+	{
+		velocity = velocity * 0.7f + (pos - lastPos) * 0.3f;
+		turn = turn * 0.7f + (ahead - lastAhead) * 0.3f;
+	}
+	else velocity = turn = make_float3( 0 );
+	lastPos = pos, lastAhead = ahead, tracking = true;
+	// the poses now, halfway and at the end of the lookahead; the frustum of the camera,
+	// see Camera::UpdateFrustum, widened a quarter for turns that do not go as predicted
+	const int poses = 3;
+	float3 P[poses], A[poses], R[poses], U[poses];
+	for (int i = 0; i < poses; i++)
+	{
+		const float frames = (float)(PREFETCHLOOKAHEAD * i / (poses - 1));
+		P[i] = pos + velocity * frames;
+		A[i] = ahead + turn * frames;
+		A[i] = length( A[i] ) > 0.01f ? normalize( A[i] ) : ahead;
+		const float3 side = cross( make_float3( 0, 1, 0 ), A[i] );
+		R[i] = length( side ) > 0.001f ? normalize( side ) : make_float3( 1, 0, 0 );
+		U[i] = cross( A[i], R[i] );
+	}
+	const float tanX = 0.625f * camera.aspect, tanY = 0.625f;
+	const float3 edge = make_float3( stream.ChunkEdge() );
+	const float radius = 0.5f * length( edge ), reach = PREFETCHREACH + radius;
+	const float padX = radius * sqrtf( 1 + tanX * tanX ), padY = radius * sqrtf( 1 + tanY * tanY );
+	// the chunks within reach of any pose
+	float3 lo = P[0], hi = P[0];
+	for (int i = 1; i < poses; i++) lo = fminf( lo, P[i] ), hi = fmaxf( hi, P[i] );
+	const uint3& grid = stream.ChunkGridSize();
+	const int3 first = make_int3( fmaxf( make_float3( 0 ), (lo - reach) / edge ) );
+	const int3 last = min( make_int3( (hi + reach) / edge ), make_int3( grid ) - 1 );
+	candidates.clear();
+	for (int z = first.z; z <= last.z; z++) for (int y = first.y; y <= last.y; y++) for (int x = first.x; x <= last.x; x++)
+	{
+		const float3 centre = (make_float3( (float)x, (float)y, (float)z ) + 0.5f) * edge;
+		for (int i = 0; i < poses; i++)
+		{
+			// a sphere around the chunk against the frustum planes
+			const float3 d = centre - P[i];
+			const float distance2 = dot( d, d ), depth = dot( d, A[i] );
+			const bool nearby = distance2 < 4 * radius * radius;
+			if (!nearby && (distance2 > reach * reach || depth < -radius)) continue;
+			if (!nearby && (fabsf( dot( d, R[i] ) ) - depth * tanX > padX || fabsf( dot( d, U[i] ) ) - depth * tanY > padY)) continue;
+			candidates.push_back( make_pair( sqrLength( centre - pos ), make_uint3( x, y, z ) ) );
+			break;
+		}
+	}
+	// nearest first; the loaders may not get to the far ones this frame, the next Update queues them again
+	sort( candidates.begin(), candidates.end(), []( const pair<float, uint3>& a, const pair<float, uint3>& b ) { return a.first < b.first; } );
+	queued = 0;
+	for (const pair<float, uint3>& c : candidates)
+	{
+		if (queued == PREFETCHMAX) break;
+		if (stream.Prefetch( c.second )) queued++;
+	}
+}
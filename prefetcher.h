@@ -0,0 +1,30 @@
+#pragma once
+
+#define PREFETCHLOOKAHEAD	30		// frames of camera motion that chunks are prefetched for
+#define PREFETCHREACH		384		// voxels: chunks further from a predicted pose are left to the rays
+#define PREFETCHMAX			256		// chunks queued per frame at most
+
+namespace Tmpl8 {
+
+// Queues the chunks of a streamed level that the camera is about to need, so they are
+// loaded before rays step into them. The camera's recent motion, smoothed over a few
+// frames, predicts where it will be and where it will look over the next
+// PREFETCHLOOKAHEAD frames; the chunks in view from those poses, and those right around
+// the camera, go to StreamedWorld::Prefetch, nearest first. A still camera only
+// prefetches what it sees.
+class ChunkPrefetcher
+{
+public:
+	// once per frame, between frames, before StreamedWorld::Update
+	void Update( StreamedWorld& stream, const Camera& camera, const float cellSize );
+	void Reset() { tracking = false; velocity = turn = make_float3( 0 ); }
+	float3 velocity = make_float3( 0 );	// voxels per frame
+	float3 turn = make_float3( 0 );		// change of the view direction per frame
+	uint queued = 0;					// chunks queued in the last Update
+private:
+	float3 lastPos, lastAhead;
+	bool tracking = false;				// lastPos and lastAhead are set
+	vector<pair<float, uint3>> candidates;
+};
+
+} // namespace Tmpl8
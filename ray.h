@@ -5,6 +5,7 @@ namespace Tmpl8 {
 class Ray
 {
 public:
+	Ray() = default;
 	Ray( const float3 origin, const float3 direction, const float rayLength = 1e34f, const uint rgb = 0 );
 	float3 IntersectionPoint() const { return O + t * D; }
 	float3 GetNormal() const;
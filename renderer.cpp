@@ -1,7 +1,4 @@
 #include "template.h"
-#include <execution>
-
-#define ACCUMULATION_INDEX 0.8f
 
 // -----------------------------------------------------------
 // Calculate light transport via a ray
@@ -9,10 +6,18 @@
 float3 Renderer::Trace(Ray& ray, int rayStep)
 {
 	// accounting for the statistics
-	rayCount++;
+	Profile().Count(rayStep == 0 ? PrimaryRays : BounceRays);
 
 	scene.FindNearest(ray);
 
+	return Shade(ray, rayStep);
+}
+
+// -----------------------------------------------------------
+// Shade a ray for which FindNearest has already been called
+// -----------------------------------------------------------
+float3 Renderer::Shade(Ray& ray, int rayStep)
+{
 	// Didn't find any voxel
 	if (ray.voxelKey == NOMATERIALKEY) return GetSkyColor(ray);
 	
@@ -22,16 +27,23 @@ float3 Renderer::Trace(Ray& ray, int rayStep)
 	float3 N = normalize(ray.GetNormal());
 	float3 I = ray.IntersectionPoint();
 
-	bool isKeyValid = false;
-	const Material& material = scene.GetMaterialByKey(ray.voxelKey, isKeyValid);
+	const Material material = scene.GetMaterialByKey(ray.voxelKey);
 
 	float3 albedo = lerp(material.albedo, float3(0.0), material.metallic);;
 
 	float3 result = float3(0.0f);
 
-	for (auto it = scene.GetLights().begin(); it != scene.GetLights().end(); it++)
+	// only the lights whose range may reach the point
+	const vector<Light>& lights = scene.GetLights();
+	const vector<uint>& nearLights = scene.LightsNear(I);
+	PROFILE_COUNT(LightEvaluations, nearLights.size());
+	for (const uint i : nearLights)
 	{
-		result += albedo * scene.ShadowRay((*it), I, N);
+		Ray shadowRay;
+		float3 contribution;
+		if (!scene.PrepareShadowRay(lights[i], I, N, shadowRay, contribution)) continue;
+		Profile().Count(ShadowRays);
+		if (!scene.IsOccluded(shadowRay)) result += albedo * contribution;
 	}
 
 	if (rayStep >= MAXRAYSTEPS)	return result;
@@ -52,19 +64,47 @@ float3 Tmpl8::Renderer::GetSkyColor(Ray& ray)
 	return float3(0.4235f, 0.7255f, 0.9686f);
 }
 
+// -----------------------------------------------------------
+// Colour the screen by pixelCost: blue for cheap, through green and
+// yellow, to red at heatmapScale and beyond
+// -----------------------------------------------------------
+void Renderer::WriteHeatmap()
+{
+	const uint pixels = RENDERWIDTH * RENDERHEIGHT;
+	uint64_t sum = 0;
+	heatmapMax = 0;
+	for (uint i = 0; i < pixels; i++) sum += pixelCost[i], heatmapMax = max(heatmapMax, pixelCost[i]);
+	heatmapMean = (float)sum / pixels;
+	vector<uint> sorted = pixelCost;
+	nth_element(sorted.begin(), sorted.begin() + pixels * 99 / 100, sorted.end());
+	heatmapP99 = sorted[pixels * 99 / 100];
+	const float scale = heatmapScale > 0 ? heatmapScale : (float)max(1u, heatmapP99);
+
+	// the histogram spans [0, scale]; the last bin also holds everything above it
+	memset(heatmapHistogram, 0, sizeof(heatmapHistogram));
+	for (uint i = 0; i < pixels; i++) heatmapHistogram[min((int)(pixelCost[i] * HEATMAPBINS / scale), HEATMAPBINS - 1)]++;
+
+	static const float3 ramp[] = { float3(0, 0, 0.5f), float3(0, 0.5f, 1), float3(0, 0.8f, 0), float3(1, 1, 0), float3(1, 0, 0) };
+	Jobs().ParallelFor(0, RENDERHEIGHT, [&](int y)
+	{
+		for (int x = 0; x < RENDERWIDTH; x++)
+		{
+			const float f = min(pixelCost[x + y * RENDERWIDTH] / scale, 1.0f) * 3.999f;
+			const int stop = (int)f;
+			screen->pixels[x + y * RENDERWIDTH] = RGBF32_to_RGB8(lerp(ramp[stop], ramp[stop + 1], f - stop));
+		}
+	});
+}
+
 // -----------------------------------------------------------
 // Application initialization - Executed once, at app start
 // -----------------------------------------------------------
 void Renderer::Init()
 {
-
-	for (uint i = 0; i < RENDERHEIGHT; i++)
-		verticalIter[i] = i;
-	for (uint i = 0; i < RENDERWIDTH; i++)
-		horizontalIter[i] = i;
-
 	dMousePos = int2{ 0, 0 };
 	scene.LoadLevelFromFile(levelFilepath);
+	// a mappable level stays mappable when it is saved
+	saveMappable = scene.IsMapped();
 }
 
 // -----------------------------------------------------------
@@ -74,43 +114,38 @@ void Renderer::Tick( float deltaTime )
 {
 	// high-resolution timer, see template.h
 	Timer t;
-	// pixel loop: lines are executed as OpenMP parallel tasks (disabled in DEBUG)
 
-	bool cameraIsMoving = camera.HandleInput( deltaTime, dMousePos );
-
-	imageAccumulationIndex = 0.0f;
-	if (!cameraIsMoving && accumulationEnabled) imageAccumulationIndex = ACCUMULATION_INDEX;
-	
-	rayCount = 0;
+	// frame boundary: no jobs use the scene, so a level loaded in the background can go in
+	bool levelLoaded = false;
+	if (levelLoader.Finish( scene, levelLoaded ))
+	{
+		if (levelLoaded) selectedLightIndex = -1, saveMappable = scene.IsMapped();
+		else printf( "Failed to load %s\n", levelLoader.File() );
+	}
+	bool levelSaved;
+	if (levelSaver.Finish( scene, levelSaved ) && !levelSaved) printf( "Failed to save %s\n", levelSaver.File() );
+	if (autosaveInterval > 0 && autosaveTimer.elapsed() > autosaveInterval && !levelLoader.Busy())
+	{
+		// tried again next frame if a save is still in progress. Mappable levels are not
+		// autosaved: writing one, or unmapping the level for a snapshot, copies the whole
+		// grid on this thread; use the Save button for those.
+		const bool mappable = saveMappable || scene.IsMapped();
+		if (mappable || levelSaver.Start( scene, levelFilepath ) || !scene.HasGrid()) autosaveTimer.reset();
+	}
 
-#define MT 1
-#if MT
-#pragma omp parallel for schedule(dynamic)
+	bool cameraIsMoving;
+	{
+		PROFILE_STAGE( CameraInputStage );
+		cameraIsMoving = camera.HandleInput( deltaTime, dMousePos );
+	}
+	// and the chunks a streamed level loaded in the background
+	const bool chunksStreamed = StreamChunks();
 
-	for (int y = 0; y < RENDERHEIGHT; y++)
-		{
-			// trace a primary ray for each pixel on the line
-			for (int x = 0; x < RENDERWIDTH; x++)
-				{
-#else
-	std::for_each(std::execution::par, verticalIter.begin(), verticalIter.end(),
-		[this](uint y)
-		{
-			std::for_each(std::execution::par, horizontalIter.begin(), horizontalIter.end(),
-				[this, y](uint x)
-				{
-#endif
-					Ray r = camera.GetPrimaryRay( (float)x, (float)y );
-					float3 pixel = lerp(Trace(r, 0), RGB8_to_RGBF32(screen->pixels[x + y * RENDERWIDTH]), imageAccumulationIndex);
+	imageAccumulationIndex = 0.0f;
+	if (!cameraIsMoving && !levelLoaded && !chunksStreamed && accumulationEnabled) imageAccumulationIndex = ACCUMULATION_INDEX;
 
-					screen->pixels[x + y * RENDERWIDTH] = RGBF32_to_RGB8( pixel );
-#if MT
-				}
-		}
-#else
-				});
-		});
-#endif
+	RenderFrame();
+	if (recordingPath) recordedPath.push_back( CameraPose{ camera.camPos, camera.camAhead } );
 
 	// Performance counter
 	float timePassed = t.elapsed();
@@ -121,6 +156,81 @@ void Renderer::Tick( float deltaTime )
 	fps = 1000.0f / frameTime;
 }
 
+// -----------------------------------------------------------
+// Between frames, for a streamed level: queue the chunks the camera
+// is about to need, and put those that arrived in the table
+// -----------------------------------------------------------
+bool Renderer::StreamChunks()
+{
+	if (!scene.stream) return false;
+	if (prefetchChunks) prefetcher.Update( *scene.stream, camera, scene.cellSize );
+	return scene.stream->Update( camera.camPos / scene.cellSize ) > 0;
+}
+
+// -----------------------------------------------------------
+// Render one frame into the screen surface, blending with the previous
+// frame by imageAccumulationIndex; no window or input needed
+// -----------------------------------------------------------
+void Renderer::RenderFrame()
+{
+	Jobs().ResetStats();
+	scene.UpdateMaterialTable();
+	scene.UpdateLightGrid();
+
+	// the heatmap needs the cost of each pixel, so it is traced pixel by pixel
+	const ProfileCounter costCounter = heatmap == HeatmapShadowRays ? ShadowRays : heatmap == HeatmapBounces ? BounceRays : DDASteps;
+	if (heatmap != HeatmapOff) pixelCost.resize(RENDERWIDTH * RENDERHEIGHT);
+
+	// pixel loop: screen tiles are rendered on the tile scheduler's thread pool
+	if (wavefront && heatmap == HeatmapOff) TraceWavefront();
+	else scheduler.Render( RENDERWIDTH, RENDERHEIGHT, [this, costCounter]( const int x0, const int y0, const int x1, const int y1 )
+	{
+		const double tileStart = PROFILE_NOW();
+		for (int y = y0; y < y1; y++)
+		{
+			// primary rays for a line of the tile; neighbouring rays are coherent, so
+			// with packetTracing they are traversed as packets
+			const double traceStart = PROFILE_NOW();
+			Ray r[TILESIZE];
+			const int count = x1 - x0;
+			for (int i = 0; i < count; i++) r[i] = camera.GetPrimaryRay( (float)(x0 + i), (float)y );
+			if (heatmap != HeatmapOff)
+			{
+				// the thread's own counter only moves for the pixel it is working on
+				for (int i = 0; i < count; i++)
+				{
+					const uint64_t before = Profile().LocalCount( costCounter );
+					scene.FindNearest( r[i] );
+					Shade( r[i], 0 );
+					pixelCost[x0 + i + y * RENDERWIDTH] = (uint)(Profile().LocalCount( costCounter ) - before);
+				}
+				Profile().Count( PrimaryRays, count );
+				continue;
+			}
+			if (packetTracing) for (int i = 0; i < count; i += MAXPACKETSIZE) scene.FindNearest( r + i, min( count - i, MAXPACKETSIZE ) );
+			else for (int i = 0; i < count; i++) scene.FindNearest( r[i] );
+			Profile().Count( PrimaryRays, count );
+			const double shadeStart = PROFILE_NOW();
+			for (int i = 0; i < count; i++)
+			{
+				uint& dst = screen->pixels[x0 + i + y * RENDERWIDTH];
+				dst = RGBF32_to_RGB8( lerp(Shade(r[i], 0), RGB8_to_RGBF32(dst), imageAccumulationIndex) );
+			}
+			PROFILE_STAGE_TIME( PrimaryTraceStage, shadeStart - traceStart );
+			PROFILE_STAGE_TIME( ShadingStage, PROFILE_NOW() - shadeStart );
+		}
+		PROFILE_EVENT( "tile", tileStart, PROFILE_NOW() );
+	} );
+
+	if (heatmap != HeatmapOff) WriteHeatmap();
+
+	Profile().EndFrame();
+	const uint64_t* counters = Profile().frame.counters;
+	frameRays.primary = (uint)counters[PrimaryRays], frameRays.shadow = (uint)counters[ShadowRays], frameRays.bounce = (uint)counters[BounceRays];
+}
+
+#ifndef HEADLESS
+
 // -----------------------------------------------------------
 // Update user interface (imgui)
 // -----------------------------------------------------------
@@ -138,12 +248,51 @@ void Renderer::UI()
 
 	//ImGui::Text("Mouse hover: %i", r.voxelKey);
 
-	ImGui::Text("Frame time: %.2f ms   FPS: %.2f   Rays traced: %i", frameTime, fps, rayCount);
+	ImGui::Text("Frame time: %.2f ms   FPS: %.2f   Rays traced: %u (%.1f Mrays/s)", frameTime, fps, frameRays.Total(), frameRays.Total() / (frameTime * 1000));
+	ImGui::Text("Primary: %u   Shadow: %u   Bounce: %u", frameRays.primary, frameRays.shadow, frameRays.bounce);
 
 	ImGui::SliderFloat("Camera speed", &camera.speed, 0.0f, 0.002f, "%.5f");
 	ImGui::SliderFloat("Camera sensivity", &camera.sensitivity, 0.0f, 0.02f);
 
+	if (ImGui::Checkbox("Record camera path", &recordingPath) && recordingPath) recordedPath.clear();
+	ImGui::SameLine();
+	ImGui::Text("%i frames", (int)recordedPath.size());
+	ImGui::InputText("Camera path file", cameraPathFile, 256);
+	if (ImGui::Button("Save camera path")) SaveCameraPath(cameraPathFile, recordedPath);
+
 	ImGui::Checkbox("Acummulate pixel data", &accumulationEnabled);
+	ImGui::Combo("Heatmap", &heatmap, "Off\0DDA steps\0Shadow rays\0Bounces\0");
+	if (heatmap != HeatmapOff)
+	{
+		ImGui::SliderFloat("Heatmap scale", &heatmapScale, 0.0f, 1000.0f, heatmapScale > 0 ? "%.0f" : "auto");
+		ImGui::Text("Per pixel: mean %.1f, 99th percentile %u, max %u", heatmapMean, heatmapP99, heatmapMax);
+		ImGui::PlotHistogram("Pixels", heatmapHistogram, HEATMAPBINS, 0, 0, 0.0f, FLT_MAX, ImVec2(0, 80));
+	}
+	ImGui::Checkbox("Trace primary rays as packets", &packetTracing);
+	ImGui::Checkbox("Wavefront path tracing", &wavefront);
+	if (ImGui::Checkbox("Pin job threads to cores", &pinThreads)) Jobs().PinThreads(pinThreads);
+	float busy = 0;
+	for (uint i = 0; i < Jobs().ThreadCount(); i++) busy += Jobs().GetStats(i).busy;
+	ImGui::Text("%u threads, %.0f%% busy", Jobs().ThreadCount(), 100 * busy / (Jobs().ThreadCount() * frameTime * 0.001f));
+	if (!wavefront)
+		ImGui::Text("%u tiles stolen", scheduler.stolenTiles);
+	if (wavefront)
+		ImGui::Text("Extend %.2f ms, shade %.2f ms, shadow rays %.2f ms, output %.2f ms", stageTime[0], stageTime[1], stageTime[2], stageTime[3]);
+
+	if (ImGui::TreeNode("Profiler"))
+	{
+		const Profiler::FrameStats& stats = Profile().frame;
+		for (int i = 0; i < PROFILECOUNTERS; i++)
+			ImGui::Text("%-18s %12llu", Profiler::counterNames[i], (unsigned long long)stats.counters[i]);
+		ImGui::Text("Thread time per stage:");
+		for (int i = 0; i < PROFILESTAGES; i++)
+			ImGui::Text("%-18s %9.2f ms", Profiler::stageNames[i], stats.stageTime[i]);
+		ImGui::InputText("Trace file", traceFile, 256);
+		ImGui::InputInt("Frames", &traceFrames);
+		if (Profile().Capturing()) ImGui::Text("Capturing...");
+		else if (ImGui::Button("Capture trace")) Profile().CaptureTrace(traceFile, max(1, traceFrames));
+		ImGui::TreePop();
+	}
 
 	ImGui::End();
 
@@ -156,16 +305,80 @@ void Renderer::UI()
 
 	ImGui::InputText("", levelFilepath, 256);
 
-	if (ImGui::Button("Load level from a file"))
+	// the level loads in the background; Tick swaps it in when it is done
+	if (levelLoader.Busy())
 	{
-		scene.LoadLevelFromFile(levelFilepath);
-		selectedLightIndex = -1;
+		ImGui::ProgressBar(levelLoader.Progress(), ImVec2(0, 0), "Loading...");
 	}
+	else if (ImGui::Button("Load level from a file"))
+		levelLoader.Start(levelFilepath, scene.layout, scene.format);
 
 	ImGui::SameLine();
 
-	if (ImGui::Button("Save level to a file"))
-		scene.SaveLevelToFile(levelFilepath);
+	// grid levels are saved in the background, octree and mappable levels right away
+	if (levelSaver.Busy()) ImGui::Text("Saving...");
+	else if (ImGui::Button("Save level to a file"))
+	{
+		if (saveMappable || scene.backend == OctreeBackend) scene.SaveLevelToFile(levelFilepath, saveMappable);
+		else levelSaver.Start(scene, levelFilepath);
+	}
+
+	ImGui::SameLine();
+	ImGui::Checkbox("Uncompressed, mappable", &saveMappable);
+	ImGui::InputInt("Autosave every n seconds", &autosaveInterval);
+
+	// for levels too large to load: chunks are read from the file as they come into view
+	if (ImGui::Button("Stream level from a file"))
+		if (scene.StreamLevelFromFile(levelFilepath, (size_t)max(1, streamCacheSize) << 20)) prefetcher.Reset();
+	ImGui::SameLine();
+	ImGui::InputInt("Chunk cache MB", &streamCacheSize);
+
+	ImGui::InputText("Model file", modelFilepath, 256);
+	ImGui::InputInt3("Model position", modelOffset);
+	ImGui::Combo("Model rotation", &modelTurns, "0\0" "90\0" "180\0" "270\0");
+	if (ImGui::Button("Import voxel model"))
+		ImportVoxelModel(scene, modelFilepath, make_int3(modelOffset[0], modelOffset[1], modelOffset[2]), modelTurns);
+
+	ImGui::Text("World size: %u x %u x %u", scene.size.x, scene.size.y, scene.size.z);
+	ImGui::InputInt3("New world size", newWorldSize);
+
+	if (ImGui::Button("Generate default level"))
+		if (scene.Resize(make_uint3(newWorldSize[0], newWorldSize[1], newWorldSize[2])))
+			scene.LoadDefaultLevel();
+
+	int layout = scene.layout;
+	if (ImGui::Combo("Grid layout", &layout, "Linear\0Morton\0Tiled 4x4x4\0Tiled 8x8x8\0"))
+		scene.SetGridLayout((GridLayout)layout);
+
+	int format = scene.format;
+	if (ImGui::Combo("Grid keys", &format, "16-bit\08-bit palettes\0"))
+		scene.SetGridFormat((GridFormat)format);
+	if (scene.HasGrid())
+		ImGui::Text("Grid keys: %.1f MB", scene.GridMemoryUsage() / (1024.0f * 1024.0f));
+
+	if (ImGui::Button("Benchmark grid layouts"))
+		BenchmarkGridLayouts(scene);
+
+	ImGui::Checkbox("Deduplicate subtrees", &octreeDAG);
+	ImGui::SameLine();
+	if (ImGui::Button("Build octree"))
+		scene.BuildOctree(octreeDAG);
+
+	int backend = scene.backend;
+	if (ImGui::Combo("Backend", &backend, "Dense grid\0Sparse voxel octree\0Streamed chunks\0"))
+		scene.SetBackend((SceneBackend)backend);
+
+	if (scene.octree)
+		ImGui::Text("Octree: %.1f MB", scene.octree->MemoryUsage() / (1024.0f * 1024.0f));
+	ImGui::Checkbox("Prefetch chunks along the camera's path", &prefetchChunks);
+	if (scene.stream)
+	{
+		const StreamedWorld::Stats& stats = scene.stream->stats;
+		ImGui::Text("Streamed: %u of %u chunks resident, %.1f MB; %llu loaded, %llu evicted", scene.stream->ResidentChunks(), scene.stream->CacheChunks(),
+			scene.stream->MemoryUsage() / (1024.0f * 1024.0f), (unsigned long long)stats.loaded, (unsigned long long)stats.evicted);
+		ImGui::Text("Last frame: %u chunks hit, %u missed; prefetched %llu, %llu used, %llu wasted", stats.hits, stats.misses,
+			(unsigned long long)stats.prefetched, (unsigned long long)stats.prefetchUsed, (unsigned long long)stats.prefetchWasted);
+	}
 
 	if (ImGui::TreeNode("Lights"))
 	{
@@ -230,16 +443,16 @@ void Renderer::UI()
 				ImGui::PushID(it->first); // Just something unique
 
 				ImGui::TableSetColumnIndex(0);
-				ImGui::ColorEdit3("", (float*) &material.albedo);
+				if (ImGui::ColorEdit3("", (float*) &material.albedo)) scene.MaterialsChanged();
 
 				ImGui::PushID("metallic");
 				ImGui::TableSetColumnIndex(1);
-				ImGui::SliderFloat("", &material.metallic, 0.0f, 1.0f);
+				if (ImGui::SliderFloat("", &material.metallic, 0.0f, 1.0f)) scene.MaterialsChanged();
 				ImGui::PopID();
 
 				ImGui::PushID("roughness");
 				ImGui::TableSetColumnIndex(2);
-				ImGui::SliderFloat("", &material.roughness, 0.0f, 1.0f);
+				if (ImGui::SliderFloat("", &material.roughness, 0.0f, 1.0f)) scene.MaterialsChanged();
 				ImGui::PopID();
 
 				ImGui::PopID();
@@ -255,19 +468,19 @@ void Renderer::UI()
 
 		ImGui::SameLine();
 		if (ImGui::Button("Point"))
-			scene.lights.push_back(Light::CreatePoint());
+			scene.AddLight(Light::CreatePoint());
 
 		ImGui::SameLine();
 		if (ImGui::Button("Directional"))
-			scene.lights.push_back(Light::CreateDirectional());
+			scene.AddLight(Light::CreateDirectional());
 
 		ImGui::SameLine();
 		if (ImGui::Button("Spot"))
-			scene.lights.push_back(Light::CreateSpot());
+			scene.AddLight(Light::CreateSpot());
 
 		ImGui::SameLine();
 		if (ImGui::Button("Area"))
-			scene.lights.push_back(Light::CreateArea());
+			scene.AddLight(Light::CreateArea());
 	}
 	ImGui::End();	// "Scene" window
 
@@ -303,7 +516,8 @@ void Renderer::UI()
 		ImGui::ColorEdit3("Color", (float*) (&selectedLight.color));
 
 		if (lightType == Point || lightType == Spot)
-			ImGui::DragFloat3("Position", (float*)(&selectedLight.pos), 0.001f);
+			if (ImGui::DragFloat3("Position", (float*)(&selectedLight.pos), 0.001f))
+				scene.LightChanged(selectedLightIndex);
 
 		// Different thing then you think
 		if (lightType == Directional || lightType == Spot)
@@ -319,10 +533,13 @@ void Renderer::UI()
 		ImGui::DragFloat("Intensity", (&selectedLight.intensity), 0.001f);
 
 		if (lightType == Spot || lightType == Point)
-			ImGui::DragFloat("Range", (&selectedLight.range), 0.001f);
+			if (ImGui::DragFloat("Range", (&selectedLight.range), 0.001f))
+				scene.LightChanged(selectedLightIndex);
 
 		ImGui::End();
 	}
 
 	if (!areOperatingOnSelectedLight) selectedLightIndex = -1;
-}
\ No newline at end of file
+}
+
+#endif // HEADLESS
@@ -1,6 +1,8 @@
 #pragma once
 
 #define MAXRAYSTEPS 2
+#define ACCUMULATION_INDEX 0.8f
+#define HEATMAPBINS 64
 
 #include <vector>
 #include <array>
@@ -10,13 +12,52 @@
 namespace Tmpl8
 {
 
+// a compact queue of rays for the wavefront stages; Push may be called from parallel loops
+struct RayQueue
+{
+	vector<Ray> rays;
+	vector<float3> weights;	// path throughput, or for shadow rays the light they bring
+	vector<uint> pixels;
+	uint count = 0;
+
+	void Reset( const size_t capacity )
+	{
+		if (rays.size() < capacity) rays.resize( capacity ), weights.resize( capacity ), pixels.resize( capacity );
+		count = 0;
+	}
+	void Push( const Ray& ray, const float3& weight, const uint pixel )
+	{
+		const uint slot = AtomicAdd( count, 1 ) - 1;
+		rays[slot] = ray, weights[slot] = weight, pixels[slot] = pixel;
+	}
+};
+
+// debug view: pixels coloured by what they cost instead of shaded; DDA steps
+// are only counted with PROFILING, see profiler.h
+enum HeatmapMode
+{
+	HeatmapOff,
+	HeatmapDDASteps,
+	HeatmapShadowRays,
+	HeatmapBounces
+};
+
+// rays traced in a frame, by kind; counted per thread by the profiler
+struct RayCounts
+{
+	uint primary = 0, shadow = 0, bounce = 0;
+	uint Total() const { return primary + shadow + bounce; }
+};
+
 class Renderer : public TheApp
 {
 public:
 	// game flow methods
 	void Init();
 	void Tick( float deltaTime );
+#ifndef HEADLESS
 	void UI();
+#endif
 	void Shutdown() { /* nothing here for now */ }
 	// input handling
 	void MouseUp( int button ) { button = 0; /* implement if you want to detect mouse button presses */ }
@@ -39,23 +80,66 @@ public:
 	int2 mousePos;
 	int2 dMousePos;
 	Scene scene;
+	LevelLoader levelLoader;	// swaps levels in at the start of Tick
+	LevelSaver levelSaver;
+	int autosaveInterval = 0;	// seconds, 0 for off
+	Timer autosaveTimer;
 	Camera camera;
 
 	int selectedLightIndex = -1;
 
 	char levelFilepath[256] = "C:\\Projects\\VoxelRT\\level.bin";
+	bool saveMappable = false;	// store levels uncompressed, for memory mapped loading
+	int streamCacheSize = STREAMCACHESIZE;	// MB of chunks a streamed level keeps in memory
+	ChunkPrefetcher prefetcher;
+	bool prefetchChunks = true;
+	char modelFilepath[256] = "assets/ship.bin";
+	int modelOffset[3] = { 0, 0, 0 };
+	int modelTurns = 0;			// quarter turns about the y axis
+	int newWorldSize[3] = { WORLDSIZE, WORLDSIZE, WORLDSIZE }; // powers of 2
 	bool accumulationEnabled = true;
+	bool packetTracing = true;
+	bool octreeDAG = true;
+	bool wavefront = false;
+	bool pinThreads = false;
+	bool recordingPath = false;
+	vector<CameraPose> recordedPath;	// for voxelrt_bench, see benchmark.h
+	char cameraPathFile[256] = "camera_path.txt";
 
 	float frameTime, fps;
-	uint rayCount;
+	RayCounts frameRays;	// in the last frame
+	int traceFrames = 10;
+	char traceFile[256] = "trace.json";
 	float imageAccumulationIndex;
 
-	std::array<uint, RENDERHEIGHT> verticalIter;
-	std::array<uint, RENDERWIDTH> horizontalIter;
+	int heatmap = HeatmapOff;
+	float heatmapScale = 0;		// cost shown as red; 0: the 99th percentile of the frame
+	vector<uint> pixelCost;		// per pixel, for the heatmap
+	float heatmapHistogram[HEATMAPBINS];
+	uint heatmapMax = 0, heatmapP99 = 0;
+	float heatmapMean = 0;
+
+	TileScheduler scheduler;
 
 	// RT functions
+	bool StreamChunks();
+	void RenderFrame();
 	float3 Trace(Ray& ray, int rayStep);
+	float3 Shade(Ray& ray, int rayStep);
 	float3 GetSkyColor(Ray& ray);
+	void WriteHeatmap();
+
+	// wavefront path tracing, see wavefront.cpp
+	void TraceWavefront();
+	void GeneratePrimaryRays();
+	void ExtendPaths(const int rayStep);
+	void ShadePaths(const int rayStep);
+	void TraceShadowRays();
+	void WriteFrame();
+
+	RayQueue paths, bounces, shadows;
+	vector<float3> frameColor;
+	float stageTime[4] = {};	// ms per frame in: extend, shade, shadow rays, the rest
 };
 
 } // namespace Tmpl8
\ No newline at end of file
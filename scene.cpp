@@ -1,32 +1,473 @@
 #include "template.h"
 
-inline float intersect_cube( Ray& ray )
+// level file identification
+#define LEVELMAGIC		0x54525856	// "VXRT"
+#define OCTREEMAGIC		0x4f535856	// "VXSO", the level is stored as an octree
+#define MAPPEDMAGIC		0x4d525856	// "VXRM", the level is stored uncompressed, for memory mapping
+#define LEVELVERSION	2			// 1: raw grid and LevelData; 2: compressed chunks, see Scene::LevelHeader
+#define LEVELCHUNKSIZE	32			// edge of a level file chunk in voxels, power of 2; smaller worlds use their size
+#define LEGACYWORLDSIZE	128			// files without a header hold a fixed 128^3 grid
+#define MAPPEDALIGNMENT	4096		// sections of a mappable level start on a page boundary
+#define JOURNALMAGIC	0x4a525856	// "VXRJ", a journal record of an incremental save
+#define JOURNALMAXRECORDS	64		// compact the level file after this many incremental saves
+
+static uint worldGenerations = 0;	// see Scene::generation
+
+// the terrain of the default level, at a point in world space
+inline unsigned short default_level_key( const float x, const float y, const float z )
+{
+	return noise3D( x, y, z ) > 0.09f ? 1 : NOMATERIALKEY;
+}
+
+inline float intersect_box( Ray& ray, const float3& extent )
 {
 	// branchless slab method by Tavian
-	const float tx1 = -ray.O.x * ray.rD.x, tx2 = (1 - ray.O.x) * ray.rD.x;
+	const float tx1 = -ray.O.x * ray.rD.x, tx2 = (extent.x - ray.O.x) * ray.rD.x;
 	float ty, tz, tmin = min( tx1, tx2 ), tmax = max( tx1, tx2 );
-	const float ty1 = -ray.O.y * ray.rD.y, ty2 = (1 - ray.O.y) * ray.rD.y;
+	const float ty1 = -ray.O.y * ray.rD.y, ty2 = (extent.y - ray.O.y) * ray.rD.y;
 	ty = min( ty1, ty2 ), tmin = max( tmin, ty ), tmax = min( tmax, max( ty1, ty2 ) );
-	const float tz1 = -ray.O.z * ray.rD.z, tz2 = (1 - ray.O.z) * ray.rD.z;
+	const float tz1 = -ray.O.z * ray.rD.z, tz2 = (extent.z - ray.O.z) * ray.rD.z;
 	tz = min( tz1, tz2 ), tmin = max( tmin, tz ), tmax = min( tmax, max( tz1, tz2 ) );
 	if (tmin == tz) ray.axis = 2; else if (tmin == ty) ray.axis = 1;
 	return tmax >= tmin ? tmin : 1e34f;
 }
 
-inline bool point_in_cube( const float3& pos )
+inline bool point_in_box( const float3& pos, const float3& extent )
 {
-	// test if pos is inside the cube
+	// test if pos is inside the box
 	return pos.x >= 0 && pos.y >= 0 && pos.z >= 0 &&
-		pos.x <= 1 && pos.y <= 1 && pos.z <= 1;
+		pos.x <= extent.x && pos.y <= extent.y && pos.z <= extent.z;
+}
+
+// Skip the empty brick around the current cell, along with the empty bricks
+// around it that the distance field vouches for.
+inline bool skip_empty_bricks( Scene::DDAState& s, const uint distance, const uint3& size, uint& axis )
+{
+#if DISTANCEFIELD
+	const int r = (int)max( 1u, distance ) - 1;
+	const int3 brick = make_int3( s.X / BRICKSIZE, s.Y / BRICKSIZE, s.Z / BRICKSIZE );
+	const int3 last = make_int3( size.x >> BRICKSHIFT, size.y >> BRICKSHIFT, size.z >> BRICKSHIFT ) - 1;
+	const uint3 lo = make_uint3( max( brick - r, make_int3( 0 ) ) * BRICKSIZE );
+	const uint3 hi = make_uint3( min( brick + r, last ) * BRICKSIZE + (BRICKSIZE - 1) );
+	return skip_empty_box( s, lo, hi, size, axis );
+#else
+	return skip_empty_block( s, BRICKSIZE, size, axis );
+#endif
 }
 
-Scene::Scene()
+Scene::Scene( const bool defaultLevel )
 {
 	// Generate an emty grid
-	grid = (unsigned short*)MALLOC64(GRIDSIZE3 * sizeof(unsigned short));
-	memset(grid, 0, GRIDSIZE3 * sizeof(unsigned short));
+	grid = 0, cellOffsets = 0, brickOccupancy = 0, blockOccupancy = 0, brickDistance = 0;
+	Resize(make_uint3(WORLDSIZE));
+
+	if (defaultLevel) LoadDefaultLevel();
+}
+
+Scene::~Scene()
+{
+	ReleaseOctree();
+	ReleaseStream();
+	FreeGrid();
+}
+
+void Scene::Swap( Scene& other )
+{
+	lights.swap(other.lights);
+	materials.swap(other.materials);
+	materialsChanged = other.materialsChanged = true;
+	lightsChanged = other.lightsChanged = true;
+	swap(size, other.size);
+	swap(brickGridSize, other.brickGridSize);
+	swap(blockGridSize, other.blockGridSize);
+	swap(cellSize, other.cellSize);
+	swap(extent, other.extent);
+	swap(layout, other.layout);
+	swap(format, other.format);
+	swap(backend, other.backend);
+	swap(octree, other.octree);
+	swap(stream, other.stream);
+	swap(grid, other.grid);
+	swap(paletteGrid, other.paletteGrid);
+	swap(brickPalette, other.brickPalette);
+	palettes.swap(other.palettes);
+	paletteUsed.swap(other.paletteUsed);
+	swap(brickOccupancy, other.brickOccupancy);
+	swap(blockOccupancy, other.blockOccupancy);
+	swap(brickDistance, other.brickDistance);
+	swap(bulkEdit, other.bulkEdit);
+	swap(mappedLevel, other.mappedLevel);
+	swap(brickShift, other.brickShift);
+	swap(blockShift, other.blockShift);
+	swap(cellOffsets, other.cellOffsets);
+	swap(cellX, other.cellX);
+	swap(cellY, other.cellY);
+	swap(cellZ, other.cellZ);
+	swap(chunkEdge, other.chunkEdge);
+	swap(chunkGridSize, other.chunkGridSize);
+	swap(chunkShift, other.chunkShift);
+	dirtyChunks.swap(other.dirtyChunks);
+	swap(levelFile, other.levelFile);
+	swap(generation, other.generation);
+}
+
+bool Scene::SetWorldSize( const uint3& newSize, const uint maxShift )
+{
+	const uint3 shift = make_uint3( log2_pow2( newSize.x ), log2_pow2( newSize.y ), log2_pow2( newSize.z ) );
+	if ((1u << shift.x) != newSize.x || (1u << shift.y) != newSize.y || (1u << shift.z) != newSize.z ||
+		newSize.x < BRICKSIZE || newSize.y < BRICKSIZE || newSize.z < BRICKSIZE || shift.x + shift.y + shift.z > maxShift)
+	{
+		printf("Unsupported world size %ux%ux%u\n", newSize.x, newSize.y, newSize.z);
+		return false;
+	}
+
+	size = newSize;
+	brickGridSize = make_uint3( size.x >> BRICKSHIFT, size.y >> BRICKSHIFT, size.z >> BRICKSHIFT );
+	blockGridSize = make_uint3( size.x >> BLOCKSHIFT, size.y >> BLOCKSHIFT, size.z >> BLOCKSHIFT );
+	brickShift = make_uint3( 0, shift.x - BRICKSHIFT, shift.x + shift.y - 2 * BRICKSHIFT );
+	blockShift = make_uint3( 0, shift.x - BLOCKSHIFT, shift.x + shift.y - 2 * BLOCKSHIFT );
+	cellSize = 1.0f / max( size.x, max( size.y, size.z ) );
+	extent = make_float3( size ) * cellSize;
+	chunkEdge = make_uint3( min( size.x, (uint)LEVELCHUNKSIZE ), min( size.y, (uint)LEVELCHUNKSIZE ), min( size.z, (uint)LEVELCHUNKSIZE ) );
+	chunkGridSize = make_uint3( size.x / chunkEdge.x, size.y / chunkEdge.y, size.z / chunkEdge.z );
+	chunkShift = make_uint3( log2_pow2( chunkEdge.x ), log2_pow2( chunkEdge.y ), log2_pow2( chunkEdge.z ) );
+	// a new world: the next save writes all of it
+	dirtyChunks.assign( chunkGridSize.x * chunkGridSize.y * chunkGridSize.z, 0 );
+	levelFile = LevelFile();
+	generation = AtomicAdd( worldGenerations, 1 );
+	return true;
+}
+
+void Scene::FreeGrid()
+{
+	if (mappedLevel)
+	{
+		delete mappedLevel;
+		mappedLevel = 0;
+	}
+	else
+	{
+		FREE64(grid);
+		FREE64(brickOccupancy);
+		FREE64(blockOccupancy);
+		FREE64(brickDistance);
+	}
+	FREE64(cellOffsets);
+	FreePalettes();
+	grid = 0, cellOffsets = 0, brickOccupancy = 0, blockOccupancy = 0, brickDistance = 0;
+}
+
+void Scene::FreePalettes()
+{
+	FREE64(paletteGrid);
+	FREE64(brickPalette);
+	paletteGrid = 0, brickPalette = 0;
+	palettes.clear();
+	paletteUsed.clear();
+}
+
+void Scene::ReleaseOctree()
+{
+	delete octree;
+	octree = 0;
+	backend = GridBackend;
+}
+
+void Scene::ReleaseStream()
+{
+	delete stream;
+	stream = 0;
+	if (backend == StreamBackend) backend = GridBackend;
+}
+
+bool Scene::Resize( const uint3& newSize )
+{
+	if (!SetWorldSize(newSize, MAXWORLDSHIFT)) return false;
+
+	ReleaseOctree();
+	ReleaseStream();
+	FreeGrid();
+	const size_t cells = (size_t)size.x * size.y * size.z;
+	grid = (unsigned short*)MALLOC64(cells * sizeof(unsigned short));
+	cellOffsets = (uint*)MALLOC64((size.x + size.y + size.z) * sizeof(uint));
+	cellX = cellOffsets, cellY = cellX + size.x, cellZ = cellY + size.y;
+	BuildCellOffsets(layout, cellOffsets);
+	brickOccupancy = (uint*)MALLOC64((cells >> (3 * BRICKSHIFT)) * sizeof(uint));
+	blockOccupancy = (uint64_t*)MALLOC64((cells >> (3 * BLOCKSHIFT)) * sizeof(uint64_t));
+	brickDistance = (uchar*)MALLOC64((cells >> (3 * BRICKSHIFT)) * sizeof(uchar) + 64); // padded for 32-bit gathers
+	ClearGrid();
+	return true;
+}
+
+void Scene::BuildCellOffsets( const GridLayout newLayout, uint* offsets ) const
+{
+	uint* ox = offsets, *oy = ox + size.x, *oz = oy + size.y;
+	const uint3 shift = make_uint3( log2_pow2( size.x ), log2_pow2( size.y ), log2_pow2( size.z ) );
+	switch (newLayout)
+	{
+	case MortonLayout:
+	{
+		// interleave the bits, x first; an axis drops out of the interleave once its
+		// bits run out, which keeps the index dense for non-cubic worlds
+		for (uint i = 0; i < size.x; i++) ox[i] = 0;
+		for (uint i = 0; i < size.y; i++) oy[i] = 0;
+		for (uint i = 0; i < size.z; i++) oz[i] = 0;
+		for (uint bit = 0, pos = 0; pos < shift.x + shift.y + shift.z; bit++)
+		{
+			if (bit < shift.x) { for (uint i = 0; i < size.x; i++) ox[i] |= ((i >> bit) & 1) << pos; pos++; }
+			if (bit < shift.y) { for (uint i = 0; i < size.y; i++) oy[i] |= ((i >> bit) & 1) << pos; pos++; }
+			if (bit < shift.z) { for (uint i = 0; i < size.z; i++) oz[i] |= ((i >> bit) & 1) << pos; pos++; }
+		}
+	}
+	break;
+
+	case Tiled4Layout:
+	case Tiled8Layout:
+	{
+		// tiles of T^3 cells, linear within a tile and linear over the tiles
+		const uint t = newLayout == Tiled4Layout ? 2 : 3, T = 1 << t;
+		const uint tilesX = size.x >> t, tilesXY = tilesX * (size.y >> t);
+		for (uint i = 0; i < size.x; i++) ox[i] = ((i >> t) << (3 * t)) + (i & (T - 1));
+		for (uint i = 0; i < size.y; i++) oy[i] = (((i >> t) * tilesX) << (3 * t)) + ((i & (T - 1)) << t);
+		for (uint i = 0; i < size.z; i++) oz[i] = (((i >> t) * tilesXY) << (3 * t)) + ((i & (T - 1)) << (2 * t));
+	}
+	break;
+
+	default:
+		for (uint i = 0; i < size.x; i++) ox[i] = i;
+		for (uint i = 0; i < size.y; i++) oy[i] = i << shift.x;
+		for (uint i = 0; i < size.z; i++) oz[i] = i << (shift.x + shift.y);
+		break;
+	}
+}
+
+void Scene::SetGridLayout( const GridLayout newLayout )
+{
+	if (newLayout == layout || !HasGrid()) return;
+	ReleaseMapping();
+	uint* offsets = (uint*)MALLOC64((size.x + size.y + size.z) * sizeof(uint));
+	BuildCellOffsets(newLayout, offsets);
+	const uint* nx = offsets, *ny = nx + size.x, *nz = ny + size.y;
+	const size_t cells = (size_t)size.x * size.y * size.z;
+	if (paletteGrid)
+	{
+		// palettes are per brick, which no layout changes
+		uchar* newGrid = (uchar*)MALLOC64(cells);
+		Jobs().ParallelFor(0, (int)size.z, [&](int z)
+		{
+			for (uint y = 0; y < size.y; y++) for (uint x = 0; x < size.x; x++)
+				newGrid[nx[x] + ny[y] + nz[z]] = paletteGrid[CellIndex(x, y, z)];
+		});
+		FREE64(paletteGrid);
+		paletteGrid = newGrid;
+	}
+	else
+	{
+		unsigned short* newGrid = (unsigned short*)MALLOC64(cells * sizeof(unsigned short));
+		Jobs().ParallelFor(0, (int)size.z, [&](int z)
+		{
+			for (uint y = 0; y < size.y; y++) for (uint x = 0; x < size.x; x++)
+				newGrid[nx[x] + ny[y] + nz[z]] = grid[CellIndex(x, y, z)];
+		});
+		FREE64(grid);
+		grid = newGrid;
+	}
+	FREE64(cellOffsets);
+	cellOffsets = offsets, layout = newLayout;
+	cellX = cellOffsets, cellY = cellX + size.x, cellZ = cellY + size.y;
+}
+
+bool Scene::SetGridFormat( const GridFormat newFormat )
+{
+	if (!HasGrid()) return false;
+	// during a bulk edit the grid holds 16-bit keys anyway; EndBulkEdit converts it
+	if (newFormat == Palette8 && grid && !bulkEdit)
+	{
+		ReleaseMapping();
+		if (!CompactGrid()) return false;
+	}
+	if (newFormat == Keys16 && paletteGrid) ExpandGrid();
+	format = newFormat;
+	return true;
+}
+
+size_t Scene::GridMemoryUsage() const
+{
+	// the keys: the grid, and the palettes if any; not the occupancy
+	const size_t cells = (size_t)size.x * size.y * size.z;
+	if (paletteGrid) return cells + (cells >> (3 * BRICKSHIFT)) * sizeof(uint) + palettes.size() * sizeof(unsigned short);
+	return grid ? cells * sizeof(unsigned short) : 0;
+}
+
+bool Scene::CompactGrid()
+{
+	// how often each key occurs; the shared palette takes the most common ones
+	const size_t cells = (size_t)size.x * size.y * size.z;
+	const uint bricks = brickGridSize.x * brickGridSize.y * brickGridSize.z;
+	auto ForBrickVoxels = [&]( const uint bx, const uint by, const uint bz, auto&& f )
+	{
+		for (uint z = bz * BRICKSIZE; z < (bz + 1) * BRICKSIZE; z++) for (uint y = by * BRICKSIZE; y < (by + 1) * BRICKSIZE; y++)
+			for (uint x = bx * BRICKSIZE; x < (bx + 1) * BRICKSIZE; x++) f( CellIndex(x, y, z) );
+	};
+	vector<uint> counts(65536, 0);
+	Jobs().ParallelFor(0, (int)brickGridSize.z, [&](int bz)
+	{
+		vector<uint> local(65536, 0);
+		for (uint by = 0; by < brickGridSize.y; by++) for (uint bx = 0; bx < brickGridSize.x; bx++)
+			ForBrickVoxels(bx, by, bz, [&]( const uint cell ) { local[grid[cell]]++; });
+		for (uint key = 0; key < 65536; key++) if (local[key]) AtomicAdd(counts[key], (int)local[key]);
+	});
+	vector<pair<uint, unsigned short>> used;
+	for (uint key = 1; key < 65536; key++) if (counts[key]) used.push_back(make_pair(counts[key], (unsigned short)key));
+	sort(used.begin(), used.end(), []( const pair<uint, unsigned short>& a, const pair<uint, unsigned short>& b ) { return a.first > b.first; });
+	palettes.assign(PALETTESIZE, NOMATERIALKEY);
+	paletteUsed.assign(1, 1);
+	vector<short> sharedIndex(65536, -1);
+	sharedIndex[NOMATERIALKEY] = 0;
+	for (size_t i = 0; i < used.size() && paletteUsed[0] < PALETTESIZE; i++)
+		sharedIndex[used[i].second] = (short)paletteUsed[0], palettes[paletteUsed[0]++] = used[i].second;
+	// the bricks with other keys get a palette of their own
+	brickPalette = (uint*)MALLOC64(bricks * sizeof(uint));
+	memset(brickPalette, 0, bricks * sizeof(uint));
+	if (used.size() >= PALETTESIZE)
+	{
+		Jobs().ParallelFor(0, (int)brickGridSize.z, [&](int bz)
+		{
+			for (uint by = 0; by < brickGridSize.y; by++) for (uint bx = 0; bx < brickGridSize.x; bx++)
+			{
+				bool shared = true;
+				ForBrickVoxels(bx, by, bz, [&]( const uint cell ) { shared = shared && sharedIndex[grid[cell]] >= 0; });
+				if (!shared) brickPalette[bx + (by << brickShift.y) + (bz << brickShift.z)] = 1;
+			}
+		});
+		uint count = 1;
+		for (uint i = 0; i < bricks; i++) if (brickPalette[i]) brickPalette[i] = count++;
+		palettes.resize((size_t)count * PALETTESIZE, NOMATERIALKEY);
+		paletteUsed.resize(count, 1);
+	}
+	paletteGrid = (uchar*)MALLOC64(cells);
+	uint failed = 0;
+	Jobs().ParallelFor(0, (int)brickGridSize.z, [&](int bz)
+	{
+		for (uint by = 0; by < brickGridSize.y; by++) for (uint bx = 0; bx < brickGridSize.x; bx++)
+		{
+			const uint palette = brickPalette[bx + (by << brickShift.y) + (bz << brickShift.z)];
+			if (palette == 0)
+			{
+				ForBrickVoxels(bx, by, bz, [&]( const uint cell ) { paletteGrid[cell] = (uchar)sharedIndex[grid[cell]]; });
+				continue;
+			}
+			// the keys of the brick in the order they appear
+			unsigned short* keys = palettes.data() + (size_t)palette * PALETTESIZE;
+			uint& n = paletteUsed[palette];
+			bool fits = true;
+			ForBrickVoxels(bx, by, bz, [&]( const uint cell )
+			{
+				uint i = 0;
+				while (i < n && keys[i] != grid[cell]) i++;
+				if (i == PALETTESIZE) { fits = false; return; }
+				if (i == n) keys[n++] = grid[cell];
+				paletteGrid[cell] = (uchar)i;
+			});
+			if (!fits) AtomicAdd(failed, 1);
+		}
+	});
+	if (failed)
+	{
+		printf("%u bricks hold more than %i materials, the grid keeps 16-bit keys\n", failed, PALETTESIZE);
+		FreePalettes();
+		return false;
+	}
+	FREE64(grid);
+	grid = 0;
+	return true;
+}
+
+void Scene::ExpandGrid()
+{
+	grid = (unsigned short*)MALLOC64((size_t)size.x * size.y * size.z * sizeof(unsigned short));
+	Jobs().ParallelFor(0, (int)size.z, [&](int z)
+	{
+		for (uint y = 0; y < size.y; y++) for (uint x = 0; x < size.x; x++)
+		{
+			const uint cell = CellIndex(x, y, z);
+			grid[cell] = CellKey(cell, x, y, z);
+		}
+	});
+	FreePalettes();
+}
+
+bool Scene::SetPaletteKey( const uint x, const uint y, const uint z, const unsigned short materialKey )
+{
+	uint& palette = brickPalette[BrickIndex(x, y, z)];
+	unsigned short* keys = palettes.data() + (size_t)palette * PALETTESIZE;
+	for (uint i = 0; i < paletteUsed[palette]; i++) if (keys[i] == materialKey)
+	{
+		paletteGrid[CellIndex(x, y, z)] = (uchar)i;
+		return true;
+	}
+	if (paletteUsed[palette] < PALETTESIZE)
+	{
+		keys[paletteUsed[palette]] = materialKey;
+		paletteGrid[CellIndex(x, y, z)] = (uchar)paletteUsed[palette]++;
+		return true;
+	}
+	// the palette is full: the brick gets one of its own, with only the keys it still uses
+	const uint x0 = x & ~(BRICKSIZE - 1), y0 = y & ~(BRICKSIZE - 1), z0 = z & ~(BRICKSIZE - 1);
+	unsigned short newKeys[PALETTESIZE] = { NOMATERIALKEY };
+	uchar indices[BRICKSIZE * BRICKSIZE * BRICKSIZE];
+	uint n = 1, v = 0;
+	for (uint k = z0; k < z0 + BRICKSIZE; k++) for (uint j = y0; j < y0 + BRICKSIZE; j++) for (uint i = x0; i < x0 + BRICKSIZE; i++, v++)
+	{
+		const unsigned short key = (i == x && j == y && k == z) ? materialKey : GetMaterial(i, j, k);
+		uint index = 0;
+		while (index < n && newKeys[index] != key) index++;
+		if (index == PALETTESIZE) return false;
+		if (index == n) newKeys[n++] = key;
+		indices[v] = (uchar)index;
+	}
+	if (palette == 0)
+	{
+		palette = (uint)paletteUsed.size();
+		paletteUsed.push_back(0);
+		palettes.resize(palettes.size() + PALETTESIZE, NOMATERIALKEY);
+	}
+	memcpy(palettes.data() + (size_t)palette * PALETTESIZE, newKeys, n * sizeof(unsigned short));
+	paletteUsed[palette] = n, v = 0;
+	for (uint k = z0; k < z0 + BRICKSIZE; k++) for (uint j = y0; j < y0 + BRICKSIZE; j++) for (uint i = x0; i < x0 + BRICKSIZE; i++)
+		paletteGrid[CellIndex(i, j, k)] = indices[v++];
+	return true;
+}
 
-	LoadDefaultLevel();
+void Scene::BuildOctree( const bool dag )
+{
+	if (!HasGrid()) return;
+	if (!octree) octree = new SparseVoxelOctree();
+	octree->Build(*this, dag);
+	backend = OctreeBackend;
+}
+
+bool Scene::SetBackend( const SceneBackend newBackend )
+{
+	// a streamed level is never in memory as a whole
+	if (backend == StreamBackend || newBackend == StreamBackend) return newBackend == backend;
+	if (newBackend == OctreeBackend)
+	{
+		if (!octree) return false;
+		backend = OctreeBackend;
+		return true;
+	}
+	if (!HasGrid())
+	{
+		// an octree level: expand it into a new grid, keeping the octree around
+		SparseVoxelOctree* svo = octree;
+		octree = 0;
+		if (!Resize(size)) { octree = svo; return false; }
+		svo->Expand(*this);
+		octree = svo;
+	}
+	backend = GridBackend;
+	return true;
 }
 
 void Scene::LoadDefaultLevel()
@@ -37,140 +478,838 @@ void Scene::LoadDefaultLevel()
 		0.0f, 
 		1.0f
 	);
+	materialsChanged = true;
+
+	// the level is generated into the grid, any octree is out of date
+	if (!HasGrid()) Resize(make_uint3(WORLDSIZE));
+	ReleaseOctree();
+	ReleaseStream();
 
 	// initialize the scene using Perlin noise, parallel over z
-#pragma omp parallel for schedule(dynamic)
-	for (int z = 0; z < WORLDSIZE; z++)
+	BeginBulkEdit();
+	Jobs().ParallelFor(0, (int)size.z, [&](int z)
 	{
-		const float fz = (float)z / WORLDSIZE;
-		for (int y = 0; y < WORLDSIZE; y++)
+		const float fz = z * cellSize;
+		for (int y = 0; y < (int)size.y; y++)
 		{
-			float fx = 0, fy = (float)y / WORLDSIZE;
-			for (int x = 0; x < WORLDSIZE; x++, fx += 1.0f / WORLDSIZE)
+			float fx = 0, fy = y * cellSize;
+			for (int x = 0; x < (int)size.x; x++, fx += cellSize)
 			{
-				const float n = noise3D(fx, fy, fz);
-				SetMaterial(x, y, z, n > 0.09f ? 1 : NOMATERIALKEY);
+				SetMaterial(x, y, z, default_level_key(fx, fy, fz));
 			}
 		}
-	}
+	});
+	EndBulkEdit();
 }
 
 bool Scene::LoadLevelFromFile(const char* filepath)
 {
 	// Loading a level from a file
+	loadProgress = 0;
 	FILE* f = fopen(filepath, "rb");
 
-	// Moving some data to heap for effiecency and to save stack
-	SceneData* data = new SceneData();
+	if (!f)
+	{
+		printf("Failed to load the level.");
+		LoadDefaultLevel();
+		loadProgress = 1;
+		return false;
+	}
 
-	if (f)
+	LevelHeader header = {};
+	bool success = fread(&header, 1, sizeof(LevelHeader), f) == sizeof(LevelHeader);
+	const bool hasHeader = success && (header.magic == LEVELMAGIC || header.magic == OCTREEMAGIC || header.magic == MAPPEDMAGIC);
+	if (hasHeader && header.version != LEVELVERSION && (header.version != 1 || header.magic == MAPPEDMAGIC))
 	{
-		fread(data, 1, sizeof(SceneData), f);
-		fclose(f);
+		printf("Unsupported level version %u\n", header.version);
+		success = false;
 	}
-	else
+	// version 2 stores the lights and materials up front; older files end with a LevelData
+	const bool chunked = hasHeader && header.version == LEVELVERSION;
+	vector<Light> newLights;
+	map<unsigned short, Material> newMaterials;
+	if (success && header.magic == LEVELMAGIC)
+	{
+		success = Resize(header.size) && (chunked ? ReadLevelData(f, newLights, newMaterials) && ReadChunks(f) && ReadJournal(f, newLights, newMaterials) : ReadGrid(f));
+		if (success && chunked) levelFile.path = filepath;
+	}
+	else if (success && header.magic == OCTREEMAGIC)
+	{
+		// octree level: there is no grid, tracing runs on the octree
+		SparseVoxelOctree* svo = new SparseVoxelOctree();
+		uint words[3]; // depth, root, pool size
+		success = SetWorldSize(header.size, 3 * MAXOCTREEDEPTH) && (!chunked || ReadLevelData(f, newLights, newMaterials)) && fread(words, sizeof(uint), 3, f) == 3;
+		if (success)
+		{
+			svo->depth = words[0], svo->root = words[1];
+			svo->pool.resize(words[2]);
+			success = fread(svo->pool.data(), sizeof(uint), words[2], f) == words[2];
+		}
+		if (success)
+		{
+			FreeGrid();
+			ReleaseOctree();
+			ReleaseStream();
+			octree = svo, backend = OctreeBackend;
+		}
+		else delete svo;
+	}
+	else if (success && header.magic == MAPPEDMAGIC)
+	{
+		// the grid is not read at all: it is paged in from the file as the renderer touches it
+		MappedSections sections;
+		success = ReadLevelData(f, newLights, newMaterials) && fread(&sections, sizeof(MappedSections), 1, f) == 1 && MapGrid(filepath, header.size, sections);
+	}
+	else if (!hasHeader)
+	{
+		// legacy level: a bare 128^3 grid followed by the level data
+		success = Resize(make_uint3(LEGACYWORLDSIZE));
+		fseek(f, 0, SEEK_SET);
+		success = success && ReadGrid(f);
+	}
+	if (success && !chunked)
+	{
+		// Moving some data to heap for effiecency and to save stack
+		LevelData* data = new LevelData();
+		success = fread(data, 1, sizeof(LevelData), f) == sizeof(LevelData) && data->lightCount <= MAXLIGHTS && data->materialCount <= MAXMATERIALS;
+		if (success)
+		{
+			newLights.assign(data->lights, data->lights + data->lightCount);
+			for (uint i = 0; i < data->materialCount; i++) newMaterials[data->keysForMaterials[i]] = data->materials[i];
+		}
+		delete data;
+	}
+	fclose(f);
+
+	if (!success)
 	{
 		printf("Failed to load the level.");
+		Resize(make_uint3(WORLDSIZE));
 		LoadDefaultLevel();
-		delete data;
+		loadProgress = 1;
 		return false;
 	}
 
-	materials.clear();
-	for (uint i = 0; i < data->materialCount; i++)
+	materials.swap(newMaterials);
+	materialsChanged = true;
+	lights.swap(newLights);
+	lightsChanged = true;
+
+	// the grid was read as is, derive the acceleration structure from it; chunked
+	// levels did the occupancy per chunk, mappable levels store all of it
+	if (grid && !mappedLevel)
+	{
+		loadProgress = 0.9f;
+		if (!chunked) UpdateOccupancy();
+		UpdateDistanceField(make_int3(0), make_int3(brickGridSize) - 1);
+		if (format == Palette8 && !CompactGrid()) format = Keys16;
+	}
+	loadProgress = 1;
+
+	return true;
+}
+
+bool Scene::SaveLevelToFile(const char* filepath, const bool mappable)
+{
+	if (backend == StreamBackend)
 	{
-		materials[data->keysForMaterials[i]] = data->materials[i];
+		printf("A streamed level can't be saved\n");
+		return false;
 	}
+	// the file may be the one the grid is mapped from; rewriting it would pull the pages
+	// that were not read yet out from under the grid
+	ReleaseMapping();
 
-	memset(grid, 0, GRIDSIZE3 * sizeof(unsigned short));
+	// Save a level to the file
+	FILE* f = fopen(filepath, "wb");
 
-	// Let's not do it using memset, just afraid of doing something wrong
-#pragma omp parallel for schedule(dynamic)
-	for (int z = 0; z < WORLDSIZE; z++)
+	if (!f)
 	{
-		for (int y = 0; y < WORLDSIZE; y++)
-		{
-			for (int x = 0; x < WORLDSIZE; x++)
-			{
-				SetMaterial(x, y, z, data->grid[x + y * GRIDSIZE + z * GRIDSIZE2]);
-			}
-		}
+		printf("Failed to save the level");
+		return false;
 	}
 
-	lights.clear();
-	for (uint i = 0; i < data->lightCount; i++)
+	// an octree level has no grid to map, it is always stored as an octree
+	const uint magic = backend == OctreeBackend ? OCTREEMAGIC : mappable ? MAPPEDMAGIC : LEVELMAGIC;
+	const LevelHeader header = { magic, LEVELVERSION, size };
+	bool success = fwrite(&header, 1, sizeof(LevelHeader), f) == sizeof(LevelHeader) && WriteLevelData(f, lights, materials);
+	if (backend == OctreeBackend)
 	{
-		lights.push_back(data->lights[i]);
+		const uint words[3] = { octree->depth, octree->root, (uint)octree->pool.size() };
+		success = success && fwrite(words, sizeof(uint), 3, f) == 3;
+		success = success && fwrite(octree->pool.data(), sizeof(uint), octree->pool.size(), f) == octree->pool.size();
 	}
+	else if (mappable) success = success && WriteMappedGrid(f);
+	else success = success && WriteChunks(f);
+	const uint64_t bytes = tell_file(f);
+	fclose(f);
 
-	delete data;
+	// a grid saved as chunks can be saved incrementally from here on
+	levelFile = LevelFile();
+	if (success && magic == LEVELMAGIC)
+	{
+		levelFile.path = filepath, levelFile.bytes = levelFile.baseBytes = bytes;
+		fill(dirtyChunks.begin(), dirtyChunks.end(), 0);
+	}
+	if (!success) printf("Failed to save the level");
+	return success;
+}
 
+bool Scene::ReadLevelData( FILE* f, vector<Light>& newLights, map<unsigned short, Material>& newMaterials )
+{
+	// version 2: only the lights and materials that exist
+	uint lightCount, materialCount;
+	if (fread(&lightCount, sizeof(uint), 1, f) != 1 || lightCount > 0xffff) return false;
+	newLights.resize(lightCount);
+	if (fread(newLights.data(), sizeof(Light), lightCount, f) != lightCount) return false;
+	if (fread(&materialCount, sizeof(uint), 1, f) != 1 || materialCount > 0x10000) return false;
+	vector<unsigned short> keys(materialCount);
+	vector<Material> values(materialCount);
+	if (fread(keys.data(), sizeof(unsigned short), materialCount, f) != materialCount) return false;
+	if (fread(values.data(), sizeof(Material), materialCount, f) != materialCount) return false;
+	for (uint i = 0; i < materialCount; i++) newMaterials[keys[i]] = values[i];
 	return true;
 }
 
-bool Scene::SaveLevelToFile(const char* filepath)
+bool Scene::WriteLevelData( FILE* f, const vector<Light>& lights, const map<unsigned short, Material>& materials )
 {
-	// Save a level to the file
-	FILE* f = fopen(filepath, "wb");
+	const uint lightCount = (uint)lights.size(), materialCount = (uint)materials.size();
+	vector<unsigned short> keys;
+	vector<Material> values;
+	for (const auto& m : materials) keys.push_back(m.first), values.push_back(m.second);
+	return fwrite(&lightCount, sizeof(uint), 1, f) == 1 && fwrite(lights.data(), sizeof(Light), lightCount, f) == lightCount &&
+		fwrite(&materialCount, sizeof(uint), 1, f) == 1 && fwrite(keys.data(), sizeof(unsigned short), materialCount, f) == materialCount &&
+		fwrite(values.data(), sizeof(Material), materialCount, f) == materialCount;
+}
+
+bool Scene::ReadGrid( FILE* f )
+{
+	// the file holds the grid in linear order; scatter it slice by slice
+	const uint sliceSize = size.x * size.y;
+	unsigned short* slice = new unsigned short[sliceSize];
+	bool success = true;
+	for (uint z = 0; z < size.z && success; z++)
+	{
+		success = fread(slice, sizeof(unsigned short), sliceSize, f) == sliceSize;
+		for (uint y = 0, i = 0; y < size.y; y++) for (uint x = 0; x < size.x; x++, i++) grid[CellIndex(x, y, z)] = slice[i];
+		loadProgress = 0.9f * (z + 1) / size.z;
+	}
+	delete[] slice;
+	return success;
+}
+
+// compress the keys of a chunk; 'packed' is left empty for a chunk without solid voxels
+static bool PackChunk( const unsigned short* keys, const uint voxels, vector<uchar>& packed )
+{
+	packed.clear();
+	bool empty = true;
+	for (uint i = 0; i < voxels && empty; i++) empty = keys[i] == NOMATERIALKEY;
+	if (empty) return true;
+	uLongf bytes = compressBound(voxels * sizeof(unsigned short));
+	packed.resize(bytes);
+	const bool success = compress2(packed.data(), &bytes, (const Bytef*)keys, voxels * sizeof(unsigned short), Z_DEFAULT_COMPRESSION) == Z_OK;
+	packed.resize(success ? bytes : 0);
+	return success;
+}
+
+// the chunk count, the chunk table and the chunks; empty chunks are left out, unless
+// a journal record has to store that they became empty
+static bool WritePackedChunks( FILE* f, const vector<uint>& indices, const vector<vector<uchar>>& packed, const bool keepEmpty )
+{
+	vector<Scene::LevelChunk> table;
+	for (size_t i = 0; i < indices.size(); i++) if (keepEmpty || !packed[i].empty()) table.push_back(Scene::LevelChunk{ indices[i], (uint)packed[i].size() });
+	const uint count = (uint)table.size();
+	bool success = fwrite(&count, sizeof(uint), 1, f) == 1 && fwrite(table.data(), sizeof(Scene::LevelChunk), count, f) == count;
+	for (size_t i = 0; i < indices.size(); i++) success = success && fwrite(packed[i].data(), 1, packed[i].size(), f) == packed[i].size();
+	return success;
+}
 
-	// Moving some data to heap for effiecency and to save stack
-	SceneData* data = new SceneData();
+void Scene::GatherChunk( const uint index, unsigned short* keys ) const
+{
+	const uint x0 = index % chunkGridSize.x * chunkEdge.x, y0 = index / chunkGridSize.x % chunkGridSize.y * chunkEdge.y;
+	const uint z0 = index / (chunkGridSize.x * chunkGridSize.y) * chunkEdge.z;
+	for (uint z = z0; z < z0 + chunkEdge.z; z++) for (uint y = y0; y < y0 + chunkEdge.y; y++) for (uint x = x0; x < x0 + chunkEdge.x; x++)
+		*keys++ = GetMaterial(x, y, z);
+}
 
-	if (f)
+bool Scene::ReadChunks( FILE* f )
+{
+	// chunks that are not stored keep what the grid holds: nothing after Resize, or for
+	// a journal record, the level so far
+	const uint voxels = chunkEdge.x * chunkEdge.y * chunkEdge.z, total = (uint)dirtyChunks.size();
+	uint count;
+	if (fread(&count, sizeof(uint), 1, f) != 1 || count > total) return false;
+	vector<LevelChunk> table(count);
+	if (fread(table.data(), sizeof(LevelChunk), count, f) != count) return false;
+	// one read for all chunks, then decompress them on all threads straight into the grid
+	vector<size_t> offsets(count + 1, 0);
+	for (uint i = 0; i < count; i++) offsets[i + 1] = offsets[i] + table[i].compressedSize;
+	vector<uchar> packed(offsets[count]);
+	if (fread(packed.data(), 1, packed.size(), f) != packed.size()) return false;
+	uint failed = 0, done = 0;
+	Jobs().ParallelFor(0, (int)count, [&](int i)
 	{
-		// Let's not do it using memset, just afraid of doing something wrong
-#pragma omp parallel for schedule(dynamic)
-		for (int z = 0; z < WORLDSIZE; z++)
+		const LevelChunk& chunk = table[i];
+		// a compressed size of 0: the chunk became empty
+		vector<unsigned short> keys(voxels, NOMATERIALKEY);
+		uLongf bytes = voxels * sizeof(unsigned short);
+		if (chunk.index >= total || (chunk.compressedSize && (uncompress((Bytef*)keys.data(), &bytes, packed.data() + offsets[i], chunk.compressedSize) != Z_OK ||
+			bytes != voxels * sizeof(unsigned short))))
 		{
-			for (int y = 0; y < WORLDSIZE; y++)
-			{
-				for (int x = 0; x < WORLDSIZE; x++)
-				{
-					data->grid[x + y * GRIDSIZE + z * GRIDSIZE2] = grid[x + y * GRIDSIZE + z * GRIDSIZE2];
-				}
-			}
+			AtomicAdd(failed, 1);
+			return;
 		}
+		const uint x0 = chunk.index % chunkGridSize.x * chunkEdge.x, y0 = chunk.index / chunkGridSize.x % chunkGridSize.y * chunkEdge.y;
+		const uint z0 = chunk.index / (chunkGridSize.x * chunkGridSize.y) * chunkEdge.z;
+		const unsigned short* key = keys.data();
+		for (uint z = z0; z < z0 + chunkEdge.z; z++) for (uint y = y0; y < y0 + chunkEdge.y; y++) for (uint x = x0; x < x0 + chunkEdge.x; x++)
+			grid[CellIndex(x, y, z)] = *key++;
+		// chunks are whole bricks
+		for (uint bz = z0 / BRICKSIZE; bz < (z0 + chunkEdge.z) / BRICKSIZE; bz++) for (uint by = y0 / BRICKSIZE; by < (y0 + chunkEdge.y) / BRICKSIZE; by++)
+			for (uint bx = x0 / BRICKSIZE; bx < (x0 + chunkEdge.x) / BRICKSIZE; bx++) UpdateBrickOccupancy(bx, by, bz);
+		loadProgress = 0.9f * AtomicAdd(done, 1) / count;
+	});
+	if (failed) printf("%u damaged chunks in the level\n", failed);
+	return failed == 0;
+}
+
+bool Scene::WriteChunks( FILE* f ) const
+{
+	// compress all chunks in parallel; chunks without solid voxels are left out
+	const uint voxels = chunkEdge.x * chunkEdge.y * chunkEdge.z, total = (uint)dirtyChunks.size();
+	vector<vector<uchar>> packed(total);
+	vector<uint> indices(total);
+	uint failed = 0;
+	Jobs().ParallelFor(0, (int)total, [&](int i)
+	{
+		vector<unsigned short> keys(voxels);
+		GatherChunk(i, keys.data());
+		if (!PackChunk(keys.data(), voxels, packed[i])) AtomicAdd(failed, 1);
+		indices[i] = i;
+	});
+	return !failed && WritePackedChunks(f, indices, packed, false);
+}
+
+// the chunk table of a level or journal record: where each chunk is in the file
+static bool ReadChunkTable( FILE* f, const uint64_t end, vector<StreamedWorld::ChunkSource>& sources )
+{
+	uint count;
+	if (fread(&count, sizeof(uint), 1, f) != 1 || count > sources.size()) return false;
+	vector<Scene::LevelChunk> table(count);
+	if (fread(table.data(), sizeof(Scene::LevelChunk), count, f) != count) return false;
+	uint64_t offset = tell_file(f);
+	for (const Scene::LevelChunk& chunk : table)
+	{
+		if (chunk.index >= sources.size()) return false;
+		sources[chunk.index].offset = offset, sources[chunk.index].bytes = chunk.compressedSize;
+		offset += chunk.compressedSize;
+	}
+	return offset <= end && seek_file(f, offset);
+}
 
-		data->lightCount = static_cast<unsigned int>(lights.size());
+bool Scene::StreamLevelFromFile(const char* filepath, const size_t cacheBytes)
+{
+	FILE* f = fopen(filepath, "rb");
+	if (!f)
+	{
+		printf("Failed to load the level.");
+		return false;
+	}
+	LevelHeader header = {};
+	bool success = fread(&header, 1, sizeof(LevelHeader), f) == sizeof(LevelHeader);
+	if (success && (header.magic != LEVELMAGIC || header.version != LEVELVERSION))
+	{
+		printf("Only compressed grid levels can be streamed\n");
+		success = false;
+	}
+	seek_file_end(f);
+	const uint64_t end = tell_file(f);
+	seek_file(f, sizeof(LevelHeader));
+	// only the tables are read: the chunk of each index in the level, or in the last
+	// journal record that holds it
+	vector<Light> newLights;
+	map<unsigned short, Material> newMaterials;
+	vector<StreamedWorld::ChunkSource> sources;
+	success = success && SetWorldSize(header.size, STREAMMAXSHIFT) && ReadLevelData(f, newLights, newMaterials);
+	if (success)
+	{
+		sources.resize(dirtyChunks.size());
+		success = ReadChunkTable(f, end, sources);
+	}
+	LevelJournalRecord record;
+	while (success && fread(&record, sizeof(LevelJournalRecord), 1, f) == 1 && record.magic == JOURNALMAGIC && record.bytes <= end - tell_file(f))
+	{
+		newLights.clear();
+		newMaterials.clear();
+		success = ReadLevelData(f, newLights, newMaterials) && ReadChunkTable(f, end, sources);
+	}
+	fclose(f);
+	StreamedWorld* world = new StreamedWorld();
+	if (!success || !world->Open(filepath, size, chunkEdge, sources, cacheBytes))
+	{
+		delete world;
+		printf("Failed to load the level.");
+		Resize(make_uint3(WORLDSIZE));
+		LoadDefaultLevel();
+		return false;
+	}
+	FreeGrid();
+	ReleaseOctree();
+	ReleaseStream();
+	stream = world, backend = StreamBackend;
+	materials.swap(newMaterials);
+	materialsChanged = true;
+	lights.swap(newLights);
+	lightsChanged = true;
+	return true;
+}
 
-		for (uint i = 0; i < data->lightCount; i++)
+bool Scene::GenerateLevelFile(const char* filepath, const uint3& newSize)
+{
+	const uint3 shift = make_uint3( log2_pow2( newSize.x ), log2_pow2( newSize.y ), log2_pow2( newSize.z ) );
+	if ((1u << shift.x) != newSize.x || (1u << shift.y) != newSize.y || (1u << shift.z) != newSize.z ||
+		newSize.x < BRICKSIZE || newSize.y < BRICKSIZE || newSize.z < BRICKSIZE || shift.x + shift.y + shift.z > STREAMMAXSHIFT)
+	{
+		printf("Unsupported world size %ux%ux%u\n", newSize.x, newSize.y, newSize.z);
+		return false;
+	}
+	const uint3 edge = make_uint3( min( newSize.x, (uint)LEVELCHUNKSIZE ), min( newSize.y, (uint)LEVELCHUNKSIZE ), min( newSize.z, (uint)LEVELCHUNKSIZE ) );
+	const uint3 chunkGrid = make_uint3( newSize.x / edge.x, newSize.y / edge.y, newSize.z / edge.z );
+	const float cellSize = 1.0f / max( newSize.x, max( newSize.y, newSize.z ) );
+	FILE* f = fopen(filepath, "wb");
+	if (!f)
+	{
+		printf("Failed to save the level");
+		return false;
+	}
+	// every chunk gets a table entry, so the table can be written up front and filled in
+	// at the end; chunks without solid voxels are stored with a size of 0
+	const uint total = chunkGrid.x * chunkGrid.y * chunkGrid.z, voxels = edge.x * edge.y * edge.z;
+	vector<LevelChunk> table(total);
+	map<unsigned short, Material> levelMaterials;
+	levelMaterials[1] = Material(float3(0.9f, 0.9f, 0.9f), 0.0f, 1.0f);
+	const LevelHeader header = { LEVELMAGIC, LEVELVERSION, newSize };
+	bool success = fwrite(&header, 1, sizeof(LevelHeader), f) == sizeof(LevelHeader) && WriteLevelData(f, vector<Light>(), levelMaterials) &&
+		fwrite(&total, sizeof(uint), 1, f) == 1;
+	const uint64_t tableOffset = tell_file(f);
+	success = success && fwrite(table.data(), sizeof(LevelChunk), total, f) == total;
+	// a batch of chunks at a time, generated and compressed on all threads
+	const uint batchSize = 256;
+	vector<vector<uchar>> packed(batchSize);
+	uint failed = 0;
+	for (uint first = 0; first < total && success; first += batchSize)
+	{
+		const uint count = min(batchSize, total - first);
+		Jobs().ParallelFor(0, (int)count, [&](int i)
+		{
+			const uint index = first + i;
+			const uint x0 = index % chunkGrid.x * edge.x, y0 = index / chunkGrid.x % chunkGrid.y * edge.y, z0 = index / (chunkGrid.x * chunkGrid.y) * edge.z;
+			vector<unsigned short> keys(voxels);
+			unsigned short* key = keys.data();
+			for (uint z = z0; z < z0 + edge.z; z++) for (uint y = y0; y < y0 + edge.y; y++) for (uint x = x0; x < x0 + edge.x; x++)
+				*key++ = default_level_key(x * cellSize, y * cellSize, z * cellSize);
+			if (!PackChunk(keys.data(), voxels, packed[i])) AtomicAdd(failed, 1);
+		});
+		for (uint i = 0; i < count && success; i++)
 		{
-			data->lights[i] = lights.at(i);
+			table[first + i] = LevelChunk{ first + i, (uint)packed[i].size() };
+			success = fwrite(packed[i].data(), 1, packed[i].size(), f) == packed[i].size();
 		}
+		success = success && !failed;
+	}
+	success = success && seek_file(f, tableOffset) && fwrite(table.data(), sizeof(LevelChunk), total, f) == total;
+	success = fclose(f) == 0 && success;
+	if (!success) printf("Failed to save the level");
+	return success;
+}
+
+bool Scene::ReadJournal( FILE* f, vector<Light>& newLights, map<unsigned short, Material>& newMaterials )
+{
+	// the records of incremental saves, each with all lights and materials; a record that
+	// is cut short, by a save that did not complete, ends the journal
+	const uint64_t base = tell_file(f);
+	seek_file_end(f);
+	const uint64_t end = tell_file(f);
+	seek_file(f, base);
+	levelFile.bytes = levelFile.baseBytes = base, levelFile.records = 0;
+	LevelJournalRecord record;
+	while (fread(&record, sizeof(LevelJournalRecord), 1, f) == 1 && record.magic == JOURNALMAGIC && record.bytes <= end - tell_file(f))
+	{
+		newLights.clear();
+		newMaterials.clear();
+		if (!ReadLevelData(f, newLights, newMaterials) || !ReadChunks(f)) return false;
+		levelFile.bytes = tell_file(f), levelFile.records++;
+	}
+	return true;
+}
+
+bool Scene::TakeSnapshot( const char* filepath, LevelSnapshot& snapshot )
+{
+	if (!HasGrid()) return false;
+	// incremental if the file still holds the level as last loaded or saved; a file that
+	// is shorter than that has been written by someone else
+	bool shorter = true;
+	if (FILE* f = fopen(filepath, "rb")) shorter = !seek_file_end(f) || tell_file(f) < levelFile.bytes, fclose(f);
+	snapshot.full = levelFile.path != filepath || shorter;
+	// a full save replaces the file, which may be the one the grid is mapped from
+	if (snapshot.full) ReleaseMapping();
+	snapshot.file = snapshot.full ? LevelFile() : levelFile;
+	snapshot.file.path = filepath;
+	snapshot.generation = generation;
+	snapshot.size = size;
+	snapshot.lights = lights;
+	snapshot.materials = materials;
+	snapshot.chunkVoxels = chunkEdge.x * chunkEdge.y * chunkEdge.z;
+	snapshot.chunks.clear();
+	for (uint i = 0; i < (uint)dirtyChunks.size(); i++) if (snapshot.full || dirtyChunks[i]) snapshot.chunks.push_back(i), dirtyChunks[i] = 0;
+	snapshot.keys.resize(snapshot.chunks.size() * snapshot.chunkVoxels);
+	Jobs().ParallelFor(0, (int)snapshot.chunks.size(), [&](int i)
+	{
+		GatherChunk(snapshot.chunks[i], snapshot.keys.data() + (size_t)i * snapshot.chunkVoxels);
+	});
+	return true;
+}
+
+// replace 'file' by 'temp'; a reader sees either the old or the new file
+static bool ReplaceLevelFile( const string& temp, const string& file )
+{
+#ifdef _WIN32
+	return MoveFileExA(temp.c_str(), file.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return rename(temp.c_str(), file.c_str()) == 0;
+#endif
+}
+
+bool Scene::WriteSnapshot( LevelSnapshot& snapshot )
+{
+	vector<vector<uchar>> packed(snapshot.chunks.size());
+	uint failed = 0;
+	Jobs().ParallelFor(0, (int)snapshot.chunks.size(), [&](int i)
+	{
+		if (!PackChunk(snapshot.keys.data() + (size_t)i * snapshot.chunkVoxels, snapshot.chunkVoxels, packed[i])) AtomicAdd(failed, 1);
+	});
+	if (failed) return false;
+	LevelFile& file = snapshot.file;
+	if (snapshot.full)
+	{
+		// a new file, written next to the old one, which it replaces once it is complete
+		const string temp = file.path + ".tmp";
+		FILE* f = fopen(temp.c_str(), "wb");
+		if (!f) return false;
+		const LevelHeader header = { LEVELMAGIC, LEVELVERSION, snapshot.size };
+		bool success = fwrite(&header, 1, sizeof(LevelHeader), f) == sizeof(LevelHeader) && WriteLevelData(f, snapshot.lights, snapshot.materials) &&
+			WritePackedChunks(f, snapshot.chunks, packed, false);
+		file.bytes = file.baseBytes = tell_file(f), file.records = 0;
+		success = fclose(f) == 0 && success;
+		return success && ReplaceLevelFile(temp, file.path);
+	}
+	// a journal record after the valid part of the file
+	uint64_t bytes = 3 * sizeof(uint) + snapshot.lights.size() * sizeof(Light) + snapshot.materials.size() * (sizeof(unsigned short) + sizeof(Material)) +
+		snapshot.chunks.size() * sizeof(LevelChunk);
+	for (const vector<uchar>& chunk : packed) bytes += chunk.size();
+	FILE* f = fopen(file.path.c_str(), "r+b");
+	if (!f) return false;
+	const LevelJournalRecord record = { JOURNALMAGIC, (uint)bytes };
+	bool success = bytes <= 0xffffffffu && seek_file(f, file.bytes) && fwrite(&record, sizeof(LevelJournalRecord), 1, f) == 1 &&
+		WriteLevelData(f, snapshot.lights, snapshot.materials) && WritePackedChunks(f, snapshot.chunks, packed, true);
+	success = fclose(f) == 0 && success;
+	if (!success) return false;
+	file.bytes += sizeof(LevelJournalRecord) + bytes, file.records++;
+	if (file.records < JOURNALMAXRECORDS && file.bytes - file.baseBytes <= file.baseBytes) return true;
+	return CompactLevelFile(file);
+}
 
-		data->materialCount = static_cast<unsigned int>(materials.size());
-		
-		if (data->materialCount > MAXMATERIALS)
+bool Scene::CompactLevelFile( LevelFile& file )
+{
+	// merge the journal into the level: only the latest version of every chunk is kept,
+	// as it was compressed, so this needs neither the grid nor zlib
+	FILE* f = fopen(file.path.c_str(), "rb");
+	if (!f) return false;
+	LevelHeader header;
+	vector<Light> lights;
+	map<unsigned short, Material> materials;
+	map<uint, vector<uchar>> chunks;
+	bool success = fread(&header, sizeof(LevelHeader), 1, f) == 1 && header.magic == LEVELMAGIC && header.version == LEVELVERSION;
+	const uint3 edge = make_uint3( min( header.size.x, (uint)LEVELCHUNKSIZE ), min( header.size.y, (uint)LEVELCHUNKSIZE ), min( header.size.z, (uint)LEVELCHUNKSIZE ) );
+	const uint total = success ? (header.size.x / edge.x) * (header.size.y / edge.y) * (header.size.z / edge.z) : 0;
+	for (uint record = 0; record <= file.records && success; record++)
+	{
+		LevelJournalRecord journal;
+		if (record > 0) success = fread(&journal, sizeof(LevelJournalRecord), 1, f) == 1 && journal.magic == JOURNALMAGIC;
+		lights.clear(), materials.clear();
+		uint count;
+		success = success && ReadLevelData(f, lights, materials) && fread(&count, sizeof(uint), 1, f) == 1 && count <= total;
+		vector<LevelChunk> table(success ? count : 0);
+		success = success && fread(table.data(), sizeof(LevelChunk), count, f) == count;
+		for (uint i = 0; i < table.size() && success; i++)
 		{
-			printf("Material count is exceeding, not all the materials will be saved");
-			data->materialCount = MAXMATERIALS;
+			if (table[i].index >= total) success = false;
+			else if (!table[i].compressedSize) chunks.erase(table[i].index);
+			else
+			{
+				vector<uchar>& chunk = chunks[table[i].index];
+				chunk.resize(table[i].compressedSize);
+				success = fread(chunk.data(), 1, chunk.size(), f) == chunk.size();
+			}
 		}
+	}
+	fclose(f);
+	if (!success) return false;
+	vector<uint> indices;
+	vector<vector<uchar>> packed;
+	for (auto& chunk : chunks) indices.push_back(chunk.first), packed.push_back(move(chunk.second));
+	const string temp = file.path + ".tmp";
+	f = fopen(temp.c_str(), "wb");
+	if (!f) return false;
+	success = fwrite(&header, sizeof(LevelHeader), 1, f) == 1 && WriteLevelData(f, lights, materials) && WritePackedChunks(f, indices, packed, false);
+	const uint64_t bytes = tell_file(f);
+	success = fclose(f) == 0 && success && ReplaceLevelFile(temp, file.path);
+	if (success) file.bytes = file.baseBytes = bytes, file.records = 0;
+	return success;
+}
 
-		auto it = materials.begin();
+void Scene::SnapshotWritten( const LevelSnapshot& snapshot, const bool success )
+{
+	// a level that was replaced in the meantime has nothing to do with the file
+	if (snapshot.generation != generation) return;
+	if (success) levelFile = snapshot.file;
+	else
+	{
+		// the changes in the snapshot did not make it: the next save writes everything
+		levelFile = LevelFile();
+	}
+}
+
+bool Scene::MapGrid( const char* filepath, const uint3& newSize, const MappedSections& sections )
+{
+	MappedFile* file = new MappedFile();
+	if (!SetWorldSize(newSize, MAXWORLDSHIFT) || !file->Open(filepath)) { delete file; return false; }
+	const size_t cells = (size_t)size.x * size.y * size.z, bricks = cells >> (3 * BRICKSHIFT), blocks = cells >> (3 * BLOCKSHIFT);
+	const uint64_t offset[4] = { sections.grid, sections.brickOccupancy, sections.blockOccupancy, sections.brickDistance };
+	const uint64_t bytes[4] = { cells * sizeof(unsigned short), bricks * sizeof(uint), blocks * sizeof(uint64_t), bricks * sizeof(uchar) + 64 };
+	for (int i = 0; i < 4; i++) if (offset[i] % 64 || offset[i] > file->Size() || bytes[i] > file->Size() - offset[i])
+	{
+		printf("Damaged sections in the level\n");
+		delete file;
+		return false;
+	}
+	// the old grid goes first, so the two never take up memory at the same time
+	ReleaseOctree();
+	ReleaseStream();
+	FreeGrid();
+	mappedLevel = file;
+	grid = (unsigned short*)(file->Data() + sections.grid);
+	brickOccupancy = (uint*)(file->Data() + sections.brickOccupancy);
+	blockOccupancy = (uint64_t*)(file->Data() + sections.blockOccupancy);
+	brickDistance = file->Data() + sections.brickDistance;
+	// the file holds the grid in linear order and with 16-bit keys; anything else would need a copy
+	layout = LinearLayout, format = Keys16;
+	cellOffsets = (uint*)MALLOC64((size.x + size.y + size.z) * sizeof(uint));
+	cellX = cellOffsets, cellY = cellX + size.x, cellZ = cellY + size.y;
+	BuildCellOffsets(layout, cellOffsets);
+	return true;
+}
 
-		for (uint i = 0; i < data->materialCount; i++, it++)
+bool Scene::WriteMappedGrid( FILE* f ) const
+{
+	// the sections follow the level data, each on a page boundary
+	const size_t cells = (size_t)size.x * size.y * size.z, bricks = cells >> (3 * BRICKSHIFT), blocks = cells >> (3 * BLOCKSHIFT);
+	const uint64_t bytes[4] = { cells * sizeof(unsigned short), bricks * sizeof(uint), blocks * sizeof(uint64_t), bricks * sizeof(uchar) + 64 };
+	const uint64_t start = sizeof(LevelHeader) + 2 * sizeof(uint) + lights.size() * sizeof(Light) +
+		materials.size() * (sizeof(unsigned short) + sizeof(Material)) + sizeof(MappedSections);
+	uint64_t offset[4], position = start;
+	for (int i = 0; i < 4; i++)
+	{
+		offset[i] = (position + MAPPEDALIGNMENT - 1) / MAPPEDALIGNMENT * MAPPEDALIGNMENT;
+		position = offset[i] + bytes[i];
+	}
+	const MappedSections sections = { offset[0], offset[1], offset[2], offset[3] };
+	if (fwrite(&sections, sizeof(MappedSections), 1, f) != 1) return false;
+	static const uchar padding[MAPPEDALIGNMENT] = {};
+	position = start;
+	bool success = fwrite(padding, 1, offset[0] - position, f) == offset[0] - position;
+	if (layout == LinearLayout && grid) success = success && fwrite(grid, sizeof(unsigned short), cells, f) == cells;
+	else
+	{
+		// gather the keys into linear order slice by slice
+		const uint sliceSize = size.x * size.y;
+		vector<unsigned short> slice(sliceSize);
+		for (uint z = 0; z < size.z && success; z++)
 		{
-			data->keysForMaterials[i] = it->first;
-			data->materials[i] = it->second;
+			for (uint y = 0, i = 0; y < size.y; y++) for (uint x = 0; x < size.x; x++, i++) slice[i] = GetMaterial(x, y, z);
+			success = fwrite(slice.data(), sizeof(unsigned short), sliceSize, f) == sliceSize;
 		}
+	}
+	// the distance field is padded for gathers; the padding is written as zeroes
+	const void* data[4] = { grid, brickOccupancy, blockOccupancy, brickDistance };
+	const uint64_t dataBytes[4] = { bytes[0], bytes[1], bytes[2], bricks * sizeof(uchar) };
+	position = offset[0] + bytes[0];
+	for (int i = 1; i < 4 && success; i++)
+	{
+		success = fwrite(padding, 1, offset[i] - position, f) == offset[i] - position &&
+			fwrite(data[i], 1, dataBytes[i], f) == dataBytes[i] && fwrite(padding, 1, bytes[i] - dataBytes[i], f) == bytes[i] - dataBytes[i];
+		position = offset[i] + bytes[i];
+	}
+	return success;
+}
 
-		fwrite(data, 1, sizeof(SceneData), f);
-		fclose(f);
+void Scene::ReleaseMapping()
+{
+	// take private copies of everything that lives in the mapping, then close it
+	if (!mappedLevel) return;
+	const size_t cells = (size_t)size.x * size.y * size.z, bricks = cells >> (3 * BRICKSHIFT), blocks = cells >> (3 * BLOCKSHIFT);
+	unsigned short* newGrid = (unsigned short*)MALLOC64(cells * sizeof(unsigned short));
+	uint* newBrickOccupancy = (uint*)MALLOC64(bricks * sizeof(uint));
+	uint64_t* newBlockOccupancy = (uint64_t*)MALLOC64(blocks * sizeof(uint64_t));
+	uchar* newBrickDistance = (uchar*)MALLOC64(bricks * sizeof(uchar) + 64);
+	memcpy(newGrid, grid, cells * sizeof(unsigned short));
+	memcpy(newBrickOccupancy, brickOccupancy, bricks * sizeof(uint));
+	memcpy(newBlockOccupancy, blockOccupancy, blocks * sizeof(uint64_t));
+	memcpy(newBrickDistance, brickDistance, bricks * sizeof(uchar) + 64);
+	delete mappedLevel;
+	mappedLevel = 0;
+	grid = newGrid, brickOccupancy = newBrickOccupancy, blockOccupancy = newBlockOccupancy, brickDistance = newBrickDistance;
+}
 
-		delete data;
-		return true;
+void Scene::ClearGrid()
+{
+	const size_t cells = (size_t)size.x * size.y * size.z;
+	memset(grid, 0, cells * sizeof(unsigned short));
+	memset(brickOccupancy, 0, (cells >> (3 * BRICKSHIFT)) * sizeof(uint));
+	memset(blockOccupancy, 0, (cells >> (3 * BLOCKSHIFT)) * sizeof(uint64_t));
+	memset(brickDistance, MAXBRICKDISTANCE, (cells >> (3 * BRICKSHIFT)) * sizeof(uchar));
+}
+
+void Scene::UpdateOccupancy()
+{
+	// rebuild block masks and brick counts from the grid; a brick owns its 2x2x2 blocks,
+	// so threads never share a counter
+	Jobs().ParallelFor(0, (int)brickGridSize.z, [&](int bz)
+	{
+		for (uint by = 0; by < brickGridSize.y; by++) for (uint bx = 0; bx < brickGridSize.x; bx++) UpdateBrickOccupancy(bx, by, bz);
+	});
+}
+
+void Scene::UpdateBrickOccupancy( const uint bx, const uint by, const uint bz )
+{
+	uint count = 0;
+	for (uint k = 0; k < BRICKSIZE; k += BLOCKSIZE) for (uint j = 0; j < BRICKSIZE; j += BLOCKSIZE) for (uint i = 0; i < BRICKSIZE; i += BLOCKSIZE)
+	{
+		const uint x0 = bx * BRICKSIZE + i, y0 = by * BRICKSIZE + j, z0 = bz * BRICKSIZE + k;
+		uint64_t mask = 0;
+		for (uint z = z0; z < z0 + BLOCKSIZE; z++) for (uint y = y0; y < y0 + BLOCKSIZE; y++) for (uint x = x0; x < x0 + BLOCKSIZE; x++)
+			if (GetMaterial(x, y, z) != NOMATERIALKEY) mask |= BlockBit(x, y, z), count++;
+		blockOccupancy[BlockIndex(x0, y0, z0)] = mask;
 	}
-	else
+	brickOccupancy[BrickIndex(bx * BRICKSIZE, by * BRICKSIZE, bz * BRICKSIZE)] = count;
+}
+
+void Scene::BeginBulkEdit()
+{
+	// parallel edits can't share palettes
+	if (paletteGrid) ExpandGrid();
+	bulkEdit = true;
+}
+
+void Scene::EndBulkEdit()
+{
+	bulkEdit = false;
+	UpdateDistanceField(make_int3(0), make_int3(brickGridSize) - 1);
+	if (format == Palette8 && grid && !mappedLevel && !CompactGrid()) format = Keys16;
+}
+
+void Scene::UpdateDistanceField( const int3& lo, const int3& hi )
+{
+	// Recompute the distances of bricks [lo..hi]. Chebyshev distance is separable:
+	// d(p) = min_z max(|dz|, min_y max(|dy|, min_x max(|dx|, 0 for solid bricks))),
+	// so three 1D passes over a window that extends lo..hi by MAXBRICKDISTANCE - 1.
+	const int R = MAXBRICKDISTANCE - 1;
+	const int3 wlo = max( lo - R, make_int3( 0 ) ), whi = min( hi + R, make_int3( brickGridSize ) - 1 );
+	const int3 wsize = whi - wlo + 1;
+	const int wcount = wsize.x * wsize.y * wsize.z;
+	uchar* dx = new uchar[wcount], *dxy = new uchar[wcount];
+	auto W = [&]( int x, int y, int z ) { return (x - wlo.x) + (y - wlo.y) * wsize.x + (z - wlo.z) * wsize.x * wsize.y; };
+	// pass 1: along x, for the full window in y and z
+	Jobs().ParallelFor( wlo.z, whi.z + 1, [&]( int z )
 	{
-		printf("Failed to save the level");
-		delete data;
-		return false;
+		for (int y = wlo.y; y <= whi.y; y++) for (int x = lo.x; x <= hi.x; x++)
+		{
+			int d = MAXBRICKDISTANCE;
+			for (int i = max( wlo.x, x - R ); i <= min( whi.x, x + R ); i++)
+				if (brickOccupancy[i + (y << brickShift.y) + (z << brickShift.z)]) d = min( d, abs( i - x ) );
+			dx[W( x, y, z )] = (uchar)d;
+		}
+	} );
+	// pass 2: along y, for the full window in z
+	Jobs().ParallelFor( wlo.z, whi.z + 1, [&]( int z )
+	{
+		for (int y = lo.y; y <= hi.y; y++) for (int x = lo.x; x <= hi.x; x++)
+		{
+			int d = MAXBRICKDISTANCE;
+			for (int j = max( wlo.y, y - R ); j <= min( whi.y, y + R ); j++) d = min( d, max( abs( j - y ), (int)dx[W( x, j, z )] ) );
+			dxy[W( x, y, z )] = (uchar)d;
+		}
+	} );
+	// pass 3: along z, straight into the distance field
+	Jobs().ParallelFor( lo.z, hi.z + 1, [&]( int z )
+	{
+		for (int y = lo.y; y <= hi.y; y++) for (int x = lo.x; x <= hi.x; x++)
+		{
+			int d = MAXBRICKDISTANCE;
+			for (int k = max( wlo.z, z - R ); k <= min( whi.z, z + R ); k++) d = min( d, max( abs( k - z ), (int)dxy[W( x, y, k )] ) );
+			brickDistance[x + (y << brickShift.y) + (z << brickShift.z)] = (uchar)d;
+		}
+	} );
+	delete[] dx;
+	delete[] dxy;
+}
+
+void Scene::OnBrickChanged( const uint x, const uint y, const uint z, const bool filled )
+{
+#if DISTANCEFIELD
+	// a voxel edit only affects the distances within MAXBRICKDISTANCE - 1 bricks
+	const int R = MAXBRICKDISTANCE - 1;
+	const int3 brick = make_int3( x / BRICKSIZE, y / BRICKSIZE, z / BRICKSIZE );
+	const int3 lo = max( brick - R, make_int3( 0 ) ), hi = min( brick + R, make_int3( brickGridSize ) - 1 );
+	if (filled)
+	{
+		// distances can only shrink
+		for (int bz = lo.z; bz <= hi.z; bz++) for (int by = lo.y; by <= hi.y; by++) for (int bx = lo.x; bx <= hi.x; bx++)
+		{
+			uchar& d = brickDistance[bx + (by << brickShift.y) + (bz << brickShift.z)];
+			d = (uchar)min( (int)d, max( abs( bx - brick.x ), max( abs( by - brick.y ), abs( bz - brick.z ) ) ) );
+		}
 	}
+	else UpdateDistanceField( lo, hi );
+#endif
 }
 
 void Scene::SetMaterial( const uint x, const uint y, const uint z, const unsigned short materialKey)
 {
-	grid[x + y * GRIDSIZE + z * GRIDSIZE2] = materialKey;
+	if (!HasGrid()) return; // octree levels are static
+	const unsigned short cellKey = GetMaterial(x, y, z);
+	if (cellKey == materialKey) return;
+	if (paletteGrid && !SetPaletteKey(x, y, z, materialKey))
+	{
+		printf("More than %i materials in a brick, the grid goes back to 16-bit keys\n", PALETTESIZE);
+		SetGridFormat(Keys16);
+	}
+	if (grid) grid[CellIndex(x, y, z)] = materialKey;
+	// the next incremental save writes the chunk
+	dirtyChunks[ChunkIndex(x, y, z)] = 1;
+	const bool wasSolid = cellKey != NOMATERIALKEY, isSolid = materialKey != NOMATERIALKEY;
+	if (wasSolid == isSolid) return;
+
+	// keep the occupancy in sync; blocks and bricks are shared between the threads of a parallel fill
+	uint64_t& mask = blockOccupancy[BlockIndex(x, y, z)];
+	uint& count = brickOccupancy[BrickIndex(x, y, z)];
+	const uint64_t bit = BlockBit(x, y, z);
+	if (isSolid) AtomicOr(mask, bit);
+	else AtomicAnd(mask, ~bit);
+	const uint newCount = AtomicAdd(count, isSolid ? 1 : -1);
+
+	// the first voxel in a brick, or the last one out, changes the distance field
+	if (!bulkEdit && newCount == (isSolid ? 1u : 0u)) OnBrickChanged(x, y, z, isSolid);
 }
 
 
@@ -178,24 +1317,25 @@ bool Scene::Setup3DDDA( Ray& ray, DDAState& state ) const
 {
 	// if ray is not inside the world: advance until it is
 	state.t = 0;
-	bool startedInGrid = point_in_cube( ray.O );
+	bool startedInGrid = point_in_box( ray.O, extent );
 	if (!startedInGrid)
 	{
-		state.t = intersect_cube( ray );
+		state.t = intersect_box( ray, extent );
 		if (state.t > 1e33f) return false; // ray misses voxel data entirely
 	}
-	// setup amanatides & woo - assume world is 1x1x1, from (0,0,0) to (1,1,1)
-	static const float cellSize = 1.0f / GRIDSIZE;
+	// setup amanatides & woo - the world spans (0,0,0) to extent, in cells of cellSize
 	state.step = make_int3( 1 - ray.Dsign * 2 );
-	const float3 posInGrid = GRIDSIZE * (ray.O + (state.t + 0.00005f) * ray.D);
+	const float3 posInGrid = (ray.O + (state.t + 0.00005f) * ray.D) / cellSize;
 	const float3 gridPlanes = (ceilf( posInGrid ) - ray.Dsign) * cellSize;
-	const int3 P = clamp( make_int3( posInGrid ), 0, GRIDSIZE - 1 );
+	const int3 P = min( max( make_int3( posInGrid ), make_int3( 0 ) ), make_int3( size ) - 1 );
 	state.X = P.x, state.Y = P.y, state.Z = P.z;
 	state.tdelta = cellSize * float3( state.step ) * ray.rD;
 	state.tmax = (gridPlanes - ray.O) * ray.rD;
 	// detect rays that start inside a voxel
-	uint cell = grid[P.x + P.y * GRIDSIZE + P.z * GRIDSIZE2];
-	ray.inside = cell != 0 && startedInGrid;
+	if (!startedInGrid) ray.inside = false;
+	else if (backend == OctreeBackend) ray.inside = octree->GetMaterial( P.x, P.y, P.z ) != NOMATERIALKEY;
+	else if (backend == StreamBackend) ray.inside = stream->GetMaterial( P.x, P.y, P.z ) != NOMATERIALKEY;
+	else ray.inside = IsSolid( P.x, P.y, P.z );
 	// proceed with traversal
 	return true;
 }
@@ -207,51 +1347,79 @@ void Scene::FindNearest( Ray& ray ) const
 	// setup Amanatides & Woo grid traversal
 	DDAState s;
 	if (!Setup3DDDA( ray, s )) return;
-	//uint cell, lastCell = 0, axis = ray.axis;
-	unsigned short cellKey, lastCellKey = NOMATERIALKEY, axis = ray.axis;
+	if (backend == OctreeBackend) octree->Traverse( ray, s, size );
+	else if (backend == StreamBackend) stream->Traverse( ray, s, size );
+	else Traverse( ray, s );
+}
+
+void Scene::Traverse( Ray& ray, DDAState& s ) const
+{
+	// continue a traversal from state 's'; ray.axis holds the last axis crossed
+	unsigned short cellKey = NOMATERIALKEY;
+	uint axis = ray.axis, steps = 0;
 	if (ray.inside)
 	{
 		// start stepping until we find an empty voxel
+		uint lastX = 0, lastY = 0, lastZ = 0;
 		while (1)
 		{
-			cellKey = grid[s.X + s.Y * GRIDSIZE + s.Z * GRIDSIZE2];
-			if (cellKey == NOMATERIALKEY) break;
-			lastCellKey = cellKey;
+			steps++;
+			if (!IsSolid(s.X, s.Y, s.Z)) break;
+			lastX = s.X, lastY = s.Y, lastZ = s.Z;
 			if (s.tmax.x < s.tmax.y)
 			{
-				if (s.tmax.x < s.tmax.z) { s.t = s.tmax.x, s.X += s.step.x, axis = 0; if (s.X >= GRIDSIZE) break; s.tmax.x += s.tdelta.x; }
-				else { s.t = s.tmax.z, s.Z += s.step.z, axis = 2; if (s.Z >= GRIDSIZE) break; s.tmax.z += s.tdelta.z; }
+				if (s.tmax.x < s.tmax.z) { s.t = s.tmax.x, s.X += s.step.x, axis = 0; if (s.X >= size.x) break; s.tmax.x += s.tdelta.x; }
+				else { s.t = s.tmax.z, s.Z += s.step.z, axis = 2; if (s.Z >= size.z) break; s.tmax.z += s.tdelta.z; }
 			}
 			else
 			{
-				if (s.tmax.y < s.tmax.z) { s.t = s.tmax.y, s.Y += s.step.y, axis = 1; if (s.Y >= GRIDSIZE) break; s.tmax.y += s.tdelta.y; }
-				else { s.t = s.tmax.z, s.Z += s.step.z, axis = 2; if (s.Z >= GRIDSIZE) break; s.tmax.z += s.tdelta.z; }
+				if (s.tmax.y < s.tmax.z) { s.t = s.tmax.y, s.Y += s.step.y, axis = 1; if (s.Y >= size.y) break; s.tmax.y += s.tdelta.y; }
+				else { s.t = s.tmax.z, s.Z += s.step.z, axis = 2; if (s.Z >= size.z) break; s.tmax.z += s.tdelta.z; }
 			}
 		}
-		ray.voxelKey = lastCellKey; // we store the voxel we just left
+		ray.voxelKey = GetMaterial(lastX, lastY, lastZ); // we store the voxel we just left
 	}
 	else
 	{
-		// start stepping until we find a filled voxel
+		// start stepping until we find a filled voxel, skipping empty bricks (as far as the
+		// distance field allows) and blocks at once;
+		// the grid itself is only read for the voxel we hit
 		while (1)
 		{
-			cellKey = grid[s.X + s.Y * GRIDSIZE + s.Z * GRIDSIZE2];
-			if (cellKey != NOMATERIALKEY) break;
-			else if (s.tmax.x < s.tmax.y)
+			steps++;
+			const uint brick = BrickIndex(s.X, s.Y, s.Z);
+			if (brickOccupancy[brick] == 0)
+			{
+				if (!skip_empty_bricks(s, brickDistance[brick], size, axis)) break;
+				continue;
+			}
+			const uint64_t mask = blockOccupancy[BlockIndex(s.X, s.Y, s.Z)];
+			if (mask == 0)
+			{
+				if (!skip_empty_block(s, BLOCKSIZE, size, axis)) break;
+				continue;
+			}
+			if (mask & BlockBit(s.X, s.Y, s.Z))
 			{
-				if (s.tmax.x < s.tmax.z) { s.t = s.tmax.x, s.X += s.step.x, axis = 0; if (s.X >= GRIDSIZE) break; s.tmax.x += s.tdelta.x; }
-				else { s.t = s.tmax.z, s.Z += s.step.z, axis = 2; if (s.Z >= GRIDSIZE) break; s.tmax.z += s.tdelta.z; }
+				cellKey = GetMaterial(s.X, s.Y, s.Z);
+				break;
+			}
+			if (s.tmax.x < s.tmax.y)
+			{
+				if (s.tmax.x < s.tmax.z) { s.t = s.tmax.x, s.X += s.step.x, axis = 0; if (s.X >= size.x) break; s.tmax.x += s.tdelta.x; }
+				else { s.t = s.tmax.z, s.Z += s.step.z, axis = 2; if (s.Z >= size.z) break; s.tmax.z += s.tdelta.z; }
 			}
 			else
 			{
-				if (s.tmax.y < s.tmax.z) { s.t = s.tmax.y, s.Y += s.step.y, axis = 1; if (s.Y >= GRIDSIZE) break; s.tmax.y += s.tdelta.y; }
-				else { s.t = s.tmax.z, s.Z += s.step.z, axis = 2; if (s.Z >= GRIDSIZE) break; s.tmax.z += s.tdelta.z; }
+				if (s.tmax.y < s.tmax.z) { s.t = s.tmax.y, s.Y += s.step.y, axis = 1; if (s.Y >= size.y) break; s.tmax.y += s.tdelta.y; }
+				else { s.t = s.tmax.z, s.Z += s.step.z, axis = 2; if (s.Z >= size.z) break; s.tmax.z += s.tdelta.z; }
 			}
 		}
 		ray.voxelKey = cellKey;
 	}
 	ray.t = s.t;
 	ray.axis = axis;
+	PROFILE_COUNT(DDASteps, steps);
 }
 
 bool Scene::IsOccluded( Ray& ray ) const
@@ -262,29 +1430,46 @@ bool Scene::IsOccluded( Ray& ray ) const
 	// setup Amanatides & Woo grid traversal
 	DDAState s;
 	if (!Setup3DDDA( ray, s )) return false;
-	// start stepping
+	if (backend == OctreeBackend) return octree->IsOccluded( ray, s, size );
+	if (backend == StreamBackend) return stream->IsOccluded( ray, s, size );
+	// start stepping, skipping empty bricks and blocks at once
+	uint axis, steps = 0;
+	bool occluded = false;
 	while (s.t < ray.t)
 	{
-		const uint cell = grid[s.X + s.Y * GRIDSIZE + s.Z * GRIDSIZE2];
-		if (cell) /* we hit a solid voxel */ return s.t < ray.t;
+		steps++;
+		const uint brick = BrickIndex(s.X, s.Y, s.Z);
+		if (brickOccupancy[brick] == 0)
+		{
+			if (!skip_empty_bricks(s, brickDistance[brick], size, axis)) break;
+			continue;
+		}
+		const uint64_t mask = blockOccupancy[BlockIndex(s.X, s.Y, s.Z)];
+		if (mask == 0)
+		{
+			if (!skip_empty_block(s, BLOCKSIZE, size, axis)) break;
+			continue;
+		}
+		if (mask & BlockBit(s.X, s.Y, s.Z)) /* we hit a solid voxel */ { occluded = s.t < ray.t; break; }
 		if (s.tmax.x < s.tmax.y)
 		{
-			if (s.tmax.x < s.tmax.z) { if ((s.X += s.step.x) >= GRIDSIZE) return false; s.t = s.tmax.x, s.tmax.x += s.tdelta.x; }
-			else { if ((s.Z += s.step.z) >= GRIDSIZE) return false; s.t = s.tmax.z, s.tmax.z += s.tdelta.z; }
+			if (s.tmax.x < s.tmax.z) { if ((s.X += s.step.x) >= size.x) break; s.t = s.tmax.x, s.tmax.x += s.tdelta.x; }
+			else { if ((s.Z += s.step.z) >= size.z) break; s.t = s.tmax.z, s.tmax.z += s.tdelta.z; }
 		}
 		else
 		{
-			if (s.tmax.y < s.tmax.z) { if ((s.Y += s.step.y) >= GRIDSIZE) return false; s.t = s.tmax.y, s.tmax.y += s.tdelta.y; }
-			else { if ((s.Z += s.step.z) >= GRIDSIZE) return false; s.t = s.tmax.z, s.tmax.z += s.tdelta.z; }
+			if (s.tmax.y < s.tmax.z) { if ((s.Y += s.step.y) >= size.y) break; s.t = s.tmax.y, s.tmax.y += s.tdelta.y; }
+			else { if ((s.Z += s.step.z) >= size.z) break; s.t = s.tmax.z, s.tmax.z += s.tdelta.z; }
 		}
 	}
-	return false;
+	PROFILE_COUNT(DDASteps, steps);
+	return occluded;
 }
 
 
-float3 Scene::ShadowRay(Light const& light, float3 const& pixelWorldPos, float3 const& pixelNormal) const
+bool Scene::PrepareShadowRay(Light const& light, float3 const& pixelWorldPos, float3 const& pixelNormal, Ray& ray, float3& contribution) const
 {
-	if (!light.isEnabled) return float3(0.0f);
+	if (!light.isEnabled) return false;
 
 	switch (light.type)
 	{
@@ -294,21 +1479,16 @@ float3 Scene::ShadowRay(Light const& light, float3 const& pixelWorldPos, float3
 		float3 direction = normalize(lightToPixelVector);
 		float rayLength = length(lightToPixelVector);
 
-		if (rayLength > light.range) return float3(0.0f);
+		if (rayLength > light.range) return false;
 
-		Ray r(light.pos, direction, rayLength);
+		ray = Ray(light.pos, direction, rayLength);
 
-		if (IsOccluded(r))
-			return float3(0.0f);
-		else
-		{
-			float3 result = light.color;
-			result *= (light.range - rayLength) / light.range;
-			result *= light.intensity;	/// REDO, should be something else
-			result *= dot(pixelNormal, -direction);
+		contribution = light.color;
+		contribution *= (light.range - rayLength) / light.range;
+		contribution *= light.intensity;	/// REDO, should be something else
+		contribution *= dot(pixelNormal, -direction);
 
-			return result;
-		}
+		return true;
 	}
 
 	break;
@@ -316,18 +1496,13 @@ float3 Scene::ShadowRay(Light const& light, float3 const& pixelWorldPos, float3
 	case LightType::Directional:
 	{
 		// Casting an opposite ray, as it is the same
-		Ray r(pixelWorldPos, -light.direction);
+		ray = Ray(pixelWorldPos, -light.direction);
 
-		if (IsOccluded(r))
-			return float3(0.0f);
-		else
-		{
-			float3 result = light.color;
-			result *= light.intensity;	/// REDO, should be something else
-			result *= dot(pixelNormal, -light.direction);
+		contribution = light.color;
+		contribution *= light.intensity;	/// REDO, should be something else
+		contribution *= dot(pixelNormal, -light.direction);
 
-			return result;
-		}
+		return true;
 	}
 
 	break;
@@ -336,19 +1511,30 @@ float3 Scene::ShadowRay(Light const& light, float3 const& pixelWorldPos, float3
 
 		printf("We don't support spot light yet");
 		abort();
-		return float3(0.0f);
+		return false;
 		break;
 	default:
 		printf("The light type is unknown");
 		abort();
-		return float3(0.0f);
+		return false;
 		break;
 	}
 }
 
+float3 Scene::ShadowRay(Light const& light, float3 const& pixelWorldPos, float3 const& pixelNormal) const
+{
+	Ray r;
+	float3 contribution;
+
+	if (!PrepareShadowRay(light, pixelWorldPos, pixelNormal, r, contribution)) return float3(0.0f);
+
+	return IsOccluded(r) ? float3(0.0f) : contribution;
+}
+
 bool Scene::AddLight(const Light& light)
 {
 	lights.push_back(light);
+	if (!lightsChanged) lightGrid.Add(lights);
 
 	return true;
 }
@@ -356,19 +1542,28 @@ bool Scene::AddLight(const Light& light)
 bool Scene::RemoveLight(const int id)
 {
 	lights.erase(lights.begin() + id);
+	if (!lightsChanged) lightGrid.Remove(id);
 
 	return true;
 }
 
-const Material& Tmpl8::Scene::GetMaterialByKey(unsigned short key, bool& isKeyValid)
+void Scene::LightChanged(const int id)
 {
-	// Shoot ourselves for such a hillarious mistake
-	if (key == NOMATERIALKEY) abort();
+	if (!lightsChanged) lightGrid.Update(lights, id);
+}
 
-	auto it = materials.find(key);
-	bool materialWasNotFound = it == materials.end();
-	if (materialWasNotFound) { isKeyValid = false; return defaultMaterial; }
+void Scene::UpdateLightGrid()
+{
+	// the grid covers the world, which a load may have resized
+	const float3& covered = lightGrid.Extent();
+	if (!lightsChanged && covered.x == extent.x && covered.y == extent.y && covered.z == extent.z) return;
+	lightGrid.Build(lights, extent);
+	lightsChanged = false;
+}
 
-	isKeyValid = true;
-	return it->second;
+void Scene::UpdateMaterialTable()
+{
+	if (!materialsChanged) return;
+	materialTable.Build(materials, defaultMaterial);
+	materialsChanged = false;
 }
@@ -1,20 +1,37 @@
 #pragma once
 
+#include <map>
 #include "light.h"
 #include "material.h"
-#include <map>
 
 // high level settings
-#define WORLDSIZE		128 // power of 2. Warning: max 512 for a 512x512x512x4 bytes = 512MB world!
+#define WORLDSIZE		128		// power of 2, edge of the default level; levels from a file bring their own size
+#define MAXWORLDSHIFT	31		// log2 of the largest voxel count; keeps cell indices within 32 bits
+#define STREAMMAXSHIFT	36		// the same for streamed levels, which are never in memory as a whole
+#define STREAMCACHESIZE	1024	// MB of chunks a streamed level keeps in memory, by default
+
+// bricks: the coarse level of the acceleration structure; a brick that holds no
+// solid voxels is skipped by the traversal in a single step.
+#define BRICKSIZE		8	// power of 2, edge of a brick in voxels
+#define BRICKSHIFT		3	// log2 of BRICKSIZE
 
-// low-level / derived
-#define WORLDSIZE2		(WORLDSIZE*WORLDSIZE)
-#define GRIDSIZE		WORLDSIZE
-#define GRIDSIZE2		(GRIDSIZE*GRIDSIZE)
-#define GRIDSIZE3		(GRIDSIZE*GRIDSIZE*GRIDSIZE)
+// distance field: per brick the Chebyshev distance (in bricks) to the nearest brick
+// holding solid voxels, so the traversal can jump over a whole cube of empty bricks.
+#define DISTANCEFIELD	1	// set to 0 to skip empty bricks one at a time
+#define MAXBRICKDISTANCE	8	// distances are clamped to this; also bounds incremental updates
+
+// blocks: the fine level of the acceleration structure; one bit per voxel, a 4x4x4
+// block of voxels packs into a single 64-bit mask. Traversal only tests these bits
+// and reads the grid once, on a hit.
+#define BLOCKSIZE		4
+#define BLOCKSHIFT		2	// log2 of BLOCKSIZE
+
+// ray packets: 8 lanes with AVX2, two runs of 4 with SSE4.1 otherwise
+#define MAXPACKETSIZE	8
 
 #define MAXLIGHTS		32
 #define MAXMATERIALS	256
+#define PALETTESIZE		256		// keys per palette of the 8-bit grid; its indices are bytes
 
 #define NOMATERIALKEY	0
 
@@ -23,6 +40,33 @@
 
 namespace Tmpl8 {
 
+// memory layouts for the grid; level files always store it in linear order
+enum GridLayout
+{
+	LinearLayout,	// x fastest, then y, then z
+	MortonLayout,	// Z-order curve, so neighbours along any axis tend to share cache lines and pages
+	Tiled4Layout,	// 4x4x4 tiles of 128 bytes, tiles in linear order
+	Tiled8Layout	// 8x8x8 tiles of 1KB, one per brick
+};
+
+// how the grid stores a voxel's material key
+enum GridFormat
+{
+	Keys16,		// the key itself
+	Palette8	// an index into a palette of keys: one shared by all bricks, and one of its own for a brick whose keys don't fit in it
+};
+
+// what FindNearest and IsOccluded trace against
+enum SceneBackend
+{
+	GridBackend,	// the dense grid with its occupancy masks
+	OctreeBackend,	// a sparse voxel octree (or DAG) of the same voxels; static
+	StreamBackend	// the chunks of a level file, paged in as rays need them; static
+};
+
+class SparseVoxelOctree;
+class StreamedWorld;
+
 class Scene
 {
 public:
@@ -35,9 +79,44 @@ public:
 		float3 tmax;
 	};
 
-	struct SceneData
+	// level file, version 2: LevelHeader; the light count, the lights, the material count,
+	// the material keys and the materials; then for a grid the chunk count, the chunk table
+	// and the compressed chunks, or for an octree the node pool. A chunk holds the keys of
+	// LEVELCHUNKSIZE^3 voxels (x fastest), compressed with zlib; empty chunks are not stored.
+	// Version 1 files hold the grid uncompressed (x fastest), followed by LevelData.
+	// Mappable levels (MAPPEDMAGIC) follow the lights and materials with MappedSections
+	// and store the grid, in linear layout, and its acceleration structure uncompressed
+	// and page aligned, so they can be used straight from a memory mapping of the file.
+	// Incremental saves append journal records to a version 2 grid level: a LevelJournalRecord,
+	// then the lights and materials, and the chunk count, table and chunks as above, with
+	// a compressed size of 0 for chunks that became empty. Later records win.
+	struct LevelHeader
+	{
+		uint magic;
+		uint version;
+		uint3 size;
+	};
+
+	struct LevelChunk
+	{
+		uint index;				// x + y * chunks.x + z * chunks.x * chunks.y, in chunks
+		uint compressedSize;	// bytes; chunks follow the table back to back
+	};
+
+	struct LevelJournalRecord
+	{
+		uint magic;
+		uint bytes;		// of the record after this header; a record that is cut short is ignored
+	};
+
+	struct MappedSections
+	{
+		uint64_t grid, brickOccupancy, blockOccupancy, brickDistance;	// file offsets
+	};
+
+	// version 1 only
+	struct LevelData
 	{
-		unsigned short grid[GRIDSIZE3]; // voxel payload is 'unsigned int', interpretation of the bits is free!
 		Light lights[MAXLIGHTS];
 		unsigned int lightCount;
 		Material materials[MAXMATERIALS];
@@ -45,36 +124,222 @@ public:
 		unsigned int materialCount;
 	};
 
-	Scene();
+	// without the default level, the world starts out empty
+	Scene( const bool defaultLevel = true );
+	~Scene();
+	Scene( const Scene& ) = delete;
+	Scene& operator=( const Scene& ) = delete;
+	// exchange levels with another scene, e.g. one that was loaded in the background
+	void Swap( Scene& other );
+
+	// Reallocate the grid for a world of 'newSize' voxels (powers of 2, at least BRICKSIZE
+	// per axis). The grid is left empty.
+	bool Resize( const uint3& newSize );
+	// Reorder the grid in memory; voxel coordinates and file contents are unaffected.
+	void SetGridLayout( const GridLayout newLayout );
+	// Store keys as they are, or as 8-bit palette indices, in half the memory. The format
+	// sticks: levels loaded or generated later are converted when they are complete. False
+	// if there is no grid, or a brick holds more than PALETTESIZE different keys.
+	bool SetGridFormat( const GridFormat newFormat );
+	size_t GridMemoryUsage() const;
+
+	// Build a sparse voxel octree from the grid and trace against it; with 'dag',
+	// identical subtrees are stored once. Later grid edits need a rebuild to show.
+	void BuildOctree( const bool dag );
+	// Switch between grid and octree. Levels loaded as an octree have no grid; one
+	// is created from the octree if the world is small enough.
+	bool SetBackend( const SceneBackend newBackend );
 
 	void LoadDefaultLevel();
 	bool LoadLevelFromFile(const char* filepath);
-	bool SaveLevelToFile(const char* filepath);
+	// Trace a chunked level straight from its file, for worlds too large to load: only
+	// the chunk table is read, and chunks are paged in as rays need them, keeping at most
+	// 'cacheBytes' of them in memory (see StreamedWorld). There is no grid to edit.
+	bool StreamLevelFromFile(const char* filepath, const size_t cacheBytes = (size_t)STREAMCACHESIZE << 20);
+	// the default level at any size, generated chunk by chunk straight into a level file
+	static bool GenerateLevelFile(const char* filepath, const uint3& size);
+	// how far the LoadLevelFromFile in progress is, 0..1; may be read from any thread
+	atomic<float> loadProgress{ 1 };
+	// 'mappable' stores the grid uncompressed, for near instant loading: pages of a mappable
+	// level are read from the file on first use, and edits go to private copies of them.
+	bool SaveLevelToFile(const char* filepath, const bool mappable = false);
+
+	// The level file that holds the grid as it was last loaded or saved as compressed
+	// chunks; SetMaterial marks the chunks that changed since, so a save to the same file
+	// only needs to append those (see LevelSaver).
+	struct LevelFile
+	{
+		string path;
+		uint64_t bytes = 0;		// the level and its journal; anything after it is ignored
+		uint64_t baseBytes = 0;	// the level without its journal
+		uint records = 0;		// in the journal
+	};
+	// a copy of what a save writes, so it can be written on another thread while the scene changes
+	struct LevelSnapshot
+	{
+		LevelFile file;			// the file and its state; updated by WriteSnapshot
+		bool full = true;		// a new file with all chunks, or a journal record with the changed ones
+		uint generation = 0;
+		uint3 size;
+		vector<Light> lights;
+		map<unsigned short, Material> materials;
+		uint chunkVoxels = 0;
+		vector<uint> chunks;			// indices of the chunks in the snapshot
+		vector<unsigned short> keys;	// their voxels, chunkVoxels per chunk
+	};
+	// Copy what a save to 'filepath' has to write: the chunks that changed if the file holds
+	// the level as last loaded or saved, all chunks otherwise. The changes count as saved
+	// from here on. False if there is no grid to save.
+	bool TakeSnapshot( const char* filepath, LevelSnapshot& snapshot );
+	// Write a snapshot; compacts the file once the journal outgrows the level or has
+	// JOURNALMAXRECORDS records. Only touches the file, so any thread can call it.
+	static bool WriteSnapshot( LevelSnapshot& snapshot );
+	// after WriteSnapshot, on the thread that renders: the file now holds what was snapshotted
+	void SnapshotWritten( const LevelSnapshot& snapshot, const bool success );
+	LevelFile levelFile;
+
+	// SetMaterial calls between these may run in parallel; acceleration data that
+	// is too expensive to keep up to date per voxel is rebuilt in EndBulkEdit. An 8-bit
+	// grid holds 16-bit keys in between.
+	void BeginBulkEdit();
+	void EndBulkEdit();
 
+	// start of the DDA walk: advances the ray into the world; false if it misses it
+	bool Setup3DDDA( Ray& ray, DDAState& state ) const;
 	void FindNearest( Ray& ray ) const;
+	void FindNearest( Ray* rays, const uint count ) const; // coherent rays, traced in packets of MAXPACKETSIZE
 	bool IsOccluded( Ray& ray ) const;
 	void SetMaterial( const uint x, const uint y, const uint z, const unsigned short materialKey );
+	unsigned short GetMaterial( const uint x, const uint y, const uint z ) const { return CellKey(CellIndex(x, y, z), x, y, z); }
+	bool HasGrid() const { return grid || paletteGrid; }
+	bool IsMapped() const { return mappedLevel != 0; }	// the grid lives in a mapping of a mappable level file
+	bool IsBrickEmpty( const uint x, const uint y, const uint z ) const { return brickOccupancy[BrickIndex(x, y, z)] == 0; }
 
 	// RT funstions
+	// the shadow ray towards a light and the light it brings if unoccluded; false if the light can't contribute
+	bool PrepareShadowRay(Light const& light, float3 const& pixelWorldPos, float3 const& pixelNormal, Ray& ray, float3& contribution) const;
 	float3 ShadowRay(Light const& light, float3 const& pixelWorldPos, float3 const& pixelNormal) const;
 
 	// Managment functions
 	bool AddLight(const Light& light);
 	bool RemoveLight(const int id);
+	void LightChanged(const int id);	// after moving a light or changing its range in place
+	void UpdateLightGrid();				// at a frame boundary
+	// the indices of the lights that may reach a point, see LightGrid
+	const vector<uint>& LightsNear(const float3& p) const { return lightGrid.LightsAt(p); }
 
 	vector<Light>& GetLights() { return lights; }
+	// call MaterialsChanged after editing the materials; the next frame rebuilds the table
 	map<unsigned short, Material>& GetMaterials() { return materials; }
-	const Material& GetMaterialByKey(unsigned short key, bool& isKeyValid);
+	void MaterialsChanged() { materialsChanged = true; }
+	void UpdateMaterialTable();	// at a frame boundary
+	Material GetMaterialByKey(unsigned short key) const { PROFILE_COUNT(MaterialLookups, 1); return materialTable.Get(key); }
+	const MaterialTable& GetMaterialTable() const { return materialTable; }
 
 	vector<Light> lights;
 	map<unsigned short, Material> materials;
 	const Material defaultMaterial = Material(float3(0.75f, 0.0f, 0.75f), 0.0f, 0.0f);
+	MaterialTable materialTable;	// what shading reads; the materials as of the last UpdateMaterialTable
+	bool materialsChanged = true;
+	LightGrid lightGrid;
+	bool lightsChanged = true;	// the light grid needs a full rebuild
+
+	// world dimensions: the longest axis spans one unit of world space, so a voxel
+	// measures cellSize on every axis and the grid spans 'extent'
+	uint3 size;			// in voxels, powers of 2
+	uint3 brickGridSize, blockGridSize;
+	float cellSize;
+	float3 extent;
+	GridLayout layout = LinearLayout;
+	GridFormat format = Keys16;
+	SceneBackend backend = GridBackend;
+	SparseVoxelOctree* octree = 0;
+	StreamedWorld* stream = 0;
 
-	// grid contains key to a material in a map of materials;
+	// grid contains key to a material in a map of materials; 0 for an 8-bit grid
 	unsigned short *grid;
+	// the 8-bit grid: per voxel an index into the palette of its brick, PALETTESIZE keys
+	// per palette; index 0 is NOMATERIALKEY in every palette. Palette 0 is shared.
+	uchar* paletteGrid = 0;
+	uint* brickPalette = 0;				// per brick
+	vector<unsigned short> palettes;
+	vector<uint> paletteUsed;			// entries per palette
+	// number of solid voxels per brick, kept up to date by SetMaterial
+	uint *brickOccupancy;
+	// solid voxel bits per block, kept up to date by SetMaterial
+	uint64_t *blockOccupancy;
+	// Chebyshev distance to the nearest non-empty brick, 0 for non-empty bricks
+	uchar *brickDistance;
 
 private:
-	bool Setup3DDDA( Ray& ray, DDAState& state ) const;
+	void Traverse( Ray& ray, DDAState& state ) const;
+	template <class V> void FindNearestPacket( Ray* rays, const uint count ) const;
+	bool SetWorldSize( const uint3& newSize, const uint maxShift );
+	void FreeGrid();
+	void ReleaseOctree();
+	void ReleaseStream();
+	void ClearGrid();
+	void BuildCellOffsets( const GridLayout newLayout, uint* offsets ) const;
+	bool CompactGrid();
+	void ExpandGrid();
+	void FreePalettes();
+	bool SetPaletteKey( const uint x, const uint y, const uint z, const unsigned short materialKey );
+	bool ReadGrid( FILE* f );
+	bool ReadChunks( FILE* f );
+	bool WriteChunks( FILE* f ) const;
+	bool ReadJournal( FILE* f, vector<Light>& newLights, map<unsigned short, Material>& newMaterials );
+	static bool ReadLevelData( FILE* f, vector<Light>& newLights, map<unsigned short, Material>& newMaterials );
+	static bool WriteLevelData( FILE* f, const vector<Light>& lights, const map<unsigned short, Material>& materials );
+	static bool CompactLevelFile( LevelFile& file );
+	void GatherChunk( const uint index, unsigned short* keys ) const;
+	bool MapGrid( const char* filepath, const uint3& newSize, const MappedSections& sections );
+	bool WriteMappedGrid( FILE* f ) const;
+	void ReleaseMapping();
+	void UpdateOccupancy();
+	void UpdateBrickOccupancy( const uint bx, const uint by, const uint bz );
+	void UpdateDistanceField( const int3& lo, const int3& hi );
+	void OnBrickChanged( const uint x, const uint y, const uint z, const bool filled );
+
+	bool bulkEdit = false;
+	// level file chunks: powers of 2, LEVELCHUNKSIZE or the world size per axis
+	uint3 chunkEdge, chunkGridSize, chunkShift;
+	vector<uchar> dirtyChunks;	// per chunk, set by SetMaterial
+	uint generation = 0;		// unique per world, so a save can tell it is still the same one
+	uint ChunkIndex( const uint x, const uint y, const uint z ) const
+	{
+		return (x >> chunkShift.x) + ((y >> chunkShift.y) + (z >> chunkShift.z) * chunkGridSize.y) * chunkGridSize.x;
+	}
+	// set when the grid and its acceleration structure live in a mapping of a level file
+	MappedFile* mappedLevel = 0;
+	// per level, the shifts that turn y and z into a linear index: (0, log2 sx, log2 sx*sy)
+	uint3 brickShift, blockShift;
+	// every layout is separable: a cell index is the sum of one offset per axis
+	uint* cellOffsets = 0;	// size.x + size.y + size.z entries
+	uint *cellX, *cellY, *cellZ;
+	uint CellIndex( const uint x, const uint y, const uint z ) const
+	{
+		return cellX[x] + cellY[y] + cellZ[z];
+	}
+	uint BrickIndex( const uint x, const uint y, const uint z ) const
+	{
+		return (x >> BRICKSHIFT) + ((y >> BRICKSHIFT) << brickShift.y) + ((z >> BRICKSHIFT) << brickShift.z);
+	}
+	uint BlockIndex( const uint x, const uint y, const uint z ) const
+	{
+		return (x >> BLOCKSHIFT) + ((y >> BLOCKSHIFT) << blockShift.y) + ((z >> BLOCKSHIFT) << blockShift.z);
+	}
+	unsigned short CellKey( const uint cell, const uint x, const uint y, const uint z ) const
+	{
+		return paletteGrid ? palettes[(size_t)brickPalette[BrickIndex(x, y, z)] * PALETTESIZE + paletteGrid[cell]] : grid[cell];
+	}
+	static uint64_t BlockBit( const uint x, const uint y, const uint z )
+	{
+		return 1ull << ((x & 3) + (y & 3) * 4 + (z & 3) * 16);
+	}
+	bool IsSolid( const uint x, const uint y, const uint z ) const
+	{
+		return (blockOccupancy[BlockIndex(x, y, z)] & BlockBit(x, y, z)) != 0;
+	}
 };
 
 }
\ No newline at end of file
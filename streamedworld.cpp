@@ -0,0 +1,326 @@
+#include "template.h"
+
+StreamedWorld::~StreamedWorld()
+{
+	{
+		lock_guard<mutex> lock( loadLock );
+		stopLoaders = true;
+	}
+	loadWake.notify_all();
+	for (thread& loader : loaders) loader.join();
+	FREE64( keys );
+	FREE64( blockOccupancy );
+	FREE64( brickOccupancy );
+}
+
+bool StreamedWorld::Open( const char* filepath, const uint3& size, const uint3& edge, vector<ChunkSource>& chunkSources, const size_t cacheBytes )
+{
+	chunkEdge = edge;
+	chunkShift = make_uint3( log2_pow2( edge.x ), log2_pow2( edge.y ), log2_pow2( edge.z ) );
+	chunkGridSize = make_uint3( size.x / edge.x, size.y / edge.y, size.z / edge.z );
+	chunkVoxels = edge.x * edge.y * edge.z, chunkBlocks = chunkVoxels >> (3 * BLOCKSHIFT), chunkBricks = chunkVoxels >> (3 * BRICKSHIFT);
+	const uint chunks = chunkGridSize.x * chunkGridSize.y * chunkGridSize.z;
+	if (chunkSources.size() != chunks) return false;
+	// a file handle per loader, so their reads do not wait for each other's seeks
+	FILE* files[STREAMTHREADS] = {};
+	for (int i = 0; i < STREAMTHREADS; i++) if (!(files[i] = fopen( filepath, "rb" )))
+	{
+		for (int j = 0; j < i; j++) fclose( files[j] );
+		return false;
+	}
+	// no more slots than there are chunks with voxels in them
+	uint solidChunks = 0;
+	for (const ChunkSource& source : chunkSources) if (source.bytes) solidChunks++;
+	slots = (uint)min( cacheBytes / SlotBytes(), (size_t)max( 1u, solidChunks ) );
+	if (slots == 0)
+	{
+		printf( "The chunk cache is too small for a single chunk\n" );
+		for (int i = 0; i < STREAMTHREADS; i++) fclose( files[i] );
+		return false;
+	}
+	sources.swap( chunkSources );
+	slotOf.assign( chunks, NOSLOT );
+	requested = vector<atomic<uchar>>( chunks );
+	requestQueue.resize( chunks );
+	chunkOf.assign( slots, NOSLOT );
+	lastHit = vector<atomic<uint>>( slots );
+	prefetchedSlot.assign( slots, 0 );
+	freeSlots.resize( slots );
+	for (uint i = 0; i < slots; i++) freeSlots[i] = slots - 1 - i;
+	keys = (unsigned short*)MALLOC64( (size_t)slots * chunkVoxels * sizeof(unsigned short) );
+	blockOccupancy = (uint64_t*)MALLOC64( (size_t)slots * chunkBlocks * sizeof(uint64_t) );
+	brickOccupancy = (uint*)MALLOC64( (size_t)slots * chunkBricks * sizeof(uint) );
+	for (int i = 0; i < STREAMTHREADS; i++) loaders.push_back( thread( &StreamedWorld::Loader, this, files[i] ) );
+	return true;
+}
+
+void StreamedWorld::Loader( FILE* f )
+{
+	vector<uchar> packed;
+	unique_lock<mutex> lock( loadLock );
+	while (1)
+	{
+		loadWake.wait( lock, [this]() { return stopLoaders || !pendingLoads.empty(); } );
+		if (stopLoaders) break;
+		LoadJob job = pendingLoads.front();
+		pendingLoads.pop_front();
+		lock.unlock();
+		job.loaded = LoadChunk( f, job.chunk, job.slot, packed );
+		lock.lock();
+		finishedLoads.push_back( job );
+		if (--loadsInFlight == 0) loadIdle.notify_all();
+	}
+	fclose( f );
+}
+
+bool StreamedWorld::Loading()
+{
+	lock_guard<mutex> lock( loadLock );
+	return loadsInFlight > 0;
+}
+
+bool StreamedWorld::Prefetch( const uint3& chunk )
+{
+	if (chunk.x >= chunkGridSize.x || chunk.y >= chunkGridSize.y || chunk.z >= chunkGridSize.z) return false;
+	const uint i = chunk.x + (chunk.y + chunk.z * chunkGridSize.y) * chunkGridSize.x;
+	if (slotOf[i] != NOSLOT || sources[i].bytes == 0 || requested[i] != 0) return false;
+	requested[i] = 3;
+	prefetchQueue.push_back( i );
+	return true;
+}
+
+uint StreamedWorld::TakeSlot( const uint minAge )
+{
+	if (!freeSlots.empty())
+	{
+		const uint slot = freeSlots.back();
+		freeSlots.pop_back();
+		return slot;
+	}
+	if (nextVictim == NOSLOT)
+	{
+		// the resident chunks, least recently hit first; slots that are being loaded into are not in the table
+		victims.clear();
+		for (uint slot = 0; slot < slots; slot++) if (chunkOf[slot] != NOSLOT && slotOf[chunkOf[slot]] == slot)
+			victims.push_back( make_pair( lastHit[slot].load(), slot ) );
+		sort( victims.begin(), victims.end() );
+		nextVictim = 0;
+	}
+	if (nextVictim == victims.size() || frame - victims[nextVictim].first < minAge) return NOSLOT;
+	// out of the table before a loader writes to the slot; no ray can reach it after this
+	const uint slot = victims[nextVictim++].second;
+	slotOf[chunkOf[slot]] = NOSLOT;
+	if (prefetchedSlot[slot]) stats.prefetchWasted++;
+	resident--, stats.evicted++;
+	return slot;
+}
+
+uint StreamedWorld::Update( const float3& viewpoint, const bool wait )
+{
+	vector<LoadJob> finished;
+	uint inFlight;
+	{
+		unique_lock<mutex> lock( loadLock );
+		if (wait) loadIdle.wait( lock, [this]() { return loadsInFlight == 0; } );
+		finished.swap( finishedLoads );
+		inFlight = loadsInFlight;
+	}
+	// the frame that just ended, before new chunks come in
+	stats.hits = 0, stats.misses = requestCount;
+	for (uint slot = 0; slot < slots; slot++) if (chunkOf[slot] != NOSLOT && slotOf[chunkOf[slot]] == slot && lastHit[slot] == frame)
+	{
+		stats.hits++;
+		if (prefetchedSlot[slot]) prefetchedSlot[slot] = 0, stats.prefetchUsed++;
+	}
+	uint installed = 0;
+	for (const LoadJob& job : finished)
+	{
+		requested[job.chunk] = 0;
+		if (job.loaded)
+		{
+			slotOf[job.chunk] = job.slot, lastHit[job.slot] = frame, prefetchedSlot[job.slot] = job.prefetch;
+			resident++, stats.loaded++, installed++;
+			continue;
+		}
+		// a damaged chunk is not tried again
+		printf( "Chunk %u of the streamed level is damaged\n", job.chunk );
+		sources[job.chunk].bytes = 0;
+		chunkOf[job.slot] = NOSLOT;
+		freeSlots.push_back( job.slot );
+	}
+	// the requested chunks nearest to the viewpoint first; the chunks that do not fit are
+	// forgotten, rays that still need them ask again, and the prefetcher queues them again
+	vector<pair<float, uint>> demand;
+	for (uint i = 0; i < requestCount; i++)
+	{
+		const uint chunk = requestQueue[i];
+		const float3 centre = make_float3( (float)(chunk % chunkGridSize.x) + 0.5f, (float)(chunk / chunkGridSize.x % chunkGridSize.y) + 0.5f,
+			(float)(chunk / (chunkGridSize.x * chunkGridSize.y)) + 0.5f ) * make_float3( chunkEdge );
+		demand.push_back( make_pair( sqrLength( centre - viewpoint ), chunk ) );
+	}
+	requestCount = 0;
+	sort( demand.begin(), demand.end() );
+	vector<LoadJob> jobs;
+	nextVictim = NOSLOT;
+	auto Issue = [&]( const uint chunk, const bool prefetch )
+	{
+		// a ray asking for a chunk may evict any chunk that was not hit in the frame that just
+		// ended; a prefetch only one that has not been hit for a while
+		const uint slot = inFlight + jobs.size() < STREAMINFLIGHT ? TakeSlot( prefetch ? STREAMPREFETCHAGE : 1 ) : NOSLOT;
+		if (slot == NOSLOT) { requested[chunk] = 0; return; }
+		chunkOf[slot] = chunk, requested[chunk] = 2, prefetchedSlot[slot] = 0;
+		jobs.push_back( LoadJob{ chunk, slot, prefetch, false } );
+		if (prefetch) stats.prefetched++;
+	};
+	for (const pair<float, uint>& d : demand) Issue( d.second, false );
+	for (const uint chunk : prefetchQueue) Issue( chunk, true );
+	prefetchQueue.clear();
+	if (!jobs.empty())
+	{
+		{
+			lock_guard<mutex> lock( loadLock );
+			pendingLoads.insert( pendingLoads.end(), jobs.begin(), jobs.end() );
+			loadsInFlight += (uint)jobs.size();
+		}
+		loadWake.notify_all();
+	}
+	frame++;
+	return installed;
+}
+
+bool StreamedWorld::LoadChunk( FILE* f, const uint chunk, const uint slot, vector<uchar>& packed )
+{
+	// decompress straight into the slot, and derive its occupancy
+	const ChunkSource& source = sources[chunk];
+	unsigned short* voxels = keys + (size_t)slot * chunkVoxels;
+	uint64_t* blocks = blockOccupancy + (size_t)slot * chunkBlocks;
+	uint* bricks = brickOccupancy + (size_t)slot * chunkBricks;
+	packed.resize( source.bytes );
+	uLongf bytes = chunkVoxels * sizeof(unsigned short);
+	if (!seek_file( f, source.offset ) || fread( packed.data(), 1, source.bytes, f ) != source.bytes ||
+		uncompress( (Bytef*)voxels, &bytes, packed.data(), source.bytes ) != Z_OK || bytes != chunkVoxels * sizeof(unsigned short)) return false;
+	memset( blocks, 0, chunkBlocks * sizeof(uint64_t) );
+	memset( bricks, 0, chunkBricks * sizeof(uint) );
+	for (uint z = 0, i = 0; z < chunkEdge.z; z++) for (uint y = 0; y < chunkEdge.y; y++) for (uint x = 0; x < chunkEdge.x; x++, i++)
+	{
+		if (voxels[i] == NOMATERIALKEY) continue;
+		const uint3 l = make_uint3( x, y, z );
+		blocks[LocalBlock( l )] |= BlockBit( l );
+		bricks[LocalBrick( l )]++;
+	}
+	return true;
+}
+
+bool StreamedWorld::Locate( const uint x, const uint y, const uint z, uint& slot, uint3& local ) const
+{
+	const uint chunk = ChunkIndex( x, y, z );
+	slot = slotOf[chunk];
+	if (slot == NOSLOT)
+	{
+		if (sources[chunk].bytes) Request( chunk );
+		return false;
+	}
+	local = make_uint3( x & (chunkEdge.x - 1), y & (chunkEdge.y - 1), z & (chunkEdge.z - 1) );
+	return true;
+}
+
+unsigned short StreamedWorld::GetMaterial( const uint x, const uint y, const uint z ) const
+{
+	uint slot;
+	uint3 l;
+	if (!Locate( x, y, z, slot, l )) return NOMATERIALKEY;
+	return keys[(size_t)slot * chunkVoxels + LocalVoxel( l )];
+}
+
+bool StreamedWorld::SkipChunk( Scene::DDAState& s, const uint3& size, uint& axis ) const
+{
+	const uint3 lo = make_uint3( s.X & ~(chunkEdge.x - 1), s.Y & ~(chunkEdge.y - 1), s.Z & ~(chunkEdge.z - 1) );
+	return skip_empty_box( s, lo, lo + chunkEdge - 1u, size, axis );
+}
+
+void StreamedWorld::Traverse( Ray& ray, Scene::DDAState& s, const uint3& size ) const
+{
+	// see Scene::Traverse; a chunk that is not resident is skipped as a whole, like an empty brick
+	unsigned short cellKey = NOMATERIALKEY;
+	uint axis = ray.axis, steps = 0, slot;
+	uint3 l;
+	if (ray.inside)
+	{
+		// step until we leave the solid voxels, and report the last one
+		while (1)
+		{
+			steps++;
+			const unsigned short key = GetMaterial( s.X, s.Y, s.Z );
+			if (key == NOMATERIALKEY) break;
+			cellKey = key;
+			if (!skip_empty_block( s, 1, size, axis )) break;
+		}
+	}
+	else while (1)
+	{
+		steps++;
+		if (!Locate( s.X, s.Y, s.Z, slot, l ))
+		{
+			if (!SkipChunk( s, size, axis )) break;
+			continue;
+		}
+		if (brickOccupancy[(size_t)slot * chunkBricks + LocalBrick( l )] == 0)
+		{
+			if (!skip_empty_block( s, BRICKSIZE, size, axis )) break;
+			continue;
+		}
+		const uint64_t mask = blockOccupancy[(size_t)slot * chunkBlocks + LocalBlock( l )];
+		if (mask == 0)
+		{
+			if (!skip_empty_block( s, BLOCKSIZE, size, axis )) break;
+			continue;
+		}
+		if (mask & BlockBit( l ))
+		{
+			cellKey = keys[(size_t)slot * chunkVoxels + LocalVoxel( l )];
+			Hit( slot );
+			break;
+		}
+		if (!skip_empty_block( s, 1, size, axis )) break;
+	}
+	ray.voxelKey = cellKey;
+	ray.t = s.t;
+	ray.axis = axis;
+	PROFILE_COUNT( DDASteps, steps );
+}
+
+bool StreamedWorld::IsOccluded( const Ray& ray, Scene::DDAState& s, const uint3& size ) const
+{
+	uint axis, steps = 0, slot;
+	uint3 l;
+	bool occluded = false;
+	while (s.t < ray.t)
+	{
+		steps++;
+		if (!Locate( s.X, s.Y, s.Z, slot, l ))
+		{
+			if (!SkipChunk( s, size, axis )) break;
+			continue;
+		}
+		if (brickOccupancy[(size_t)slot * chunkBricks + LocalBrick( l )] == 0)
+		{
+			if (!skip_empty_block( s, BRICKSIZE, size, axis )) break;
+			continue;
+		}
+		const uint64_t mask = blockOccupancy[(size_t)slot * chunkBlocks + LocalBlock( l )];
+		if (mask == 0)
+		{
+			if (!skip_empty_block( s, BLOCKSIZE, size, axis )) break;
+			continue;
+		}
+		if (mask & BlockBit( l ))
+		{
+			occluded = s.t < ray.t;
+			Hit( slot );
+			break;
+		}
+		if (!skip_empty_block( s, 1, size, axis )) break;
+	}
+	PROFILE_COUNT( DDASteps, steps );
+	return occluded;
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#define STREAMTHREADS	4		// threads that read and decompress chunks
+#define STREAMINFLIGHT	128		// chunks being loaded at most
+#define STREAMPREFETCHAGE	60	// frames a chunk must have gone without a hit before a prefetch may evict it
+#define NOSLOT			0xffffffff
+
+namespace Tmpl8 {
+
+// file positions beyond 2GB; long is 32 bits on Windows
+inline bool seek_file( FILE* f, const uint64_t offset )
+{
+#ifdef _WIN32
+	return _fseeki64( f, (long long)offset, SEEK_SET ) == 0;
+#else
+	return fseeko( f, (off_t)offset, SEEK_SET ) == 0;
+#endif
+}
+
+inline bool seek_file_end( FILE* f )
+{
+#ifdef _WIN32
+	return _fseeki64( f, 0, SEEK_END ) == 0;
+#else
+	return fseeko( f, 0, SEEK_END ) == 0;
+#endif
+}
+
+inline uint64_t tell_file( FILE* f )
+{
+#ifdef _WIN32
+	return (uint64_t)_ftelli64( f );
+#else
+	return (uint64_t)ftello( f );
+#endif
+}
+
+// A level that does not have to fit in memory: the chunks of a chunked level file are
+// paged into a cache of a fixed number of slots as rays need them, and the chunk that
+// was hit least recently makes room when the cache is full. Traversal looks every chunk
+// up in the resident-chunk table. A chunk that is not resident counts as empty and is
+// requested, so rays never wait for the disk; Update, at frame boundaries, hands the
+// requested chunks nearest to the camera, and then any prefetched ones (see
+// ChunkPrefetcher), to a pool of loader threads. Static, like the octree.
+// The loaders read with plain positional reads, one file handle each; io_uring would
+// save the threads, but does not exist on every platform the renderer builds on.
+class StreamedWorld
+{
+public:
+	struct ChunkSource
+	{
+		uint64_t offset = 0;	// of the compressed chunk in the file
+		uint bytes = 0;			// compressed size; 0 for a chunk without solid voxels
+	};
+	struct Stats
+	{
+		uint hits = 0, misses = 0;	// last frame: resident chunks that rays hit, and missing chunks that rays asked for
+		uint64_t loaded = 0, evicted = 0;
+		uint64_t prefetched = 0;	// loads that no ray asked for yet
+		uint64_t prefetchUsed = 0, prefetchWasted = 0;	// prefetched chunks that rays hit, and that were evicted without a hit
+	};
+	~StreamedWorld();	// stops the loaders; chunks still being loaded are dropped
+	// 'sources' per chunk, x fastest; the cache takes up to 'cacheBytes'
+	bool Open( const char* filepath, const uint3& size, const uint3& chunkEdge, vector<ChunkSource>& sources, const size_t cacheBytes );
+	// Frame boundary, with no rays in flight: put the chunks the loaders finished in the table,
+	// and hand them the next chunks: first those rays asked for, nearest to 'viewpoint' (in
+	// voxels), then the prefetched ones, in the order they were queued. The chunks hit least
+	// recently make room. With 'wait', the chunks in progress are waited for first. Returns
+	// the number of chunks that became resident.
+	uint Update( const float3& viewpoint, const bool wait = false );
+	bool Loading();
+	// queue a chunk, by its position in chunks, to load before rays need it; call between
+	// frames, before Update. False for chunks that are resident, empty or on their way already.
+	bool Prefetch( const uint3& chunk );
+	const uint3& ChunkGridSize() const { return chunkGridSize; }
+	const uint3& ChunkEdge() const { return chunkEdge; }
+
+	unsigned short GetMaterial( const uint x, const uint y, const uint z ) const;
+	void Traverse( Ray& ray, Scene::DDAState& s, const uint3& size ) const;
+	bool IsOccluded( const Ray& ray, Scene::DDAState& s, const uint3& size ) const;
+
+	size_t MemoryUsage() const { return (size_t)slots * SlotBytes() + sources.size() * (sizeof(ChunkSource) + 2 * sizeof(uint) + 1); }
+	uint ResidentChunks() const { return resident; }
+	uint CacheChunks() const { return slots; }
+	Stats stats;
+private:
+	struct LoadJob
+	{
+		uint chunk, slot;
+		bool prefetch, loaded;
+	};
+	size_t SlotBytes() const { return chunkVoxels * sizeof(unsigned short) + chunkBlocks * sizeof(uint64_t) + chunkBricks * sizeof(uint); }
+	void Loader( FILE* f );
+	bool LoadChunk( FILE* f, const uint chunk, const uint slot, vector<uchar>& packed );
+	// a slot for a chunk to load: a free one, or the one hit least recently, if that was
+	// at least 'minAge' frames ago
+	uint TakeSlot( const uint minAge );
+	void Request( const uint chunk ) const
+	{
+		// the first ray to ask queues the chunk; it stays requested until Update has seen it
+		PROFILE_COUNT( ChunkMisses, 1 );
+		if (requested[chunk].load( memory_order_relaxed ) == 0 && requested[chunk].exchange( 1 ) == 0)
+			requestQueue[AtomicAdd( requestCount, 1 ) - 1] = chunk;
+	}
+	uint ChunkIndex( const uint x, const uint y, const uint z ) const
+	{
+		return (x >> chunkShift.x) + ((y >> chunkShift.y) + (z >> chunkShift.z) * chunkGridSize.y) * chunkGridSize.x;
+	}
+	// the resident chunk around a voxel, and the voxel's position in it; false if it is not resident
+	bool Locate( const uint x, const uint y, const uint z, uint& slot, uint3& local ) const;
+	// brick, block and voxel index within a chunk
+	uint LocalBrick( const uint3& l ) const { return (l.x >> BRICKSHIFT) + ((l.y >> BRICKSHIFT) << (chunkShift.x - BRICKSHIFT)) + ((l.z >> BRICKSHIFT) << (chunkShift.x + chunkShift.y - 2 * BRICKSHIFT)); }
+	uint LocalBlock( const uint3& l ) const { return (l.x >> BLOCKSHIFT) + ((l.y >> BLOCKSHIFT) << (chunkShift.x - BLOCKSHIFT)) + ((l.z >> BLOCKSHIFT) << (chunkShift.x + chunkShift.y - 2 * BLOCKSHIFT)); }
+	uint LocalVoxel( const uint3& l ) const { return l.x + (l.y << chunkShift.x) + (l.z << (chunkShift.x + chunkShift.y)); }
+	static uint64_t BlockBit( const uint3& l ) { return 1ull << ((l.x & 3) + (l.y & 3) * 4 + (l.z & 3) * 16); }
+	void Hit( const uint slot ) const { if (lastHit[slot].load( memory_order_relaxed ) != frame) lastHit[slot].store( frame, memory_order_relaxed ); }
+	bool SkipChunk( Scene::DDAState& s, const uint3& size, uint& axis ) const;
+
+	uint3 chunkEdge, chunkShift, chunkGridSize;
+	uint chunkVoxels = 0, chunkBlocks = 0, chunkBricks = 0;
+	vector<ChunkSource> sources;
+	vector<uint> slotOf;	// the resident-chunk table: per chunk its slot, or NOSLOT
+	// per chunk 0, 1 once a ray requested it, 2 while it loads, 3 while queued for prefetching
+	mutable vector<atomic<uchar>> requested;
+	mutable vector<uint> requestQueue;	// chunks requested since the last Update
+	mutable uint requestCount = 0;
+	vector<uint> prefetchQueue;
+	// the cache: per slot the voxels of a chunk, x fastest, and their occupancy
+	uint slots = 0, resident = 0;
+	uint frame = 0;					// Update calls so far; hits record it
+	vector<uint> chunkOf;			// per slot its chunk, or NOSLOT
+	mutable vector<atomic<uint>> lastHit;	// per slot, the last frame a ray hit the chunk
+	vector<uint> freeSlots;
+	vector<pair<uint, uint>> victims;	// resident slots by their last hit, oldest first, for TakeSlot
+	uint nextVictim = NOSLOT;			// NOSLOT until this Update needs victims
+	vector<uchar> prefetchedSlot;	// per slot: prefetched, and not hit since
+	unsigned short* keys = 0;
+	uint64_t* blockOccupancy = 0;	// one bit per voxel, as in the grid
+	uint* brickOccupancy = 0;		// solid voxels per brick
+	// the loaders; the slots of the chunks they work on are not in the table until Update
+	vector<thread> loaders;
+	mutex loadLock;
+	condition_variable loadWake, loadIdle;
+	deque<LoadJob> pendingLoads;
+	vector<LoadJob> finishedLoads;
+	uint loadsInFlight = 0;		// handed to the loaders, not yet finished
+	bool stopLoaders = false;
+};
+
+} // namespace Tmpl8
@@ -0,0 +1,167 @@
+#include "template.h"
+
+static inline uint child_count( const uint mask )
+{
+#ifdef _MSC_VER
+	return __popcnt( mask );
+#else
+	return __builtin_popcount( mask );
+#endif
+}
+
+void SparseVoxelOctree::Build( const Scene& scene, const bool dag )
+{
+	pool.clear();
+	dedup = dag;
+	depth = log2_pow2( max( scene.size.x, max( scene.size.y, scene.size.z ) ) );
+	root = BuildNode( scene, depth, 0, 0, 0 );
+	if (root == EMPTYNODE)
+	{
+		// an empty world still gets a root, so traversal never has to check
+		const uint mask = 0;
+		root = AddNode( &mask, 1 );
+	}
+	nodeHashes.clear();
+	pool.shrink_to_fit();
+}
+
+uint SparseVoxelOctree::BuildNode( const Scene& scene, const uint level, const uint x, const uint y, const uint z )
+{
+	// the tree is a cube; the part outside a non-cubic world is empty
+	if (x >= scene.size.x || y >= scene.size.y || z >= scene.size.z) return EMPTYNODE;
+	if (level == BRICKSHIFT && scene.IsBrickEmpty( x, y, z )) return EMPTYNODE;
+	uint words[9], count = 1, mask = 0;
+	const uint half = 1 << (level - 1);
+	for (uint c = 0; c < 8; c++)
+	{
+		const uint cx = x + (c & 1) * half, cy = y + ((c >> 1) & 1) * half, cz = z + (c >> 2) * half;
+		if (level == 1)
+		{
+			const unsigned short key = scene.GetMaterial( cx, cy, cz );
+			if (key == NOMATERIALKEY) continue;
+			words[count++] = key;
+		}
+		else
+		{
+			const uint child = BuildNode( scene, level - 1, cx, cy, cz );
+			if (child == EMPTYNODE) continue;
+			words[count++] = child;
+		}
+		mask |= 1 << c;
+	}
+	if (!mask) return EMPTYNODE;
+	words[0] = mask;
+	return AddNode( words, count );
+}
+
+uint SparseVoxelOctree::AddNode( const uint* words, const uint count )
+{
+	// FNV-1a over the node words; children are built first, so equal subtrees have equal words
+	uint64_t hash = 14695981039346656037ull;
+	if (dedup)
+	{
+		for (uint i = 0; i < count; i++) hash = (hash ^ words[i]) * 1099511628211ull;
+		auto range = nodeHashes.equal_range( hash );
+		for (auto it = range.first; it != range.second; it++)
+			if (child_count( pool[it->second] ) + 1 == count && memcmp( &pool[it->second], words, count * sizeof( uint ) ) == 0) return it->second;
+	}
+	const uint index = (uint)pool.size();
+	pool.insert( pool.end(), words, words + count );
+	if (dedup) nodeHashes.insert( { hash, index } );
+	return index;
+}
+
+void SparseVoxelOctree::Expand( Scene& scene ) const
+{
+	scene.BeginBulkEdit();
+	ExpandNode( scene, root, depth, 0, 0, 0 );
+	scene.EndBulkEdit();
+}
+
+void SparseVoxelOctree::ExpandNode( Scene& scene, const uint node, const uint level, const uint x, const uint y, const uint z ) const
+{
+	const uint mask = pool[node], half = 1 << (level - 1);
+	for (uint c = 0, i = 1; c < 8; c++) if (mask & (1 << c))
+	{
+		const uint cx = x + (c & 1) * half, cy = y + ((c >> 1) & 1) * half, cz = z + (c >> 2) * half;
+		if (level == 1) scene.SetMaterial( cx, cy, cz, (unsigned short)pool[node + i++] );
+		else ExpandNode( scene, pool[node + i++], level - 1, cx, cy, cz );
+	}
+}
+
+unsigned short SparseVoxelOctree::GetMaterial( const uint x, const uint y, const uint z ) const
+{
+	uint node = root;
+	for (uint level = depth; level > 0; level--)
+	{
+		const uint bit = level - 1, mask = pool[node];
+		const uint c = ((x >> bit) & 1) + ((y >> bit) & 1) * 2 + ((z >> bit) & 1) * 4;
+		if (!(mask & (1 << c))) return NOMATERIALKEY;
+		node = pool[node + 1 + child_count( mask & ((1 << c) - 1) )];
+	}
+	return (unsigned short)node; // below level 1, the 'node' is the material key
+}
+
+// Descend from the root to the cell the DDA is in. Returns the material key of a
+// solid voxel, or NOMATERIALKEY and in 'emptySize' the edge of the empty node that
+// holds the cell.
+static inline unsigned short find_cell( const SparseVoxelOctree& svo, const Scene::DDAState& s, uint& emptySize )
+{
+	const uint* pool = svo.pool.data();
+	uint node = svo.root;
+	for (uint level = svo.depth; level > 0; level--)
+	{
+		const uint bit = level - 1, mask = pool[node];
+		const uint c = ((s.X >> bit) & 1) + ((s.Y >> bit) & 1) * 2 + ((s.Z >> bit) & 1) * 4;
+		if (!(mask & (1 << c))) { emptySize = 1 << bit; return NOMATERIALKEY; }
+		node = pool[node + 1 + child_count( mask & ((1 << c) - 1) )];
+	}
+	return (unsigned short)node;
+}
+
+void SparseVoxelOctree::Traverse( Ray& ray, Scene::DDAState& s, const uint3& size ) const
+{
+	// see Scene::Traverse; ray.axis holds the last axis crossed
+	unsigned short cellKey = NOMATERIALKEY;
+	uint axis = ray.axis, emptySize = 1, steps = 0;
+	if (ray.inside)
+	{
+		// step until we leave the solid voxels, and report the last one
+		while (1)
+		{
+			steps++;
+			const unsigned short key = find_cell( *this, s, emptySize );
+			if (key == NOMATERIALKEY) break;
+			cellKey = key;
+			if (!skip_empty_block( s, 1, size, axis )) break;
+		}
+	}
+	else
+	{
+		// skip empty nodes until we hit a solid voxel
+		while (1)
+		{
+			steps++;
+			cellKey = find_cell( *this, s, emptySize );
+			if (cellKey != NOMATERIALKEY || !skip_empty_block( s, emptySize, size, axis )) break;
+		}
+	}
+	ray.voxelKey = cellKey;
+	ray.t = s.t;
+	ray.axis = axis;
+	PROFILE_COUNT( DDASteps, steps );
+}
+
+bool SparseVoxelOctree::IsOccluded( const Ray& ray, Scene::DDAState& s, const uint3& size ) const
+{
+	uint axis, emptySize = 1, steps = 0;
+	bool occluded = false;
+	while (s.t < ray.t)
+	{
+		steps++;
+		if (find_cell( *this, s, emptySize ) != NOMATERIALKEY) { occluded = true; break; }
+		if (!skip_empty_block( s, emptySize, size, axis )) break;
+	}
+	PROFILE_COUNT( DDASteps, steps );
+	return occluded;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <unordered_map>
+
+#define MAXOCTREEDEPTH	13		// octree worlds up to 8192 voxels per axis
+#define EMPTYNODE		0xffffffff
+
+namespace Tmpl8 {
+
+// Sparse voxel octree over the world, for large static levels.
+// Nodes live in a single pool of 32-bit words: a node is its 8-bit child mask,
+// followed by one word per child that exists. Below a level-1 node (2x2x2 voxels)
+// those words are the material keys of the voxels; above it, they are pool indices
+// of the child nodes. With deduplication, identical subtrees are stored once,
+// which turns the tree into a DAG.
+// Traversal is the same Amanatides & Woo walk as the dense grid: every step
+// restarts at the root and descends to the current cell, and an empty node skips
+// its whole box, so no stack is needed.
+class SparseVoxelOctree
+{
+public:
+	// build from the scene's grid; with 'dag', identical subtrees are shared
+	void Build( const Scene& scene, const bool dag );
+	// write all solid voxels back into the scene's grid
+	void Expand( Scene& scene ) const;
+
+	unsigned short GetMaterial( const uint x, const uint y, const uint z ) const;
+	void Traverse( Ray& ray, Scene::DDAState& s, const uint3& size ) const;
+	bool IsOccluded( const Ray& ray, Scene::DDAState& s, const uint3& size ) const;
+
+	size_t MemoryUsage() const { return pool.size() * sizeof(uint); }
+
+	vector<uint> pool;
+	uint root = EMPTYNODE;
+	uint depth = 0;			// the root covers 2^depth voxels per axis
+private:
+	uint BuildNode( const Scene& scene, const uint level, const uint x, const uint y, const uint z );
+	uint AddNode( const uint* words, const uint count );
+	void ExpandNode( Scene& scene, const uint node, const uint level, const uint x, const uint y, const uint z ) const;
+
+	bool dedup = false;
+	unordered_multimap<uint64_t, uint> nodeHashes; // only used while building
+};
+
+} // namespace Tmpl8
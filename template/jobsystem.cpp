@@ -0,0 +1,207 @@
+// Template, IGAD version 3
+// Get the latest version from: https://github.com/jbikker/tmpl8
+// IGAD/NHTV/BUAS/UU - Jacco Bikker - 2006-2023
+
+#include "template.h"
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+JobSystem& Tmpl8::Jobs()
+{
+	static JobSystem jobs;
+	return jobs;
+}
+
+JobSystem::JobSystem( const uint threadCount )
+{
+	uint count = threadCount ? threadCount : thread::hardware_concurrency();
+	if (count == 0) count = 1;
+	poolThread = true;
+	stats.resize( count );
+	for (uint i = 1; i < count; i++) workers.emplace_back( &JobSystem::WorkerLoop, this, i );
+}
+
+JobSystem::~JobSystem()
+{
+	{
+		lock_guard<mutex> l( queueLock );
+		quit = true;
+	}
+	wake.notify_all();
+	for (thread& t : workers) t.join();
+}
+
+void JobSystem::WorkerLoop( const uint index )
+{
+	threadIndex = index, poolThread = true;
+	while (1)
+	{
+		Job job;
+		{
+			unique_lock<mutex> l( queueLock );
+			wake.wait( l, [this] { return quit || !queue.empty() || !backgroundQueue.empty(); } );
+			if (quit) return;
+			deque<Job>& q = queue.empty() ? backgroundQueue : queue;
+			job = move( q.front() );
+			q.pop_front();
+			if (&q == &queue) queued--;
+		}
+		Execute( job );
+	}
+}
+
+void JobSystem::Run( const function<void()>& task, JobCounter* group, JobCounter* after )
+{
+	if (group) group->pending++;
+	if (after)
+	{
+		lock_guard<mutex> l( after->lock );
+		if (!after->Done())
+		{
+			// queued by Finish, when the last job of 'after' completes
+			after->continuations.push_back( make_pair( task, group ) );
+			return;
+		}
+	}
+	Submit( Job{ task, group } );
+}
+
+void JobSystem::Submit( Job&& job, const bool background )
+{
+	{
+		lock_guard<mutex> l( queueLock );
+		if (background) backgroundQueue.push_back( move( job ) );
+		else queue.push_back( move( job ) ), queued++;
+	}
+	wake.notify_one();
+}
+
+bool JobSystem::TryRunJob()
+{
+	Job job;
+	{
+		lock_guard<mutex> l( queueLock );
+		if (queue.empty()) return false;
+		job = move( queue.front() );
+		queue.pop_front();
+		queued--;
+	}
+	Execute( job );
+	return true;
+}
+
+void JobSystem::Execute( Job& job )
+{
+	Timer t;
+	job.task();
+	ThreadStats& s = stats[threadIndex];
+	s.jobs++, s.busy += t.elapsed();
+	Finish( job.group );
+}
+
+void JobSystem::Finish( JobCounter* group )
+{
+	if (!group) return;
+	vector<pair<function<void()>, JobCounter*>> ready;
+	{
+		// decrement under the lock, so Run never adds a continuation after they were released
+		lock_guard<mutex> l( group->lock );
+		if (--group->pending > 0) return;
+		ready.swap( group->continuations );
+	}
+	for (auto& c : ready) Submit( Job{ move( c.first ), c.second } );
+}
+
+void JobSystem::Wait( JobCounter& group )
+{
+	while (!group.Done()) if (!TryRunJob()) this_thread::yield();
+	// the last job may still hold the lock while it releases the continuations
+	lock_guard<mutex> l( group.lock );
+}
+
+void JobSystem::ParallelFor( const int first, const int last, const int grain, const function<void( int from, int to )>& body )
+{
+	if (last <= first) return;
+	const int chunks = (last - first + grain - 1) / grain;
+	if (chunks == 1) { body( first, last ); return; }
+	if (!poolThread) { ParallelForBackground( first, last, grain, body ); return; }
+	// one job per thread; each takes the next chunk until none are left
+	atomic<int> next{ 0 };
+	auto worker = [&]()
+	{
+		for (int c = next++; c < chunks; c = next++)
+		{
+			const int from = first + c * grain;
+			body( from, min( from + grain, last ) );
+		}
+	};
+	JobCounter group;
+	const uint jobs = min( (uint)chunks, ThreadCount() );
+	for (uint i = 1; i < jobs; i++) Run( worker, &group );
+	worker();
+	Wait( group );
+}
+
+void JobSystem::ParallelForBackground( const int first, const int last, const int grain, const function<void( int from, int to )>& body )
+{
+	// e.g. a background level load. Its jobs go to the background queue, so threads waiting
+	// for the frame never pick them up; a worker leaves the loop between chunks as soon as
+	// other jobs are queued, and requeues it to come back later.
+	const int chunks = (last - first + grain - 1) / grain;
+	atomic<int> next{ 0 };
+	JobCounter group;
+	function<void()> helper = [&]()
+	{
+		while (next.load() < chunks)
+		{
+			if (queued.load() > 0)
+			{
+				group.pending++;
+				Submit( Job{ helper, &group }, true );
+				return;
+			}
+			const int c = next++;
+			if (c >= chunks) return;
+			const int from = first + c * grain;
+			body( from, min( from + grain, last ) );
+		}
+	};
+	const uint jobs = min( (uint)chunks, ThreadCount() );
+	for (uint i = 1; i < jobs; i++) group.pending++, Submit( Job{ helper, &group }, true );
+	// this thread is not needed for anything else: it takes chunks until none are left
+	for (int c = next++; c < chunks; c = next++)
+	{
+		const int from = first + c * grain;
+		body( from, min( from + grain, last ) );
+	}
+	// the last chunks may still be running on the workers; a requeued helper finds none left
+	while (!group.Done()) this_thread::yield();
+	lock_guard<mutex> l( group.lock );
+}
+
+void JobSystem::PinThreads( const bool pin )
+{
+	const uint cores = thread::hardware_concurrency();
+	for (uint i = 0; i < ThreadCount(); i++)
+	{
+	#ifdef _WIN32
+		HANDLE h = i == 0 ? GetCurrentThread() : (HANDLE)workers[i - 1].native_handle();
+		DWORD_PTR all = 0;
+		for (uint c = 0; c < cores && c < 64; c++) all |= (DWORD_PTR)1 << c;
+		SetThreadAffinityMask( h, pin && cores > 0 ? (DWORD_PTR)1 << (i % min( cores, 64u )) : all );
+	#else
+		pthread_t h = i == 0 ? pthread_self() : workers[i - 1].native_handle();
+		cpu_set_t set;
+		CPU_ZERO( &set );
+		if (pin && cores > 0) CPU_SET( i % cores, &set );
+		else for (uint c = 0; c < cores; c++) CPU_SET( c, &set );
+		pthread_setaffinity_np( h, sizeof( set ), &set );
+	#endif
+	}
+}
+
+void JobSystem::ResetStats()
+{
+	for (ThreadStats& s : stats) s = ThreadStats();
+}
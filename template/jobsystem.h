@@ -0,0 +1,121 @@
+// Template, IGAD version 3
+// Get the latest version from: https://github.com/jbikker/tmpl8
+// IGAD/NHTV/BUAS/UU - Jacco Bikker - 2006-2023
+
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <functional>
+
+namespace Tmpl8 {
+
+// atomic read-modify-write on plain variables, for data that is shared by the jobs of a parallel loop
+#ifdef _MSC_VER
+inline uint AtomicAdd( uint& v, const int n ) { return (uint)_InterlockedExchangeAdd( (volatile long*)&v, n ) + n; }
+inline void AtomicOr( uint64_t& v, const uint64_t bits ) { _InterlockedOr64( (volatile long long*)&v, (long long)bits ); }
+inline void AtomicAnd( uint64_t& v, const uint64_t bits ) { _InterlockedAnd64( (volatile long long*)&v, (long long)bits ); }
+#else
+inline uint AtomicAdd( uint& v, const int n ) { return __atomic_add_fetch( &v, n, __ATOMIC_RELAXED ); }
+inline void AtomicOr( uint64_t& v, const uint64_t bits ) { __atomic_fetch_or( &v, bits, __ATOMIC_RELAXED ); }
+inline void AtomicAnd( uint64_t& v, const uint64_t bits ) { __atomic_fetch_and( &v, bits, __ATOMIC_RELAXED ); }
+#endif
+inline void AtomicAdd( float& v, const float n )
+{
+	static_assert(sizeof( float ) == sizeof( uint ), "float and uint must have the same size");
+	uint* bits = (uint*)&v;
+	while (1)
+	{
+	#ifdef _MSC_VER
+		const uint seen = *(volatile uint*)bits;
+		float f; memcpy( &f, &seen, 4 ); f += n;
+		uint next; memcpy( &next, &f, 4 );
+		if ((uint)_InterlockedCompareExchange( (volatile long*)bits, (long)next, (long)seen ) == seen) return;
+	#else
+		uint seen = __atomic_load_n( bits, __ATOMIC_RELAXED );
+		float f; memcpy( &f, &seen, 4 ); f += n;
+		uint next; memcpy( &next, &f, 4 );
+		if (__atomic_compare_exchange_n( bits, &seen, next, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED )) return;
+	#endif
+	}
+}
+
+// A group of jobs that can be waited for; pass it to Run to fork, and to Wait to join.
+// A job can also be made to wait for a group: it is queued once the group is done.
+class JobCounter
+{
+	friend class JobSystem;
+	atomic<int> pending{ 0 };
+	mutex lock;
+	vector<pair<function<void()>, JobCounter*>> continuations; // jobs waiting for this group
+public:
+	bool Done() const { return pending.load() == 0; }
+};
+
+// A persistent pool of worker threads, shared by the whole application.
+// The thread that created the pool counts as thread 0; while it waits for a
+// group, it executes queued jobs, so nested fork-join does not deadlock.
+// Threads that are not part of the pool do not show up in the statistics;
+// their parallel loops run as background jobs (see ParallelFor).
+class JobSystem
+{
+public:
+	struct ThreadStats
+	{
+		uint64_t jobs = 0;		// jobs executed since the last ResetStats
+		float busy = 0;			// seconds spent in jobs
+	};
+	JobSystem( const uint threadCount = 0 ); // 0: one thread per hardware thread
+	~JobSystem();
+	// fork: queue 'job' in 'group'; with 'after', it is only queued once that group is done
+	void Run( const function<void()>& job, JobCounter* group = 0, JobCounter* after = 0 );
+	// join: wait for all jobs in 'group', helping out with queued jobs meanwhile
+	void Wait( JobCounter& group );
+	// split [first, last) into chunks of at most 'grain' and run body( from, to ) on all threads;
+	// called from a thread outside the pool, the workers only help out when they have no other jobs
+	void ParallelFor( const int first, const int last, const int grain, const function<void( int from, int to )>& body );
+	template <class T> void ParallelFor( const int first, const int last, const T& body )
+	{
+		// one index per call, like a dynamic OpenMP schedule
+		ParallelFor( first, last, 1, [&body]( int from, int to ) { for (int i = from; i < to; i++) body( i ); } );
+	}
+	// bind each thread to its own hardware thread, or release them again; call from thread 0
+	void PinThreads( const bool pin );
+	uint ThreadCount() const { return (uint)stats.size(); }
+	static uint ThreadIndex() { return threadIndex; }	// 0 for the main thread, 1..n-1 for the workers
+	static bool InPool() { return poolThread; }			// false for e.g. the level loader thread
+	const ThreadStats& GetStats( const uint thread ) const { return stats[thread]; }
+	void ResetStats();
+private:
+	struct Job
+	{
+		function<void()> task;
+		JobCounter* group;
+	};
+	void WorkerLoop( const uint index );
+	void Submit( Job&& job, const bool background = false );
+	bool TryRunJob();
+	void ParallelForBackground( const int first, const int last, const int grain, const function<void( int from, int to )>& body );
+	void Execute( Job& job );
+	void Finish( JobCounter* group );
+
+	deque<Job> queue;
+	deque<Job> backgroundQueue;	// taken by idle workers only, never by a waiting thread
+	atomic<int> queued{ 0 };	// jobs in 'queue', checked by background jobs between chunks
+	mutex queueLock;
+	condition_variable wake;
+	vector<thread> workers;
+	vector<ThreadStats> stats;	// written only by the thread it belongs to
+	bool quit = false;
+	// inline, so per-thread counters (see profiler.h) read it without a call
+	static inline thread_local uint threadIndex = 0;
+	static inline thread_local bool poolThread = false;
+};
+
+// the application-wide job system, created on first use
+JobSystem& Jobs();
+
+} // namespace Tmpl8
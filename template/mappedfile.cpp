@@ -0,0 +1,63 @@
+// Template, IGAD version 3
+// Get the latest version from: https://github.com/jbikker/tmpl8
+// IGAD/NHTV/BUAS/UU - Jacco Bikker - 2006-2023
+
+#include "template.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef _WIN32
+
+bool MappedFile::Open( const char* file )
+{
+	Close();
+	HANDLE f = CreateFileA( file, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0 );
+	if (f == INVALID_HANDLE_VALUE) return false;
+	LARGE_INTEGER fileSize;
+	if (GetFileSizeEx( f, &fileSize ) && fileSize.QuadPart > 0)
+		mapping = CreateFileMappingA( f, 0, PAGE_WRITECOPY, 0, 0, 0 );
+	// the mapping keeps the file open
+	CloseHandle( f );
+	if (!mapping) return false;
+	data = (uchar*)MapViewOfFile( mapping, FILE_MAP_COPY, 0, 0, 0 );
+	if (!data) { Close(); return false; }
+	bytes = (size_t)fileSize.QuadPart;
+	return true;
+}
+
+void MappedFile::Close()
+{
+	if (data) UnmapViewOfFile( data );
+	if (mapping) CloseHandle( mapping );
+	data = 0, mapping = 0, bytes = 0;
+}
+
+#else
+
+bool MappedFile::Open( const char* file )
+{
+	Close();
+	const int f = open( file, O_RDONLY );
+	if (f < 0) return false;
+	struct stat info;
+	void* p = MAP_FAILED;
+	if (fstat( f, &info ) == 0 && info.st_size > 0)
+		p = mmap( 0, (size_t)info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, f, 0 );
+	// the mapping keeps the file open
+	close( f );
+	if (p == MAP_FAILED) return false;
+	data = (uchar*)p, bytes = (size_t)info.st_size;
+	return true;
+}
+
+void MappedFile::Close()
+{
+	if (data) munmap( data, bytes );
+	data = 0, bytes = 0;
+}
+
+#endif
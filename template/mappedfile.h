@@ -0,0 +1,28 @@
+// Template, IGAD version 3
+// Get the latest version from: https://github.com/jbikker/tmpl8
+// IGAD/NHTV/BUAS/UU - Jacco Bikker - 2006-2023
+
+#pragma once
+
+namespace Tmpl8 {
+
+// A file mapped into memory with private, copy-on-write pages: the OS reads pages in
+// on first access, and a page that is written to becomes a private copy, so the
+// contents can be edited in memory while the file itself never changes.
+class MappedFile
+{
+public:
+	~MappedFile() { Close(); }
+	bool Open( const char* file );
+	void Close();
+	uchar* Data() const { return data; }
+	size_t Size() const { return bytes; }
+private:
+	uchar* data = 0;
+	size_t bytes = 0;
+#ifdef _WIN32
+	void* mapping = 0;
+#endif
+};
+
+} // namespace Tmpl8
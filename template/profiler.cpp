@@ -0,0 +1,84 @@
+// Template, IGAD version 3
+// Get the latest version from: https://github.com/jbikker/tmpl8
+// IGAD/NHTV/BUAS/UU - Jacco Bikker - 2006-2023
+
+#include "template.h"
+
+const char* Profiler::counterNames[PROFILECOUNTERS] = { "primary rays", "shadow rays", "bounce rays", "DDA steps", "light evaluations", "material lookups", "chunk misses" };
+const char* Profiler::stageNames[PROFILESTAGES] = { "camera input", "primary trace", "shading", "present", "UI" };
+thread_local Profiler::ThreadData Profiler::dropped;
+
+Profiler::Profiler()
+{
+	// one slot per job system thread; other threads count into 'dropped'
+	threads.resize( Jobs().ThreadCount() );
+	origin = chrono::high_resolution_clock::now();
+}
+
+double Profiler::Now() const
+{
+	return chrono::duration<double, micro>( chrono::high_resolution_clock::now() - origin ).count();
+}
+
+void Profiler::AddEvent( const char* name, const double start, const double end )
+{
+	if (captureFrames > 0 && JobSystem::InPool()) Local().events.push_back( TraceEvent{ name, start, end - start } );
+}
+
+void Profiler::EndFrame()
+{
+	frame = FrameStats();
+	for (ThreadData& thread : threads)
+	{
+		for (int i = 0; i < PROFILECOUNTERS; i++) frame.counters[i] += thread.counters[i], thread.counters[i] = 0;
+		for (int i = 0; i < PROFILESTAGES; i++) frame.stageTime[i] += (float)(thread.stageTime[i] * 0.001), thread.stageTime[i] = 0;
+	}
+	const double now = Now();
+	if (captureFrames > 0)
+	{
+		threads[0].events.push_back( TraceEvent{ "frame", frameStart, now - frameStart } );
+		frameMarkers.push_back( FrameMarker{ frameStart, frame } );
+		if (--captureFrames == 0)
+		{
+			SaveTrace( captureFile.c_str() );
+			for (ThreadData& thread : threads) thread.events.clear();
+			frameMarkers.clear();
+		}
+	}
+	frameStart = now;
+}
+
+void Profiler::CaptureTrace( const char* file, const int frames )
+{
+	for (ThreadData& thread : threads) thread.events.clear();
+	frameMarkers.clear();
+	captureFile = file, captureFrames = frames;
+}
+
+// Chrome trace event format: complete ("X") events per thread, and a counter ("C")
+// track per counter with the totals of each frame
+bool Profiler::SaveTrace( const char* file ) const
+{
+	FILE* f = fopen( file, "w" );
+	if (!f) { printf( "Could not write trace %s\n", file ); return false; }
+	fprintf( f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" );
+	fprintf( f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"VoxelRT\"}}" );
+	for (size_t t = 0; t < threads.size(); t++)
+	{
+		fprintf( f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%i,\"args\":{\"name\":\"%s %i\"}}", (int)t, t ? "worker" : "main", (int)t );
+		for (const TraceEvent& e : threads[t].events)
+			fprintf( f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%i,\"ts\":%.3f,\"dur\":%.3f}", e.name, (int)t, e.start, e.duration );
+	}
+	for (const FrameMarker& m : frameMarkers)
+	{
+		for (int i = 0; i < PROFILECOUNTERS; i++)
+			fprintf( f, ",\n{\"name\":\"%s\",\"ph\":\"C\",\"pid\":0,\"ts\":%.3f,\"args\":{\"count\":%llu}}", counterNames[i], m.start, (unsigned long long)m.stats.counters[i] );
+		fprintf( f, ",\n{\"name\":\"stage time (ms)\",\"ph\":\"C\",\"pid\":0,\"ts\":%.3f,\"args\":{", m.start );
+		for (int i = 0; i < PROFILESTAGES; i++) fprintf( f, "%s\"%s\":%.3f", i ? "," : "", stageNames[i], m.stats.stageTime[i] );
+		fprintf( f, "}}" );
+	}
+	fprintf( f, "\n]}\n" );
+	fclose( f );
+	printf( "Trace written to %s\n", file );
+	return true;
+}
@@ -0,0 +1,134 @@
+// Template, IGAD version 3
+// Get the latest version from: https://github.com/jbikker/tmpl8
+// IGAD/NHTV/BUAS/UU - Jacco Bikker - 2006-2023
+
+#pragma once
+
+#define PROFILING	1		// stage timers, trace capture and the traversal counters; 0 compiles them out
+
+namespace Tmpl8 {
+
+// hot path counters; ray counts are always kept, the rest only with PROFILING
+enum ProfileCounter
+{
+	PrimaryRays,
+	ShadowRays,
+	BounceRays,
+	DDASteps,			// cells, empty blocks and empty bricks stepped over, per ray
+	LightEvaluations,	// lights considered for a shaded point, including those that can't contribute
+	MaterialLookups,	// material table reads
+	ChunkMisses,		// steps into chunks of a streamed level that were not in memory yet
+	PROFILECOUNTERS
+};
+
+// stages of a frame; time is summed over all threads, so a stage can take longer than the frame
+enum ProfileStage
+{
+	CameraInputStage,
+	PrimaryTraceStage,	// FindNearest for primary rays
+	ShadingStage,		// everything after the primary hit: shadow rays, bounces, accumulation
+	PresentStage,
+	UIStage,
+	PROFILESTAGES
+};
+
+// Per-thread counters and stage times, plus an optional trace of what each thread
+// did, for chrome://tracing or Perfetto. Every thread of the job system writes only
+// its own cache line aligned slot, so counting does not contend; EndFrame sums the
+// slots up once all work of the frame is done. Threads outside the job system are
+// not tied to frames: what they count is dropped.
+class Profiler
+{
+public:
+	struct TraceEvent
+	{
+		const char* name;		// a string literal
+		double start, duration;	// microseconds since the profiler was created
+	};
+	struct FrameStats
+	{
+		uint64_t counters[PROFILECOUNTERS] = {};
+		float stageTime[PROFILESTAGES] = {};	// ms
+	};
+	Profiler();
+	void Count( const ProfileCounter counter, const uint64_t n = 1 ) { Local().counters[counter] += n; }
+	// the calling thread's count since the last EndFrame
+	uint64_t LocalCount( const ProfileCounter counter ) { return Local().counters[counter]; }
+	// microseconds since the profiler was created
+	double Now() const;
+	void AddStageTime( const ProfileStage stage, const double microseconds ) { Local().stageTime[stage] += microseconds; }
+	// record an event on the calling thread's track of the trace, if capturing
+	void AddEvent( const char* name, const double start, const double end );
+	bool Capturing() const { return captureFrames > 0; }
+	// frame boundary, call from thread 0 with no jobs running: sums up all threads into
+	// 'frame' and starts counting again; ends a capture that has recorded all its frames
+	void EndFrame();
+	// record the next 'frames' frames and write them to 'file' as Chrome trace JSON
+	void CaptureTrace( const char* file, const int frames );
+	bool SaveTrace( const char* file ) const;
+
+	FrameStats frame;	// the last frame
+	static const char* counterNames[PROFILECOUNTERS];
+	static const char* stageNames[PROFILESTAGES];
+private:
+	struct alignas(64) ThreadData
+	{
+		uint64_t counters[PROFILECOUNTERS] = {};
+		double stageTime[PROFILESTAGES] = {};	// microseconds
+		vector<TraceEvent> events;
+	};
+	struct FrameMarker
+	{
+		double start;	// counter tracks show the totals of a frame from its start
+		FrameStats stats;
+	};
+	ThreadData& Local() { return JobSystem::InPool() ? threads[JobSystem::ThreadIndex()] : dropped; }
+
+	vector<ThreadData> threads;
+	vector<FrameMarker> frameMarkers;	// frames in the capture, for the counter tracks
+	chrono::high_resolution_clock::time_point origin;
+	double frameStart = 0;
+	int captureFrames = 0;
+	string captureFile;
+	static thread_local ThreadData dropped;	// Local() for threads outside the job system
+};
+
+// the application-wide profiler, created on first use; inline, as counting is on the hot path
+inline Profiler& Profile()
+{
+	static Profiler profiler;
+	return profiler;
+}
+
+// Adds the time from construction to destruction to a stage, and to the trace
+class ProfileScope
+{
+public:
+	ProfileScope( const ProfileStage stage ) : stage( stage ), start( Profile().Now() ) {}
+	~ProfileScope()
+	{
+		Profiler& p = Profile();
+		const double end = p.Now();
+		p.AddStageTime( stage, end - start );
+		p.AddEvent( Profiler::stageNames[stage], start, end );
+	}
+private:
+	ProfileStage stage;
+	double start;
+};
+
+#if PROFILING
+#define PROFILE_COUNT( counter, n )				Profile().Count( counter, n )
+#define PROFILE_STAGE( stage )					ProfileScope profileScope( stage )
+#define PROFILE_NOW()							Profile().Now()
+#define PROFILE_STAGE_TIME( stage, microseconds )	Profile().AddStageTime( stage, microseconds )
+#define PROFILE_EVENT( name, start, end )		Profile().AddEvent( name, start, end )
+#else
+#define PROFILE_COUNT( counter, n )
+#define PROFILE_STAGE( stage )
+#define PROFILE_NOW()							0.0
+#define PROFILE_STAGE_TIME( stage, microseconds )
+#define PROFILE_EVENT( name, start, end )
+#endif
+
+} // namespace Tmpl8
@@ -3,12 +3,19 @@
 // IGAD/NHTV/BUAS/UU - Jacco Bikker - 2006-2023
 
 #include "template.h"
+#include <sys/stat.h>
+
+using namespace Tmpl8;
+
+// static member data for instruction set support class
+static const CPUCaps cpucaps;
+
+#ifndef HEADLESS
+
 #include <stb_image.h>
 
 #pragma comment( linker, "/subsystem:windows /ENTRY:mainCRTStartup" )
 
-using namespace Tmpl8;
-
 // Enable usage of dedicated GPUs in notebooks
 // Note: this does cause the linker to produce a .lib and .exp file;
 // see http://developer.download.nvidia.com/devzone/devcenter/gamegraphics/files/OptimusRenderingPolicies.pdf
@@ -34,9 +41,6 @@ bool IGP_detected = false;
 
 uint keystate[256] = { 0 };
 
-// static member data for instruction set support class
-static const CPUCaps cpucaps;
-
 // provide access to the render target, for OpenCL / OpenGL interop
 GLTexture* GetRenderTarget() { return renderTarget; }
 
@@ -334,32 +338,41 @@ void main()
 		if (frameNr++ > 1)
 		{
 			// draw template application output
-			if (app->screen) renderTarget->CopyFrom(app->screen);
+			{
+				PROFILE_STAGE( PresentStage );
+				if (app->screen) renderTarget->CopyFrom(app->screen);
 
-			shader->Bind();
-			DrawQuad();
-			shader->Unbind();
+				shader->Bind();
+				DrawQuad();
+				shader->Unbind();
+			}
 			
 			// update imgui
-			ImGui_ImplOpenGL3_NewFrame();
-			ImGui_ImplGlfw_NewFrame();
-			ImGui::NewFrame();
-			app->uiUpdated = true;
-			
-
-			app->UI(); // app->uiUpdated will be false if Render::UI() was not implemented
-			if (app->uiUpdated)
 			{
-				ImGui::Render();
-				ImGui_ImplOpenGL3_RenderDrawData( ImGui::GetDrawData() );
-				CheckGL();
-
-				int display_w, display_h;
-				glfwGetFramebufferSize( window, &display_w, &display_h );
-				glViewport( 0, 0, display_w, display_h );
+				PROFILE_STAGE( UIStage );
+				ImGui_ImplOpenGL3_NewFrame();
+				ImGui_ImplGlfw_NewFrame();
+				ImGui::NewFrame();
+				app->uiUpdated = true;
+				
+
+				app->UI(); // app->uiUpdated will be false if Render::UI() was not implemented
+				if (app->uiUpdated)
+				{
+					ImGui::Render();
+					ImGui_ImplOpenGL3_RenderDrawData( ImGui::GetDrawData() );
+					CheckGL();
+
+					int display_w, display_h;
+					glfwGetFramebufferSize( window, &display_w, &display_h );
+					glViewport( 0, 0, display_w, display_h );
+				}
 			}
 			// finalize frame
-			glfwSwapBuffers( window );
+			{
+				PROFILE_STAGE( PresentStage );
+				glfwSwapBuffers( window );
+			}
 			glfwPollEvents();
 		}
 		if (!running) break;
@@ -387,6 +400,31 @@ void main()
 	glfwTerminate();
 }
 
+void* GetRenderTargetPointer()
+{
+	return (void*)((size_t)renderTarget->ID);
+}
+
+#else
+
+// headless builds: there is no window, keyboard or render target, and the
+// application supplies its own main()
+bool WindowHasFocus() { return false; }
+bool IsKeyDown( const uint ) { return false; }
+void* GetRenderTargetPointer() { return 0; }
+
+void FatalError( const char* fmt, ... )
+{
+	va_list args;
+	va_start( args, fmt );
+	vfprintf( stderr, fmt, args );
+	va_end( args );
+	fprintf( stderr, "\n" );
+	exit( 1 );
+}
+
+#endif
+
 // Helper functions
 bool FileIsNewer( const char* file1, const char* file2 )
 {
@@ -407,11 +445,6 @@ bool FileIsNewer( const char* file1, const char* file2 )
 #endif
 }
 
-void* GetRenderTargetPointer()
-{
-	return (void*)((size_t)renderTarget->ID);
-}
-
 bool FileExists( const char* f )
 {
 	ifstream s( f );
@@ -454,6 +487,8 @@ void TextFileWrite( const string& text, const char* _File )
 	s.write( text.c_str(), len );
 }
 
+#ifndef HEADLESS
+
 /*
 
 	OpenGL loader generated by glad 0.1.35 on Fri Mar 18 11:02:23 2022.
@@ -1596,4 +1631,6 @@ int gladLoadGLLoader( GLADloadproc load ) {
 	return GLVersion.major != 0 || GLVersion.minor != 0;
 }
 
+#endif // HEADLESS
+
 // EOF
\ No newline at end of file
@@ -1,6 +1,9 @@
 // Template, IGAD version 3
 // IGAD/NHTV/UU - Jacco Bikker - 2006-2022
 
+// Define HEADLESS to build without a window: no GLFW, OpenGL, OpenCL or ImGui.
+// This is how the core library and the command line renderer are built on Linux.
+
 // C++ headers
 #include <chrono>
 #include <fstream>
@@ -8,9 +11,13 @@
 #include <list>
 #include <string>
 #include <math.h>
+#include <string.h>
+#include <stdarg.h>
 #include <algorithm>
 #include <assert.h>
+#ifdef _WIN32
 #include <io.h>
+#endif
 
 // header for AVX, and every technology before it.
 // if your CPU does not support this (unlikely), include the appropriate header instead.
@@ -77,7 +84,9 @@ using namespace std;
 #define NODEFERWINDOWPOS
 #define NOMCX
 #define NOIME
+#ifdef _WIN32
 #include "windows.h"
+#endif
 
 // aligned memory allocations
 #ifdef _MSC_VER
@@ -98,9 +107,11 @@ using namespace std;
 #endif
 
 // imgui
+#ifndef HEADLESS
 #include "imgui.h"
 #include "imgui_impl_glfw.h"
 #include "imgui_impl_opengl3.h"
+#endif
 
 // template headers
 #include "surface.h"
@@ -111,6 +122,7 @@ using namespace Tmpl8;
 // math classes
 #include "tmpl8math.h"
 
+#ifndef HEADLESS
 // OpenCL headers
 #define CL_USE_DEPRECATED_OPENCL_2_0_APIS // safe; see https://stackoverflow.com/a/28500846
 #include "cl/cl.h"
@@ -123,13 +135,16 @@ using namespace Tmpl8;
 #include <glad.h>
 #include <GLFW/glfw3.h>
 #include <GLFW/glfw3native.h>
+#endif
 
 // zlib
 #include "zlib.h"
 
 // opencl & opencl
+#ifndef HEADLESS
 #include "opencl.h"
 #include "opengl.h"
+#endif
 
 #define WINWIDTH		1440
 #define WINHEIGHT		960
@@ -169,6 +184,13 @@ string TextFileRead( const char* _File );
 int LineCount( const string s );
 void TextFileWrite( const string& text, const char* _File );
 
+// job system: the thread pool shared by all parallel work
+#include "jobsystem.h"
+// per-thread counters, stage timers and trace capture
+#include "profiler.h"
+// copy-on-write file mappings
+#include "mappedfile.h"
+
 // global project settigs; shared with OpenCL
 #include "common.h"
 
@@ -181,14 +203,16 @@ void TextFileWrite( const string& text, const char* _File );
 #include <iostream>
 #include <bitset>
 #include <array>
+#ifdef _MSC_VER
 #include <intrin.h>
+#endif
 
 // instruction set detection
 #ifdef _WIN32
 #define cpuid(info, x) __cpuidex(info, x, 0)
 #else
 #include <cpuid.h>
-void cpuid( int info[4], int InfoType ) { __cpuid_count( InfoType, 0, info[0], info[1], info[2], info[3] ); }
+inline void cpuid( int info[4], int InfoType ) { __cpuid_count( InfoType, 0, info[0], info[1], info[2], info[3] ); }
 #endif
 class CPUCaps // from https://github.com/Mysticial/FeatureDetector
 {
@@ -282,6 +306,21 @@ public:
 	}
 };
 
+// AVX2 code paths: the code between AVX2_BEGIN and AVX2_END may use AVX2, the rest of the
+// code only the baseline instruction set, and CPUCaps::HW_AVX2 decides at runtime which
+// path runs. No FMA: contracted multiply-adds would round differently from the scalar code. MSVC, and a compiler that targets AVX2 anyway, need nothing for that;
+// GCC compiles the region for AVX2 on its own. Elsewhere, or with NOAVX2, the AVX2 paths
+// are left out.
+#if !defined( NOAVX2 ) && (defined( _MSC_VER ) || defined( __AVX2__ ))
+#define AVX2_BEGIN
+#define AVX2_END
+#elif !defined( NOAVX2 ) && defined( __GNUC__ ) && !defined( __clang__ )
+#define AVX2_BEGIN _Pragma( "GCC push_options" ) _Pragma( "GCC target(\"avx2\")" )
+#define AVX2_END _Pragma( "GCC pop_options" )
+#elif !defined( NOAVX2 )
+#define NOAVX2
+#endif
+
 // helper function for conversion of f32 colors to int
 inline uint RGBF32_to_RGB8( const float3& v )
 {
@@ -329,7 +368,16 @@ public:
 
 #include "ray.h"
 #include "scene.h"
+#include "dda.h"
+#include "svo.h"
+#include "streamedworld.h"
+#include "benchmark.h"
+#include "tilescheduler.h"
+#include "levelloader.h"
+#include "levelsaver.h"
+#include "voxelmodel.h"
 #include "camera.h"
+#include "prefetcher.h"
 #include "renderer.h"
 
 // EOF
\ No newline at end of file
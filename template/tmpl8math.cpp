@@ -217,15 +217,18 @@ float3 TransformVector( const float3& a, const mat4& M )
 // Fast matrix-vector multiplication using SSE
 float3 TransformPosition_SSE( const __m128& a, const mat4& M )
 {
-	__m128 a4 = a;
-	a4.m128_f32[3] = 1;
+	ALIGN( 16 ) float p[4];
+	_mm_store_ps( p, a );
+	p[3] = 1;
+	const __m128 a4 = _mm_load_ps( p );
 	__m128 v0 = _mm_mul_ps( a4, _mm_load_ps( &M.cell[0] ) );
 	__m128 v1 = _mm_mul_ps( a4, _mm_load_ps( &M.cell[4] ) );
 	__m128 v2 = _mm_mul_ps( a4, _mm_load_ps( &M.cell[8] ) );
 	__m128 v3 = _mm_mul_ps( a4, _mm_load_ps( &M.cell[12] ) );
 	_MM_TRANSPOSE4_PS( v0, v1, v2, v3 );
-	__m128 v = _mm_add_ps( _mm_add_ps( v0, v1 ), _mm_add_ps( v2, v3 ) );
-	return float3( v.m128_f32[0], v.m128_f32[1], v.m128_f32[2] );
+	ALIGN( 16 ) float v[4];
+	_mm_store_ps( v, _mm_add_ps( _mm_add_ps( v0, v1 ), _mm_add_ps( v2, v3 ) ) );
+	return float3( v[0], v[1], v[2] );
 }
 float3 TransformVector_SSE( const __m128& a, const mat4& M )
 {
@@ -234,6 +237,7 @@ float3 TransformVector_SSE( const __m128& a, const mat4& M )
 	__m128 v2 = _mm_mul_ps( a, _mm_load_ps( &M.cell[8] ) );
 	__m128 v3 = _mm_mul_ps( a, _mm_load_ps( &M.cell[12] ) );
 	_MM_TRANSPOSE4_PS( v0, v1, v2, v3 );
-	__m128 v = _mm_add_ps( _mm_add_ps( v0, v1 ), v2 );
-	return float3( v.m128_f32[0], v.m128_f32[1], v.m128_f32[2] );
+	ALIGN( 16 ) float v[4];
+	_mm_store_ps( v, _mm_add_ps( _mm_add_ps( v0, v1 ), v2 ) );
+	return float3( v[0], v[1], v[2] );
 }
\ No newline at end of file
@@ -0,0 +1,86 @@
+#include "template.h"
+
+// spread the lower 16 bits of v out to the even bits, for the Morton order of tiles
+static uint part1by1( uint v )
+{
+	v &= 0xffff;
+	v = (v | (v << 8)) & 0x00ff00ff;
+	v = (v | (v << 4)) & 0x0f0f0f0f;
+	v = (v | (v << 2)) & 0x33333333;
+	v = (v | (v << 1)) & 0x55555555;
+	return v;
+}
+
+void TileScheduler::BuildTileOrder( const int w, const int h )
+{
+	if (w == orderWidth && h == orderHeight) return;
+	const uint tilesX = (w + TILESIZE - 1) / TILESIZE, tilesY = (h + TILESIZE - 1) / TILESIZE;
+	vector<pair<uint, uint>> keyed;
+	for (uint y = 0; y < tilesY; y++) for (uint x = 0; x < tilesX; x++)
+		keyed.push_back( make_pair( part1by1( x ) | (part1by1( y ) << 1), x | (y << 16) ) );
+	sort( keyed.begin(), keyed.end() );
+	tileOrder.clear();
+	for (const auto& k : keyed) tileOrder.push_back( k.second );
+	orderWidth = w, orderHeight = h;
+}
+
+void TileScheduler::Render( const int w, const int h, const TileJob& tileJob )
+{
+	BuildTileOrder( w, h );
+	// deal the Morton sequence out in contiguous runs, one per job, so each starts with a compact region
+	const uint n = (uint)tileOrder.size(), threads = ThreadCount();
+	if (queues.size() != threads) queues.resize( threads );
+	for (uint i = 0; i < threads; i++)
+		queues[i].tiles.assign( tileOrder.begin() + (size_t)n * i / threads, tileOrder.begin() + (size_t)n * (i + 1) / threads );
+	width = w, height = h, job = &tileJob, steals = 0;
+	JobCounter group;
+	for (uint i = 1; i < threads; i++) Jobs().Run( [this, i] { RunTiles( i ); }, &group );
+	RunTiles( 0 );
+	// a job only leaves RunTiles when all deques are empty, so once they have all
+	// returned, every tile has been rendered
+	Jobs().Wait( group );
+	job = 0;
+	stolenTiles = steals;
+}
+
+void TileScheduler::RunTiles( const uint index )
+{
+	uint tile, stolen = 0;
+	while (1)
+	{
+		if (!PopTile( index, tile ))
+		{
+			if (!StealTile( index, tile )) break;
+			stolen++;
+		}
+		const int x0 = (tile & 0xffff) * TILESIZE, y0 = (tile >> 16) * TILESIZE;
+		(*job)( x0, y0, min( x0 + TILESIZE, width ), min( y0 + TILESIZE, height ) );
+	}
+	if (stolen) AtomicAdd( steals, stolen );
+}
+
+bool TileScheduler::PopTile( const uint index, uint& tile )
+{
+	WorkQueue& q = queues[index];
+	lock_guard<mutex> l( q.lock );
+	if (q.tiles.empty()) return false;
+	tile = q.tiles.front();
+	q.tiles.pop_front();
+	return true;
+}
+
+bool TileScheduler::StealTile( const uint index, uint& tile )
+{
+	// take from the far end of the victim's run, away from where its owner is working
+	const uint threads = ThreadCount();
+	for (uint i = 1; i < threads; i++)
+	{
+		WorkQueue& q = queues[(index + i) % threads];
+		lock_guard<mutex> l( q.lock );
+		if (q.tiles.empty()) continue;
+		tile = q.tiles.back();
+		q.tiles.pop_back();
+		return true;
+	}
+	return false;
+}
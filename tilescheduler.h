@@ -0,0 +1,44 @@
+#pragma once
+
+#define TILESIZE	16		// pixels per tile side; a multiple of MAXPACKETSIZE
+
+namespace Tmpl8 {
+
+// Renders the screen in square tiles on the threads of the job system.
+// Tiles are visited in Morton order, so consecutive tiles are close on screen and
+// in the world; the sequence is dealt out in contiguous runs, one per thread.
+// Each thread works through its own deque from the front, and a thread that runs
+// dry steals from the back of another thread's deque, so a run of expensive tiles
+// is shared out while the cheap sky tiles finish early.
+// The calling thread takes part, and Render returns when every tile is done.
+class TileScheduler
+{
+public:
+	// x0, y0 inclusive; x1, y1 exclusive
+	typedef function<void( const int x0, const int y0, const int x1, const int y1 )> TileJob;
+
+	void Render( const int width, const int height, const TileJob& job );
+	uint ThreadCount() const { return Jobs().ThreadCount(); }
+
+	uint stolenTiles = 0;	// statistics for the last Render
+private:
+	struct WorkQueue
+	{
+		mutex lock;
+		deque<uint> tiles;	// tile x in the low 16 bits, tile y in the high 16 bits
+	};
+	void BuildTileOrder( const int width, const int height );
+	void RunTiles( const uint index );
+	bool PopTile( const uint index, uint& tile );
+	bool StealTile( const uint index, uint& tile );
+
+	vector<uint> tileOrder;		// all tiles in Morton order
+	int orderWidth = 0, orderHeight = 0;
+	deque<WorkQueue> queues;	// one per job; a deque because WorkQueue can not be moved
+
+	int width = 0, height = 0;
+	const TileJob* job = 0;
+	uint steals = 0;
+};
+
+} // namespace Tmpl8
@@ -0,0 +1,187 @@
+#include "template.h"
+
+#define MAXMODELSIZE	4096	// voxels per axis; keeps a slice of colours within the reach of gzread
+
+// the MagicaVoxel palette for .vox files without an RGBA chunk: a 6x6x6 colour cube
+// without black, then ramps of red, green, blue and grey
+static vector<uint> DefaultVoxPalette()
+{
+	static const uint cube[6] = { 0xff, 0xcc, 0x99, 0x66, 0x33, 0x00 };
+	static const uint ramp[10] = { 0xee, 0xdd, 0xbb, 0xaa, 0x88, 0x77, 0x55, 0x44, 0x22, 0x11 };
+	vector<uint> palette( 1, 0 );
+	for (int r = 0; r < 6; r++) for (int g = 0; g < 6; g++) for (int b = 0; b < 6; b++)
+		if (r < 5 || g < 5 || b < 5) palette.push_back( (cube[r] << 16) + (cube[g] << 8) + cube[b] );
+	for (int shift = 16; shift >= 0; shift -= 8) for (int i = 0; i < 10; i++) palette.push_back( ramp[i] << shift );
+	for (int i = 0; i < 10; i++) palette.push_back( ramp[i] * 0x10101 );
+	return palette;
+}
+
+static bool LoadSprite( const char* file, VoxelModel& model )
+{
+	// decompressed a slice at a time, so only one slice of 32-bit colours is in memory
+	gzFile f = gzopen( file, "rb" );
+	if (!f) return false;
+	uint size[3];
+	bool success = gzread( f, size, sizeof( size ) ) == sizeof( size );
+	for (int i = 0; i < 3; i++) success = success && size[i] > 0 && size[i] <= MAXMODELSIZE;
+	success = success && (uint64_t)size[0] * size[1] * size[2] <= 0x80000000ull;
+	if (success)
+	{
+		model.size = make_uint3( size[0], size[1], size[2] );
+		const uint sliceSize = size[0] * size[1];
+		model.voxels.resize( (size_t)sliceSize * size[2] );
+		model.palette.assign( 1, 0 );
+		map<uint, unsigned short> index; // colour to palette index
+		vector<uint> slice( sliceSize );
+		for (uint z = 0; z < size[2] && success; z++)
+		{
+			success = gzread( f, slice.data(), sliceSize * sizeof( uint ) ) == (int)(sliceSize * sizeof( uint ));
+			unsigned short* voxel = model.voxels.data() + (size_t)z * sliceSize;
+			for (uint i = 0; i < sliceSize && success; i++)
+			{
+				voxel[i] = 0;
+				if (!slice[i]) continue;
+				const uint colour = slice[i] & 0xffffff;
+				auto known = index.find( colour );
+				if (known != index.end()) { voxel[i] = known->second; continue; }
+				if (model.palette.size() > 0xffff) { printf( "Too many colours in %s\n", file ); success = false; break; }
+				voxel[i] = index[colour] = (unsigned short)model.palette.size();
+				model.palette.push_back( colour );
+			}
+		}
+	}
+	gzclose( f );
+	return success;
+}
+
+static bool LoadVox( const char* file, VoxelModel& model )
+{
+	// "VOX ", the version, then the MAIN chunk; its children are SIZE, XYZI, RGBA and
+	// scene graph chunks. A chunk: id, content bytes, children bytes, content, children.
+	FILE* f = fopen( file, "rb" );
+	if (!f) return false;
+	fseek( f, 0, SEEK_END );
+	const long bytes = ftell( f );
+	fseek( f, 0, SEEK_SET );
+	vector<uchar> data( bytes > 0 ? bytes : 0 );
+	const bool read = fread( data.data(), 1, data.size(), f ) == data.size();
+	fclose( f );
+	if (!read || data.size() < 20 || memcmp( data.data(), "VOX ", 4 ) || memcmp( data.data() + 8, "MAIN", 4 )) return false;
+	const uchar* p = data.data() + 8, *end = data.data() + data.size();
+	uint chunk[3];
+	memcpy( chunk, p, 12 );
+	if (chunk[1] > (size_t)(end - p - 12)) return false;
+	p += 12 + chunk[1];
+	uint size[3] = {}, count = 0;
+	const uchar* xyzi = 0;
+	bool hasSize = false;
+	model.palette = DefaultVoxPalette();
+	while (end - p >= 12)
+	{
+		memcpy( chunk, p, 12 );
+		const uchar* content = p + 12;
+		if (chunk[1] > (size_t)(end - content) || chunk[2] > (size_t)(end - content) - chunk[1]) return false;
+		if (!memcmp( p, "SIZE", 4 ) && !hasSize && chunk[1] >= 12) memcpy( size, content, 12 ), hasSize = true;
+		else if (!memcmp( p, "XYZI", 4 ) && hasSize && !xyzi && chunk[1] >= 4)
+		{
+			// the first model only
+			memcpy( &count, content, 4 );
+			if (count > (chunk[1] - 4) / 4) return false;
+			xyzi = content + 4;
+		}
+		else if (!memcmp( p, "RGBA", 4 ) && chunk[1] >= 1024)
+		{
+			// entry i is the colour of index i + 1
+			for (int i = 0; i < 255; i++)
+				model.palette[i + 1] = (content[i * 4] << 16) + (content[i * 4 + 1] << 8) + content[i * 4 + 2];
+		}
+		p = content + chunk[1] + chunk[2];
+	}
+	if (!xyzi) return false;
+	for (int i = 0; i < 3; i++) if (size[i] == 0 || size[i] > 256) return false;
+	// z up in MagicaVoxel: its y axis becomes our z axis
+	model.size = make_uint3( size[0], size[2], size[1] );
+	model.voxels.assign( (size_t)size[0] * size[1] * size[2], 0 );
+	for (uint i = 0; i < count; i++, xyzi += 4)
+	{
+		const uint x = xyzi[0], y = xyzi[1], z = xyzi[2];
+		if (x < size[0] && y < size[1] && z < size[2]) model.voxels[x + z * size[0] + y * size[0] * size[2]] = xyzi[3];
+	}
+	return true;
+}
+
+bool Tmpl8::LoadVoxelModel( const char* file, VoxelModel& model )
+{
+	char magic[4] = {};
+	FILE* f = fopen( file, "rb" );
+	if (!f)
+	{
+		printf( "Could not open %s\n", file );
+		return false;
+	}
+	const bool vox = fread( magic, 1, 4, f ) == 4 && !memcmp( magic, "VOX ", 4 );
+	fclose( f );
+	const bool success = vox ? LoadVox( file, model ) : LoadSprite( file, model );
+	if (!success) printf( "Failed to load the voxel model %s\n", file );
+	return success;
+}
+
+int Tmpl8::ImportVoxelModel( Scene& scene, const VoxelModel& model, const int3& offset, const int quarterTurns )
+{
+	if (!scene.HasGrid()) return 0; // octree levels are static
+	// a material for every colour that is used
+	vector<uchar> used( model.palette.size(), 0 );
+	for (const unsigned short v : model.voxels) used[v] = 1;
+	vector<unsigned short> keys( model.palette.size(), NOMATERIALKEY );
+	map<unsigned short, Material>& materials = scene.GetMaterials();
+	uint nextKey = NOMATERIALKEY + 1;
+	for (size_t i = 1; i < model.palette.size(); i++) if (used[i])
+	{
+		const uint c = model.palette[i];
+		const float3 albedo = make_float3( (float)(c >> 16), (float)((c >> 8) & 255), (float)(c & 255) ) * (1.0f / 255);
+		for (const auto& m : materials) if (m.first != NOMATERIALKEY && m.second.albedo.x == albedo.x && m.second.albedo.y == albedo.y && m.second.albedo.z == albedo.z) { keys[i] = m.first; break; }
+		if (keys[i] != NOMATERIALKEY) continue;
+		while (nextKey <= 0xffff && materials.count( (unsigned short)nextKey )) nextKey++;
+		if (nextKey > 0xffff)
+		{
+			printf( "No material keys left for the model\n" );
+			return -1;
+		}
+		keys[i] = (unsigned short)nextKey;
+		materials[keys[i]] = Material( albedo, 0.0f, 1.0f );
+		scene.MaterialsChanged();
+	}
+
+	// place the voxels on all threads, a slice of the model per job
+	const uint3 s = model.size;
+	const int turns = quarterTurns & 3;
+	uint placed = 0;
+	scene.BeginBulkEdit();
+	Jobs().ParallelFor( 0, (int)s.z, [&]( int z )
+	{
+		uint count = 0;
+		const unsigned short* voxel = model.voxels.data() + (size_t)z * s.x * s.y;
+		for (int y = 0; y < (int)s.y; y++) for (int x = 0; x < (int)s.x; x++, voxel++)
+		{
+			if (!*voxel) continue;
+			// a quarter turn takes (x, z) to (z, -x); the turned model starts at 0 again
+			int tx = x, tz = z;
+			if (turns == 1) tx = z, tz = s.x - 1 - x;
+			else if (turns == 2) tx = s.x - 1 - x, tz = s.z - 1 - z;
+			else if (turns == 3) tx = s.z - 1 - z, tz = x;
+			const int wx = offset.x + tx, wy = offset.y + y, wz = offset.z + tz;
+			if (wx < 0 || wy < 0 || wz < 0 || wx >= (int)scene.size.x || wy >= (int)scene.size.y || wz >= (int)scene.size.z) continue;
+			scene.SetMaterial( wx, wy, wz, keys[*voxel] );
+			count++;
+		}
+		if (count) AtomicAdd( placed, count );
+	} );
+	scene.EndBulkEdit();
+	return (int)placed;
+}
+
+bool Tmpl8::ImportVoxelModel( Scene& scene, const char* file, const int3& offset, const int quarterTurns )
+{
+	VoxelModel model;
+	return LoadVoxelModel( file, model ) && ImportVoxelModel( scene, model, offset, quarterTurns ) >= 0;
+}
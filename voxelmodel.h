@@ -0,0 +1,28 @@
+#pragma once
+
+namespace Tmpl8 {
+
+// A voxel model, loaded from the gzip compressed sprites in assets/*.bin or from a
+// MagicaVoxel .vox file, to be placed in a scene with ImportVoxelModel.
+// Sprite files hold three uints for the size, then a 0x00RRGGBB colour per voxel,
+// x fastest, y up, 0 for empty. Of a .vox file the first model is used; its z-up
+// coordinates are turned into y-up ones.
+struct VoxelModel
+{
+	uint3 size;						// y up
+	vector<unsigned short> voxels;	// palette indices, x fastest; 0 is empty
+	vector<uint> palette;			// 0x00RRGGBB per index; palette[0] is unused
+};
+
+bool LoadVoxelModel( const char* file, VoxelModel& model );
+
+// Place a model in the scene: turned 'quarterTurns' times 90 degrees about the y axis,
+// with the lowest corner of the turned model at 'offset'. Voxels outside the world
+// are left out, empty ones leave the grid as it is. Every palette colour becomes a
+// diffuse material: one with the same albedo if the scene has it, otherwise a new one.
+// Returns the number of voxels placed, or -1 if the model did not fit in the materials.
+int ImportVoxelModel( Scene& scene, const VoxelModel& model, const int3& offset, const int quarterTurns = 0 );
+// load and place; false if the file could not be loaded
+bool ImportVoxelModel( Scene& scene, const char* file, const int3& offset, const int quarterTurns = 0 );
+
+} // namespace Tmpl8
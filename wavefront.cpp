@@ -0,0 +1,189 @@
+#include "template.h"
+
+// Wavefront path tracing: the same light transport as Renderer::Trace, but instead
+// of following one pixel's path to the end, every stage runs over all rays at once.
+// Primary rays are extended in one batch; shading turns the hits into a queue of
+// shadow rays and a queue of bounce rays, which are traced in their own batches.
+// Each stage is a separate loop over a compact queue, so it can be timed, and
+// optimized, on its own.
+
+void Renderer::TraceWavefront()
+{
+	Timer t;
+	float extend = 0, shade = 0, shadow = 0;
+	GeneratePrimaryRays();
+	for (int rayStep = 0; paths.count > 0; rayStep++)
+	{
+		t.reset();
+		ExtendPaths(rayStep);
+		extend += t.elapsed();
+		t.reset();
+		ShadePaths(rayStep);
+		shade += t.elapsed();
+		t.reset();
+		TraceShadowRays();
+		shadow += t.elapsed();
+		swap(paths, bounces);
+	}
+	t.reset();
+	WriteFrame();
+	stageTime[0] = extend * 1000, stageTime[1] = shade * 1000, stageTime[2] = shadow * 1000, stageTime[3] = t.elapsed() * 1000;
+}
+
+void Renderer::GeneratePrimaryRays()
+{
+	// one path per pixel, in scanline order so neighbouring rays are coherent
+	paths.Reset(RENDERWIDTH * RENDERHEIGHT);
+	frameColor.resize(RENDERWIDTH * RENDERHEIGHT);
+	Jobs().ParallelFor(0, RENDERHEIGHT, [&](int y)
+	{
+		PROFILE_STAGE(PrimaryTraceStage);
+		for (int x = 0; x < RENDERWIDTH; x++)
+		{
+			const uint pixel = x + y * RENDERWIDTH;
+			paths.rays[pixel] = camera.GetPrimaryRay( (float)x, (float)y );
+			paths.weights[pixel] = float3(1.0f);
+			paths.pixels[pixel] = pixel;
+			frameColor[pixel] = float3(0.0f);
+		}
+	});
+	paths.count = RENDERWIDTH * RENDERHEIGHT;
+}
+
+void Renderer::ExtendPaths(const int rayStep)
+{
+	// accounting for the statistics
+	Profile().Count(rayStep == 0 ? PrimaryRays : BounceRays, paths.count);
+
+	const int count = (int)paths.count;
+	const ProfileStage stage = rayStep == 0 ? PrimaryTraceStage : ShadingStage;
+	if (rayStep == 0 && packetTracing)
+	{
+		// primary rays are still in scanline order: traverse them as packets
+		Jobs().ParallelFor(0, (count + MAXPACKETSIZE - 1) / MAXPACKETSIZE, 32, [&](int from, int to)
+		{
+			PROFILE_STAGE(stage);
+			for (int packet = from; packet < to; packet++)
+			{
+				const int i = packet * MAXPACKETSIZE;
+				scene.FindNearest( &paths.rays[i], min( (uint)(count - i), (uint)MAXPACKETSIZE ) );
+			}
+		});
+	}
+	else
+	{
+		Jobs().ParallelFor(0, count, 256, [&](int from, int to)
+		{
+			PROFILE_STAGE(stage);
+			for (int i = from; i < to; i++) scene.FindNearest( paths.rays[i] );
+		});
+	}
+}
+
+void Renderer::ShadePaths(const int rayStep)
+{
+	// every path is a different pixel, so the frame can be written without atomics
+	const vector<Light>& lights = scene.GetLights();
+	// a shadow ray per light that may reach a hit, see LightGrid; counted first, so the
+	// queue is not sized for every light at every hit
+	uint shadowCount = 0;
+	Jobs().ParallelFor(0, (int)paths.count, 256, [&](int from, int to)
+	{
+		uint count = 0;
+		for (int i = from; i < to; i++)
+		{
+			const Ray& ray = paths.rays[i];
+			if (ray.voxelKey != NOMATERIALKEY && ray.t >= 0) count += (uint)scene.LightsNear(ray.IntersectionPoint()).size();
+		}
+		AtomicAdd(shadowCount, count);
+	});
+	shadows.Reset(shadowCount);
+	bounces.Reset(rayStep < MAXRAYSTEPS ? paths.count : 0);
+	Jobs().ParallelFor(0, (int)paths.count, 256, [&](int from, int to)
+	{
+		PROFILE_STAGE(ShadingStage);
+		// the materials of the paths are gathered a batch at a time; misses read the default material
+		uint keys[MATERIALBATCH];
+		MaterialBatch batch;
+		for (int i = from; i < to; i++)
+		{
+			const uint lane = (uint)(i - from) % MATERIALBATCH;
+			if (lane == 0)
+			{
+				const uint n = min((uint)(to - i), (uint)MATERIALBATCH);
+				for (uint j = 0; j < n; j++) keys[j] = paths.rays[i + j].voxelKey;
+				scene.GetMaterialTable().Gather(keys, n, batch);
+			}
+			Ray& ray = paths.rays[i];
+			const float3 throughput = paths.weights[i];
+			const uint pixel = paths.pixels[i];
+
+			// Didn't find any voxel, or it is behind the screen
+			if (ray.voxelKey == NOMATERIALKEY || ray.t < 0)
+			{
+				frameColor[pixel] += throughput * GetSkyColor(ray);
+				continue;
+			}
+
+			float3 N = normalize(ray.GetNormal());
+			float3 I = ray.IntersectionPoint();
+
+			const float metallic = batch.metallic[lane], roughness = batch.roughness[lane];
+			float3 albedo = lerp(float3(batch.albedoR[lane], batch.albedoG[lane], batch.albedoB[lane]), float3(0.0), metallic);
+
+			// direct light: a path that continues keeps 0.8 of it, see Renderer::Shade
+			const float3 directWeight = throughput * albedo * (rayStep < MAXRAYSTEPS ? 0.8f : 1.0f);
+			const vector<uint>& nearLights = scene.LightsNear(I);
+			PROFILE_COUNT(LightEvaluations, nearLights.size());
+			for (const uint l : nearLights)
+			{
+				Ray shadowRay;
+				float3 contribution;
+				if (scene.PrepareShadowRay(lights[l], I, N, shadowRay, contribution)) shadows.Push(shadowRay, directWeight * contribution, pixel);
+			}
+
+			if (rayStep >= MAXRAYSTEPS) continue;
+
+			// reflect
+			float3 newDirection = 2 * dot(-normalize(ray.D), N) * N + ray.D;
+			float3 randomDirection = float3(RandomFloat() - 0.5f, RandomFloat() - 0.5f, RandomFloat() - 0.5f);
+			newDirection += roughness * randomDirection;
+			float3 origin = I + newDirection * 0.0001f;
+
+			bounces.Push(Ray(origin, newDirection), throughput * 0.2f, pixel);
+		}
+	});
+}
+
+void Renderer::TraceShadowRays()
+{
+	Profile().Count(ShadowRays, shadows.count);
+	// several lights may light the same pixel
+	Jobs().ParallelFor(0, (int)shadows.count, 256, [&](int from, int to)
+	{
+		PROFILE_STAGE(ShadingStage);
+		for (int i = from; i < to; i++)
+		{
+			if (scene.IsOccluded(shadows.rays[i])) continue;
+			float3& color = frameColor[shadows.pixels[i]];
+			const float3 contribution = shadows.weights[i];
+			AtomicAdd(color.x, contribution.x);
+			AtomicAdd(color.y, contribution.y);
+			AtomicAdd(color.z, contribution.z);
+		}
+	});
+}
+
+void Renderer::WriteFrame()
+{
+	Jobs().ParallelFor(0, RENDERHEIGHT, [&](int y)
+	{
+		PROFILE_STAGE(ShadingStage);
+		for (int x = 0; x < RENDERWIDTH; x++)
+		{
+			const uint pixel = x + y * RENDERWIDTH;
+			float3 color = lerp(frameColor[pixel], RGB8_to_RGBF32(screen->pixels[pixel]), imageAccumulationIndex);
+			screen->pixels[pixel] = RGBF32_to_RGB8( color );
+		}
+	});
+}